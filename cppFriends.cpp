@@ -1,31 +1,153 @@
 #include <cctype>
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
 #include <iomanip>
 #include <iostream>
+#include <limits>
+#include <mutex>
+#include <new>
 #include <random>
 #include <sstream>
 #include <unordered_map>
 #include <string>
+#include <thread>
 #include <type_traits>
 #include <vector>
 #include <boost/algorithm/string.hpp>
 #include <boost/archive/text_oarchive.hpp>
 #include <boost/archive/text_iarchive.hpp>
+#include <boost/filesystem.hpp>
 #include <boost/io/ios_state.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/type_traits/function_traits.hpp>
+#include <boost/utility/string_ref.hpp>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <cpuid.h>
+#define CPPFRIENDS_X86_RAND
+#endif
+#if !defined(__MINGW32__) && !defined(__MINGW64__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 #include <gtest/gtest.h>
 #include "cFriendsCommon.h"
 #include "cppFriends.hpp"
 
 namespace {
+    // boost::trimと同様に、Cロケールの空白を取り除く
+    bool IsTrimmedSpace(char c) {
+        return (c == ' ') || (c == '\t') || (c == '\v') || (c == '\f');
+    }
+
+    // pからCRかLFを探す。なければpEndを返す。
+    const char* FindLineBreak(const char* p, const char* pEnd) {
+#if defined(__SSE2__)
+        const __m128i cr = _mm_set1_epi8('\r');
+        const __m128i lf = _mm_set1_epi8('\n');
+        while((pEnd - p) >= 16) {
+            const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            const int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, cr), _mm_cmpeq_epi8(chunk, lf)));
+            if (mask) {
+                return p + __builtin_ctz(static_cast<unsigned int>(mask));
+            }
+            p += 16;
+        }
+#endif
+        while((p < pEnd) && (*p != '\r') && (*p != '\n')) {
+            ++p;
+        }
+        return p;
+    }
+
+    // pos以降のCRLF, CR, LFを空白にして、後ろの空白を取り除く
+    // 改行がなければpos以降を一回走査するだけで、書き換えるのは改行より後ろだけである
+    void ExpandAndTrimRight(std::string& str, size_t pos) {
+        if (str.size() <= pos) {
+            return;
+        }
+
+        char* const pBegin = &str[0];
+        const char* pSrc = pBegin + pos;
+        const char* const pEnd = pBegin + str.size();
+        char* pDst = pBegin + pos;
+        while(pSrc < pEnd) {
+            const char* pBreak = FindLineBreak(pSrc, pEnd);
+            const auto length = static_cast<size_t>(pBreak - pSrc);
+            if (pDst != pSrc) {
+                // CRLFを一文字にした分だけ前に詰める
+                std::memmove(pDst, pSrc, length);
+            }
+            pDst += length;
+            pSrc = pBreak;
+            if (pSrc == pEnd) {
+                break;
+            }
+
+            // 書く前に読む。pDstとpSrcは同じ位置かもしれない。
+            const bool crlf = (*pSrc == '\r') && ((pSrc + 1) < pEnd) && (pSrc[1] == '\n');
+            pSrc += crlf ? 2 : 1;
+            *pDst++ = ' ';
+        }
+
+        char* pLast = pDst;
+        while((pLast > pBegin) && IsTrimmedSpace(pLast[-1])) {
+            --pLast;
+        }
+        str.erase(static_cast<size_t>(pLast - pBegin));
+        return;
+    }
+
+    // CRLF, CR, LFを空白にして、前後の空白を取り除く
     void TrimAndExpand(std::string& str) {
-        boost::replace_all(str, "\r\n", " ");
-        boost::replace_all(str, "\r", " ");
-        boost::replace_all(str, "\n", " ");
-        boost::trim(str);
+        ExpandAndTrimRight(str, 0);
+        const auto first = std::find_if_not(str.begin(), str.end(), IsTrimmedSpace);
+        str.erase(str.begin(), first);
         return;
     }
+
+    // pから改行を探す。なければpEndを返す。
+    const char* FindNewline(const char* p, const char* pEnd) {
+#if defined(__SSE2__)
+        // 16バイトずつ比べる
+        const __m128i newline = _mm_set1_epi8('\n');
+        while((pEnd - p) >= 16) {
+            const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            const int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline));
+            if (mask) {
+                return p + __builtin_ctz(static_cast<unsigned int>(mask));
+            }
+            p += 16;
+        }
+#endif
+        const void* pFound = std::memchr(p, '\n', static_cast<size_t>(pEnd - p));
+        return pFound ? static_cast<const char*>(pFound) : pEnd;
+    }
+
+    size_t CountNewlines(const char* p, const char* pEnd) {
+        size_t count = 0;
+#if defined(__SSE2__)
+        const __m128i newline = _mm_set1_epi8('\n');
+        while((pEnd - p) >= 16) {
+            const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            const int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline));
+            count += static_cast<size_t>(__builtin_popcount(static_cast<unsigned int>(mask)));
+            p += 16;
+        }
+#endif
+        return count + static_cast<size_t>(std::count(p, pEnd, '\n'));
+    }
 }
 
 class Train {
@@ -35,11 +157,24 @@ class Train {
     friend boost::serialization::access;
 
     // +演算子は列車を連結できるフレンズなんだね
+    // operator >>などで読んだ名前は正規化していないので、連結した名前を正規化する
     friend Train operator +(const Train& left, const Train& right) {
-        Train train(left.name_ + "-" + right.name_, left.type_);
+        Train train;
+        train.name_.reserve(left.name_.size() + 1 + right.name_.size());
+        train.name_.append(left.name_);
+        train.normalized_ = left.normalized_;
+        train.type_ = left.type_;
+        train += right;
         return train;
     }
 
+    // 一時オブジェクトの名前の後ろに足すので、a + b + c + ...と連結を繰り返しても
+    // 名前の領域を確保し直さず、償却O(1)で伸ばせる
+    friend Train operator +(Train&& left, const Train& right) {
+        left += right;
+        return std::move(left);
+    }
+
     // std::swapはメンバ変数を一括置換できるフレンズなんだね。おもしろーい！
     template<typename T>
     friend void std::swap(T& a, T& b);
@@ -47,30 +182,85 @@ class Train {
     // ユニットテストはprivateメンバを読めるフレンズなんだね。たーのしー!
     FRIEND_TEST(TestSerialization, Initialize);
     FRIEND_TEST(TestSerialization, Concatenate);
+    FRIEND_TEST(TestSerialization, ConcatenateChain);
+    FRIEND_TEST(TestSerialization, ConcatenateLinear);
     FRIEND_TEST(TestSerialization, ToString);
+    FRIEND_TEST(TestSerialization, ToStringBuffer);
+    FRIEND_TEST(TestSerialization, ToStringThroughput);
     FRIEND_TEST(TestSerialization, Std);
     FRIEND_TEST(TestSerialization, Boost);
     FRIEND_TEST(TestSerialization, StdInvalid);
     FRIEND_TEST(TestSerialization, BoostInvalidOut);
     FRIEND_TEST(TestSerialization, BoostInvalidIn);
+    FRIEND_TEST(TestSerialization, Binary);
+    FRIEND_TEST(TestSerialization, BinaryInvalid);
+    FRIEND_TEST(TestSerialization, BinaryThroughput);
+    FRIEND_TEST(TestSerialization, Store);
+    FRIEND_TEST(TestSerialization, StoreInvalid);
+    FRIEND_TEST(TestSerialization, BatchParse);
+    FRIEND_TEST(TestSerialization, BatchParseThroughput);
+
+    // 君はバイナリ形式で大量の列車を読み書きできるフレンズなんだね
+    friend class TrainBinaryWriter;
+    friend class TrainBinaryReader;
+    friend class TrainStore;
+    friend class TrainTextParser;
 
 public:
     // 君ははまなす廃止後、定期運行されている急行がないと知っているフレンズなんだね
     enum class Type { Local, Rapid, Limited_Express };
     Train(void) = default;
-    Train(const std::string& name, Type type) : name_(name), type_(type) {
+    Train(const std::string& name, Type type) : name_(name), type_(type), normalized_(true) {
         TrimAndExpand(name_);
     }
 
     virtual ~Train(void) = default;  // {}ではない
 
+    // 正規化済みの名前の後ろに'-'で足すので、CRLFが継ぎ目をまたぐことはない
+    // 足した部分だけを正規化して、連結済みの部分は走査し直さない
+    Train& operator +=(const Train& right) {
+        if (!normalized_) {
+            TrimAndExpand(name_);
+            normalized_ = true;
+        }
+        const size_t joint = name_.size();
+        name_.append(1, '-').append(right.name_);
+        ExpandAndTrimRight(name_, joint);
+        return *this;
+    }
+
+    // 長さを先に求めて、一回だけ領域を確保する
     std::string ToString(void) const {
-        std::string str;
-        auto i = std::find_if(descriptions_.begin(), descriptions_.end(),
-                              [=](auto& s) { return (s.first == type_); });
-        std::string desc = (i != descriptions_.end()) ? i->second : "??";
-        str = name_ + "は" + desc + "で走る列車なんだね";
-        return str;
+        return toString<std::string>();
+    }
+
+    // bufferに書く。snprintfと同様に、書くべき文字数(終端文字を除く)を返し、
+    // 収まらなければsize-1文字まで書いて終端する。
+    size_t ToString(char* buffer, size_t size) const {
+        const auto& desc = getDescription(type_);
+        const std::pair<const char*, size_t> pieces[] {
+            {name_.data(), name_.size()},
+            {"は", sizeof("は") - 1},
+            {desc.text, desc.size},
+            {"で走る列車なんだね", sizeof("で走る列車なんだね") - 1}};
+
+        size_t length = 0;
+        for(auto& piece : pieces) {
+            length += piece.second;
+        }
+        if (!size) {
+            return length;
+        }
+
+        char* p = buffer;
+        char* pEnd = buffer + size - 1;
+        for(auto& piece : pieces) {
+            const auto n = std::min(piece.second, static_cast<size_t>(pEnd - p));
+            std::memcpy(p, piece.first, n);
+            p += n;
+        }
+        *p = '\0';
+        return length;
     }
 
     // GCC 6.3.0ではprivate, protectedにするとエラーになる
@@ -92,12 +282,21 @@ private:
 
     // 例外は、返り値が得られないことを教えてくれるフレンズなんだね
     // boost::optionalという手もありますけど
+    // 種別は説明の表の添え字である
+    static bool isValidType(std::underlying_type<Type>::type type) {
+        return (type >= 0) && (static_cast<size_t>(type) < SizeOfTypes);
+    }
+
+    // ToString(void)の本体。ユニットテストはアロケータを指定して、確保する回数を数える。
+    template <typename String>
+    String toString(void) const {
+        String str(ToString(nullptr, 0), '\0');
+        ToString(&str[0], str.size() + 1);
+        return str;
+    }
+
     static Type toType(std::underlying_type<Type>::type type) {
-        if (std::none_of(
-                descriptions_.begin(), descriptions_.end(),
-                [=](auto& s) {
-                    return (static_cast<decltype(type)>(s.first) == type);
-                })) {
+        if (!isValidType(type)) {
             std::string message = "Invalid number "
                 + boost::lexical_cast<decltype(message)>(type);
 
@@ -111,6 +310,8 @@ private:
     void serialize(T& archive, const unsigned int version) {
         auto original = *this;
         archive & name_;
+        // 読んだ名前は正規化していない
+        normalized_ = normalized_ && !T::is_loading::value;
 
         try {
             // すごーい! Boost Serializationはenumをキャストなしで読み書きできるフレンズなんだね
@@ -131,14 +332,37 @@ private:
     // メンバがすべてmove assignableかつmove constructibleだから、このクラスはswappable
     std::string name_;
     Type type_ {Type::Local};
+    // name_を正規化したかどうか。読んだ名前は正規化していない。
+    bool normalized_ {false};
+
     // 種別を読めるようにする
-    static const std::vector<std::pair<Type, std::string>> descriptions_;
+    struct Description {
+        Type type;
+        const char* text;
+        size_t size;
+    };
+
+    // 種別の順に並べて、添え字で引く
+    static constexpr Description descriptions_[] {
+        {Type::Local, "普通", sizeof("普通") - 1},
+        {Type::Rapid, "快速", sizeof("快速") - 1},
+        {Type::Limited_Express, "特急", sizeof("特急") - 1}};
+    static constexpr size_t SizeOfTypes = sizeof(descriptions_) / sizeof(descriptions_[0]);
+
+    static constexpr bool isIndexedByType(size_t index) {
+        return (index >= SizeOfTypes) ||
+            ((static_cast<size_t>(descriptions_[index].type) == index) && isIndexedByType(index + 1));
+    }
+
+    static const Description& getDescription(Type type) {
+        static_assert(isIndexedByType(0), "descriptions_ must be indexed by Type");
+        static constexpr Description unknown {Type::Local, "??", sizeof("??") - 1};
+        const auto index = static_cast<size_t>(type);
+        return (index < SizeOfTypes) ? descriptions_[index] : unknown;
+    }
 };
 
-const std::vector<std::pair<Train::Type, std::string>> Train::descriptions_ {
-    {Train::Type::Local, "普通"},
-    {Train::Type::Rapid, "快速"},
-    {Train::Type::Limited_Express, "特急"}};
+constexpr Train::Description Train::descriptions_[];
 
 std::ostream& operator <<(std::ostream& os, const Train& train) {
     // osが例外を出すよう設定するが後で戻す
@@ -175,214 +399,1286 @@ std::istream& operator >>(std::istream& is, Train& train) {
     return is;
 }
 
-template<typename Derived>
-class RandomNumber {
+// 列車のバイナリ形式
+// ヘッダ : "TRNB", 版(2バイト), 予約(2バイト), 列車数(4バイト)
+// 列車   : 名前のバイト数(4バイト), 名前(終端文字なし), 種別(1バイト)
+// 整数はリトルエンディアンで書くので、どのプラットフォームでも読める
+namespace TrainBinaryFormat {
+    constexpr char Magic[] = {'T', 'R', 'N', 'B'};
+    constexpr uint16_t Version = 1;
+    constexpr size_t VersionOffset = 4;
+    constexpr size_t CountOffset = 8;
+    constexpr size_t HeaderSize = 12;
+    using Count = uint32_t;
+    using NameLength = uint32_t;
+    using TypeTag = uint8_t;
+}
+
+// 列車を一つずつbufferの後ろに足す
+class TrainBinaryWriter {
 public:
-    RandomNumber(void) = default;
-    uint_fast32_t Get(void) {
-        return static_cast<Derived*>(this)->impl();
+    explicit TrainBinaryWriter(std::string& buffer) : buffer_(buffer), headerPos_(buffer.size()) {
+        using namespace TrainBinaryFormat;
+        buffer_.append(Magic, sizeof(Magic));
+        appendUint(Version, sizeof(uint16_t));
+        appendUint(0, sizeof(uint16_t));
+        appendUint(0, sizeof(Count));
     }
 
-    RandomNumber(const RandomNumber&) = delete;
-    RandomNumber& operator =(const RandomNumber&) = delete;
-};
+    virtual ~TrainBinaryWriter(void) = default;
+    TrainBinaryWriter(const TrainBinaryWriter&) = delete;
+    TrainBinaryWriter& operator =(const TrainBinaryWriter&) = delete;
+
+    // 書けない列車なら、bufferを変えずに例外を投げる(強い例外安全)
+    void Write(const Train& train) {
+        using namespace TrainBinaryFormat;
+        using IntType = std::underlying_type<decltype(train.type_)>::type;
+        const auto type = Train::toType(static_cast<IntType>(train.type_));
+        if ((train.name_.size() > std::numeric_limits<NameLength>::max()) ||
+            (count_ == std::numeric_limits<Count>::max())) {
+            throw Train::InvalidValue("Too many bytes");
+        }
 
-class SoftwareRand : public RandomNumber<SoftwareRand> {
-public:
-    SoftwareRand(void) : gen(rd()) {}
-private:
-    // すごーい! CRTPは静的ポリモーフィズムができるフレンズなんだね
-    friend class RandomNumber<SoftwareRand>;
-    std::result_of<decltype(
-        &RandomNumber<SoftwareRand>::Get)(RandomNumber<SoftwareRand>)>::type impl() {
-        return gen();
-    }
+        const auto originalSize = buffer_.size();
+        try {
+            appendUint(train.name_.size(), sizeof(NameLength));
+            buffer_.append(train.name_);
+            appendUint(static_cast<uint64_t>(type), sizeof(TypeTag));
+        } catch(...) {
+            // 途中まで書いたものを取り消す
+            buffer_.resize(originalSize);
+            throw;
+        }
 
-    std::random_device rd;
-    std::mt19937 gen;
-};
+        // 列車数を書き換えるだけなので例外は出ない
+        ++count_;
+        for(size_t i = 0; i < sizeof(Count); ++i) {
+            buffer_[headerPos_ + CountOffset + i] = static_cast<char>((count_ >> (8 * i)) & 0xff);
+        }
+        return;
+    }
 
-class HardwareRand : public RandomNumber<HardwareRand> {
-public:
-    HardwareRand(void) {}
-private:
-    friend class RandomNumber<HardwareRand>;
-    std::result_of<decltype(
-        &RandomNumber<SoftwareRand>::Get)(RandomNumber<SoftwareRand>)>::type impl() {
-        uint32_t number = 0;
-        asm volatile (
-            "rdrand %0 \n\t"
-            :"=r"(number)::);
-        return number;
+    TrainBinaryFormat::Count GetCount(void) const {
+        return count_;
     }
-};
 
-class TestSerialization : public ::testing::Test {
-protected:
-    void checkIfStartWith(const std::string& actual, const std::string& keyword) {
-        EXPECT_EQ(0, actual.find(keyword));
+private:
+    void appendUint(uint64_t value, size_t size) {
+        for(size_t i = 0; i < size; ++i) {
+            buffer_.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+        }
         return;
     }
-};
 
-TEST_F(TestSerialization, Initialize) {
-    Train train;
-    EXPECT_TRUE(train.name_.empty());
-    EXPECT_EQ(Train::Type::Local, train.type_);
+    std::string& buffer_;
+    size_t headerPos_ {0};
+    TrainBinaryFormat::Count count_ {0};
+};
 
-    const std::string rapidName = "Acty";
-    constexpr Train::Type rapidType = Train::Type::Rapid;
-    Train rapid(rapidName, rapidType);
-    EXPECT_EQ(rapidName, rapid.name_);
-    EXPECT_EQ(rapidType, rapid.type_);
+// 列車を複製せずに読んだもの
+struct TrainView {
+    boost::string_ref name;
+    Train::Type type {Train::Type::Local};
+};
 
-    const std::string ltdExpressName = " フラノラベンダー\nエクスプレス ";
-    constexpr Train::Type ltdExpressType = Train::Type::Limited_Express;
-    Train ltdExpress(ltdExpressName, ltdExpressType);
-    EXPECT_EQ("フラノラベンダー エクスプレス", ltdExpress.name_);
-    EXPECT_EQ(ltdExpressType, ltdExpress.type_);
-}
+// 列車を一つずつ先頭から読む
+// dataは、このReaderと、Readerから得たTrainViewより長生きしなければならない。mmapした領域でもよい。
+class TrainBinaryReader {
+public:
+    TrainBinaryReader(const char* data, size_t size) : data_(data), size_(size), pos_(TrainBinaryFormat::HeaderSize) {
+        using namespace TrainBinaryFormat;
+        if ((size_ < HeaderSize) || std::memcmp(data_, Magic, sizeof(Magic))) {
+            throw Train::InvalidValue("Invalid header");
+        }
 
-TEST_F(TestSerialization, Concatenate) {
-    constexpr Train::Type type = Train::Type::Limited_Express;
-    const std::string leftName =  "Sunrise Seto";
-    const std::string rightName = "Sunrise Izumo";
-    const Train left(leftName, type);
-    const Train right(rightName, type);
+        const auto version = readUint(VersionOffset, sizeof(uint16_t));
+        if (version > Version) {
+            // 新しい版は読めない
+            std::string message = "Unsupported version "
+                + boost::lexical_cast<decltype(message)>(version);
+            throw Train::InvalidValue(message);
+        }
 
-    const Train ltdExpress = left + right;
-    EXPECT_EQ("Sunrise Seto-Sunrise Izumo", ltdExpress.name_);
-    EXPECT_EQ(type, ltdExpress.type_);
-}
+        count_ = static_cast<Count>(readUint(CountOffset, sizeof(Count)));
+    }
 
-TEST_F(TestSerialization, ToString) {
-    const Train local("いさぶろう", Train::Type::Local);
-    const Train rapid("ラビット", Train::Type::Rapid);
-    const Train ltdExpress("サンダーバード", Train::Type::Limited_Express);
+    virtual ~TrainBinaryReader(void) = default;
+    TrainBinaryReader(const TrainBinaryReader&) = delete;
+    TrainBinaryReader& operator =(const TrainBinaryReader&) = delete;
 
-    EXPECT_EQ("いさぶろうは普通で走る列車なんだね", local.ToString());
-    EXPECT_EQ("ラビットは快速で走る列車なんだね", rapid.ToString());
-    EXPECT_EQ("サンダーバードは特急で走る列車なんだね", ltdExpress.ToString());
+    TrainBinaryFormat::Count GetCount(void) const {
+        return count_;
+    }
 
-    Train outOfService("回送", Train::Type::Local);
-    outOfService.type_ = static_cast<Train::Type>(3);
-    EXPECT_EQ("回送は??で走る列車なんだね", outOfService.ToString());
-}
+    // 次の列車を読む。読み終わっていればfalseを返す。
+    // 壊れていれば、読む位置もviewも変えずに例外を投げる。
+    bool Next(TrainView& view) {
+        using namespace TrainBinaryFormat;
+        if (index_ >= count_) {
+            return false;
+        }
 
-TEST_F(TestSerialization, Std) {
-    {
-        const std::string name = "Sunrise Seto";
-        const Train::Type type = Train::Type::Limited_Express;
+        if ((size_ - pos_) < sizeof(NameLength)) {
+            throw Train::InvalidValue("Truncated data");
+        }
+        const auto length = static_cast<size_t>(readUint(pos_, sizeof(NameLength)));
+        const auto namePos = pos_ + sizeof(NameLength);
+        const auto rest = size_ - namePos;
+        if ((rest < sizeof(TypeTag)) || ((rest - sizeof(TypeTag)) < length)) {
+            throw Train::InvalidValue("Truncated data");
+        }
 
-        const Train original(name, type);
-        std::stringstream ss;
-        ss << original;
+        const auto typePos = namePos + length;
+        using IntType = std::underlying_type<Train::Type>::type;
+        const auto type = Train::toType(static_cast<IntType>(readUint(typePos, sizeof(TypeTag))));
 
-        Train restored;
-        ss >> restored;
-        EXPECT_EQ(name, restored.name_);
-        EXPECT_EQ(type, restored.type_);
+        view.name = boost::string_ref(data_ + namePos, length);
+        view.type = type;
+        pos_ = typePos + sizeof(TypeTag);
+        ++index_;
+        return true;
     }
 
-    {
-        const std::string name = " Tottori\nLiner ";
-        constexpr Train::Type type = Train::Type::Rapid;
+    // 次の列車を複製する。失敗したら、読む位置もtrainも変えない。
+    bool Read(Train& train) {
+        const auto pos = pos_;
+        const auto index = index_;
+        TrainView view;
+        if (!Next(view)) {
+            return false;
+        }
 
-        const Train original(name, type);
-        std::stringstream ss;
-        ss << original;
+        try {
+            Train t;
+            t.name_.assign(view.name.data(), view.name.size());
+            t.type_ = view.type;
+            std::swap(train, t);
+        } catch(...) {
+            pos_ = pos;
+            index_ = index;
+            throw;
+        }
 
-        Train restored;
-        ss >> restored;
-        EXPECT_EQ("Tottori Liner", restored.name_);
-        EXPECT_EQ(type, restored.type_);
+        return true;
     }
-}
 
-TEST_F(TestSerialization, Boost) {
-    const std::string name = "Sunrise Izumo";
-    constexpr Train::Type type = Train::Type::Limited_Express;
+private:
+    uint64_t readUint(size_t pos, size_t size) const {
+        uint64_t value = 0;
+        for(size_t i = 0; i < size; ++i) {
+            value |= static_cast<uint64_t>(static_cast<unsigned char>(data_[pos + i])) << (8 * i);
+        }
+        return value;
+    }
 
-    const Train original(name, type);
-    std::stringstream ss;
-    boost::archive::text_oarchive oarch(ss);
-    oarch << original;
+    const char* data_ {nullptr};
+    size_t size_ {0};
+    size_t pos_ {0};
+    TrainBinaryFormat::Count count_ {0};
+    TrainBinaryFormat::Count index_ {0};
+};
 
-    Train restored;
-    boost::archive::text_iarchive iarch(ss);
-    iarch >> restored;
-    EXPECT_EQ(name, restored.name_);
-    EXPECT_EQ(type, restored.type_);
+// 大量の列車を、列ごとにまとめてファイルに置く
+// ヘッダ     : "TRNS", 版(2バイト), 予約(2バイト), 列車数(4バイト)
+// 名前の位置 : 列車数+1個の4バイト整数。i番目の名前は名前の領域の[offsets[i], offsets[i+1])にある。
+// 種別       : 列車数個の1バイト整数
+// 名前の領域 : 名前を終端文字なしで連結したもの
+namespace TrainStoreFormat {
+    constexpr char Magic[] = {'T', 'R', 'N', 'S'};
+    constexpr uint16_t Version = 1;
+    constexpr size_t VersionOffset = 4;
+    constexpr size_t CountOffset = 8;
+    constexpr size_t HeaderSize = 12;
+    using Count = uint32_t;
+    using NameOffset = uint32_t;
+    using TypeTag = uint8_t;
 }
 
-TEST_F(TestSerialization, StdInvalid) {
-    const std::string name = "Unnamed";
-    {
-        const std::string arg = name + "\n3";
-        std::istringstream is(arg);
-        Train notRestored;
-        std::string actual;
+// ファイルをmmapして、列車を複製せずに番号で読む
+class TrainStore {
+public:
+    // 書けない列車があれば、ファイルを作らずに例外を投げる
+    // 書き込みに失敗したら、元のファイルを残して例外を投げる
+    static void Write(const std::string& filename, const std::vector<Train>& trains) {
+        using namespace TrainStoreFormat;
+        using IntType = std::underlying_type<Train::Type>::type;
+
+        size_t heapSize = 0;
+        for(auto& train : trains) {
+            Train::toType(static_cast<IntType>(train.type_));
+            heapSize += train.name_.size();
+        }
+        if ((trains.size() >= std::numeric_limits<Count>::max()) ||
+            (heapSize > std::numeric_limits<NameOffset>::max())) {
+            throw Train::InvalidValue("Too many bytes");
+        }
 
-        try {
-            is >> notRestored;
-        } catch(Train::InvalidValue& e) {
-            // 入力を適切にenumへとキャストできなかった
-            actual = e.what();
+        std::string image;
+        image.reserve(HeaderSize + (trains.size() + 1) * sizeof(NameOffset) + trains.size() * sizeof(TypeTag) + heapSize);
+        image.append(Magic, sizeof(Magic));
+        appendUint(image, Version, sizeof(uint16_t));
+        appendUint(image, 0, sizeof(uint16_t));
+        appendUint(image, trains.size(), sizeof(Count));
+
+        size_t offset = 0;
+        appendUint(image, offset, sizeof(NameOffset));
+        for(auto& train : trains) {
+            offset += train.name_.size();
+            appendUint(image, offset, sizeof(NameOffset));
+        }
+        for(auto& train : trains) {
+            appendUint(image, static_cast<uint64_t>(train.type_), sizeof(TypeTag));
+        }
+        for(auto& train : trains) {
+            image.append(train.name_);
         }
 
-        // MinGWでは": iostream error"が後ろにつく
-        const std::string expected = "Invalid number 3";
-        checkIfStartWith(actual, expected);
+        // 他のTrainStoreが同じファイルをmmapしていても壊さないように、同じディレクトリの別のファイルに書いて置き換える
+        const boost::filesystem::path target(filename);
+        const auto tempPath = target.parent_path() /
+            boost::filesystem::unique_path(target.filename().string() + ".%%%%-%%%%.tmp");
+        try {
+            std::ofstream os(tempPath.string(), std::ios::binary | std::ios::trunc);
+            os.exceptions(std::ios::failbit | std::ios::badbit);
+            os.write(image.data(), static_cast<std::streamsize>(image.size()));
+            os.close();
+            boost::filesystem::rename(tempPath, target);
+        } catch(...) {
+            // 書きかけのファイルを残さない
+            boost::system::error_code ec;
+            boost::filesystem::remove(tempPath, ec);
+            throw;
+        }
+        return;
     }
 
-    {
-        std::istringstream is(name);
-        Train notRestored;
-        std::string actual;
-
+    // 開けない、または壊れたファイルなら例外を投げる
+    explicit TrainStore(const std::string& filename) {
+        mapFile(filename);
         try {
-            is >> notRestored;
-        } catch(std::exception& e) {
-            // 入力が短すぎて読めなかった
-            actual = e.what();
+            validate();
+        } catch(...) {
+            unmapFile();
+            throw;
         }
+    }
 
-        EXPECT_FALSE(actual.empty());
+    virtual ~TrainStore(void) {
+        unmapFile();
     }
-}
 
-TEST_F(TestSerialization, BoostInvalidOut) {
-    const std::string name = "Unnamed";
-    const Train::Type type = static_cast<Train::Type>(3);
-    const Train original(name, type);
-    std::ostringstream os;
-    std::string actual;
+    TrainStore(const TrainStore&) = delete;
+    TrainStore& operator =(const TrainStore&) = delete;
 
-    try {
-        boost::archive::text_oarchive oarch(os);
-        oarch << original;
-    } catch(Train::InvalidValue& e) {
-        // 出力値が壊れている
-        actual = e.what();
+    size_t GetSize(void) const {
+        return count_;
     }
 
-    const std::string expected = "Invalid number 3";
-    checkIfStartWith(actual, expected);
-}
-
-TEST_F(TestSerialization, BoostInvalidIn) {
-    const std::string name = "Unnamed";
-    const Train::Type type = Train::Type::Local;
-    const Train original(name, type);
-    std::ostringstream os;
-    boost::archive::text_oarchive oarch(os);
-    oarch << original;
+    // 開いたときに検査したので、ここでは検査しない
+    Train::Type GetType(size_t index) const {
+        return static_cast<Train::Type>(static_cast<unsigned char>(types_[checkIndex(index)]));
+    }
 
-    auto baseText = os.str();
-    baseText.pop_back();
+    TrainView Get(size_t index) const {
+        checkIndex(index);
+        const auto begin = getNameOffset(index);
+        const auto end = getNameOffset(index + 1);
+        TrainView view;
+        view.name = boost::string_ref(heap_ + begin, end - begin);
+        view.type = GetType(index);
+        return view;
+    }
 
-    const std::vector<std::pair<std::string, std::string>> testCases {
-        {"3", "Invalid number 3"}, {"A", "input stream error"}};
+    // 種別の列だけを読んで、その種別の列車の番号を返す
+    std::vector<size_t> FindByType(Train::Type type) const {
+        std::vector<size_t> indexes;
+        const auto tag = static_cast<int>(type);
+        const char* pBegin = types_;
+        const char* pEnd = types_ + count_;
+        const char* p = pBegin;
+        while(p < pEnd) {
+            const void* pFound = std::memchr(p, tag, static_cast<size_t>(pEnd - p));
+            if (!pFound) {
+                break;
+            }
+            p = static_cast<const char*>(pFound);
+            indexes.push_back(static_cast<size_t>(p - pBegin));
+            ++p;
+        }
+        return indexes;
+    }
+
+private:
+    static void appendUint(std::string& str, uint64_t value, size_t size) {
+        for(size_t i = 0; i < size; ++i) {
+            str.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+        }
+        return;
+    }
+
+    uint64_t readUint(size_t pos, size_t size) const {
+        uint64_t value = 0;
+        for(size_t i = 0; i < size; ++i) {
+            value |= static_cast<uint64_t>(static_cast<unsigned char>(data_[pos + i])) << (8 * i);
+        }
+        return value;
+    }
+
+    size_t checkIndex(size_t index) const {
+        if (index >= count_) {
+            throw std::out_of_range("TrainStore");
+        }
+        return index;
+    }
+
+    size_t getNameOffset(size_t index) const {
+        return static_cast<size_t>(readUint(TrainStoreFormat::HeaderSize + index * sizeof(TrainStoreFormat::NameOffset),
+                                            sizeof(TrainStoreFormat::NameOffset)));
+    }
+
+    // 名前の位置が昇順で名前の領域に収まり、種別がすべて正しいことを確かめる
+    void validate(void) {
+        using namespace TrainStoreFormat;
+        if ((size_ < HeaderSize) || std::memcmp(data_, Magic, sizeof(Magic))) {
+            throw Train::InvalidValue("Invalid header");
+        }
+
+        const auto version = readUint(VersionOffset, sizeof(uint16_t));
+        if (version > Version) {
+            std::string message = "Unsupported version "
+                + boost::lexical_cast<decltype(message)>(version);
+            throw Train::InvalidValue(message);
+        }
+
+        const auto count = static_cast<size_t>(readUint(CountOffset, sizeof(Count)));
+        const auto columnSize = (count + 1) * sizeof(NameOffset) + count * sizeof(TypeTag);
+        if ((size_ - HeaderSize) < columnSize) {
+            throw Train::InvalidValue("Truncated data");
+        }
+        count_ = count;
+        types_ = data_ + HeaderSize + (count + 1) * sizeof(NameOffset);
+        heap_ = types_ + count * sizeof(TypeTag);
+        const auto heapSize = size_ - HeaderSize - columnSize;
+
+        size_t previous = 0;
+        for(size_t i = 0; i <= count; ++i) {
+            const auto offset = getNameOffset(i);
+            if ((offset < previous) || (offset > heapSize) || (!i && offset)) {
+                throw Train::InvalidValue("Invalid name offset");
+            }
+            previous = offset;
+        }
+        if (previous != heapSize) {
+            throw Train::InvalidValue("Invalid name offset");
+        }
+
+        using IntType = std::underlying_type<Train::Type>::type;
+        for(size_t i = 0; i < count; ++i) {
+            Train::toType(static_cast<IntType>(static_cast<unsigned char>(types_[i])));
+        }
+        return;
+    }
+
+#if !defined(__MINGW32__) && !defined(__MINGW64__)
+    void mapFile(const std::string& filename) {
+        const int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::ios_base::failure("Cannot open " + filename);
+        }
+
+        struct stat st;
+        if (::fstat(fd, &st) != 0) {
+            ::close(fd);
+            throw std::ios_base::failure("Cannot open " + filename);
+        }
+
+        size_ = static_cast<size_t>(st.st_size);
+        if (size_) {
+            void* pMap = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (pMap == MAP_FAILED) {
+                ::close(fd);
+                throw std::ios_base::failure("Cannot map " + filename);
+            }
+            data_ = static_cast<const char*>(pMap);
+        }
+
+        // mmapした領域はfdを閉じても読める
+        ::close(fd);
+        return;
+    }
+
+    void unmapFile(void) {
+        if (data_) {
+            ::munmap(const_cast<char*>(data_), size_);
+            data_ = nullptr;
+        }
+        return;
+    }
+#else
+    // mmapがなければファイル全体を読む
+    void mapFile(const std::string& filename) {
+        std::ifstream is(filename, std::ios::binary);
+        if (!is) {
+            throw std::ios_base::failure("Cannot open " + filename);
+        }
+        buffer_.assign(std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>());
+        data_ = buffer_.data();
+        size_ = buffer_.size();
+        return;
+    }
+
+    void unmapFile(void) {
+        data_ = nullptr;
+        return;
+    }
+
+    std::string buffer_;
+#endif
+
+    const char* data_ {nullptr};
+    size_t size_ {0};
+    size_t count_ {0};
+    const char* types_ {nullptr};
+    const char* heap_ {nullptr};
+};
+
+// operator <<で書いた列車を読めなかった理由
+struct TrainParseError {
+    enum class Reason {
+        TRUNCATED,       // 種別の行がない
+        INVALID_NUMBER,  // 種別が整数でない
+        INVALID_TYPE,    // 種別の範囲外
+    };
+
+    size_t record {0};   // 何番目の列車か
+    size_t offset {0};   // 列車の先頭の位置
+    Reason reason {Reason::TRUNCATED};
+};
+
+// operator <<で書いた列車を、改行で区切って並べたものをまとめて読む
+// operator >>と異なり、iostreamも例外も使わない
+class TrainTextParser {
+public:
+    // 読めた列車をtrainsの後ろに足し、読めなかった列車はerrorsに足して読み飛ばす
+    // 読めた列車の数を返す
+    static size_t Parse(const char* data, size_t size, std::vector<Train>& trains,
+                        std::vector<TrainParseError>& errors) {
+        const char* p = data;
+        const char* pEnd = data + size;
+        // 一列車二行なので、一度数えてから領域を確保する
+        trains.reserve(trains.size() + (CountNewlines(p, pEnd) + 1) / 2);
+
+        size_t parsed = 0;
+        size_t record = 0;
+        while(p < pEnd) {
+            TrainParseError error;
+            error.record = record++;
+            error.offset = static_cast<size_t>(p - data);
+
+            const char* pName = p;
+            const char* pNameEnd = FindNewline(p, pEnd);
+            if ((pNameEnd == pEnd) || ((pNameEnd + 1) == pEnd)) {
+                error.reason = TrainParseError::Reason::TRUNCATED;
+                errors.push_back(error);
+                break;
+            }
+
+            const char* pType = pNameEnd + 1;
+            const char* pTypeEnd = FindNewline(pType, pEnd);
+            p = (pTypeEnd == pEnd) ? pEnd : (pTypeEnd + 1);
+
+            IntType type = 0;
+            if (!parseInt(pType, pTypeEnd, type)) {
+                error.reason = TrainParseError::Reason::INVALID_NUMBER;
+                errors.push_back(error);
+                continue;
+            }
+            if (!Train::isValidType(type)) {
+                error.reason = TrainParseError::Reason::INVALID_TYPE;
+                errors.push_back(error);
+                continue;
+            }
+
+            trains.emplace_back();
+            auto& train = trains.back();
+            train.name_.assign(pName, static_cast<size_t>(pNameEnd - pName));
+            train.type_ = static_cast<Train::Type>(type);
+            ++parsed;
+        }
+
+        return parsed;
+    }
+
+private:
+    using IntType = std::underlying_type<Train::Type>::type;
+
+    // 符号と数字だけからなる行を読む
+    static bool parseInt(const char* p, const char* pEnd, IntType& value) {
+        bool negative = false;
+        if ((p < pEnd) && (*p == '-')) {
+            negative = true;
+            ++p;
+        }
+        if (p == pEnd) {
+            return false;
+        }
+
+        int64_t number = 0;
+        for(; p < pEnd; ++p) {
+            if ((*p < '0') || (*p > '9')) {
+                return false;
+            }
+            number = number * 10 + (*p - '0');
+            if (number > std::numeric_limits<IntType>::max()) {
+                return false;
+            }
+        }
+
+        value = static_cast<IntType>(negative ? -number : number);
+        return true;
+    }
+};
+
+template<typename Derived>
+class RandomNumber {
+public:
+    RandomNumber(void) = default;
+    uint_fast32_t Get(void) {
+        return static_cast<Derived*>(this)->impl();
+    }
+
+    // まとめてsize個作る。Getをsize回呼んだのと同じ列を返す。
+    void Fill(uint_fast32_t* buffer, size_t size) {
+        static_cast<Derived*>(this)->fillImpl(buffer, size);
+    }
+
+    template<typename Container>
+    void Fill(Container& container) {
+        Fill(container.data(), container.size());
+    }
+
+    RandomNumber(const RandomNumber&) = delete;
+    RandomNumber& operator =(const RandomNumber&) = delete;
+
+protected:
+    // まとめて作れる派生クラスは、これを隠す
+    void fillImpl(uint_fast32_t* buffer, size_t size) {
+        for(size_t i = 0; i < size; ++i) {
+            buffer[i] = static_cast<Derived*>(this)->impl();
+        }
+    }
+};
+
+class SoftwareRand : public RandomNumber<SoftwareRand> {
+public:
+    SoftwareRand(void) : gen(rd()) {}
+private:
+    // すごーい! CRTPは静的ポリモーフィズムができるフレンズなんだね
+    friend class RandomNumber<SoftwareRand>;
+    std::result_of<decltype(
+        &RandomNumber<SoftwareRand>::Get)(RandomNumber<SoftwareRand>)>::type impl() {
+        return gen();
+    }
+
+    std::random_device rd;
+    std::mt19937 gen;
+};
+
+namespace {
+    // CPUIDで、命令を実行できるかどうか調べる
+    bool HasRdrand(void) {
+#if defined(CPPFRIENDS_X86_RAND)
+        unsigned int eax = 0;
+        unsigned int ebx = 0;
+        unsigned int ecx = 0;
+        unsigned int edx = 0;
+        return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_RDRND);
+#else
+        return false;
+#endif
+    }
+
+    bool HasRdseed(void) {
+#if defined(CPPFRIENDS_X86_RAND)
+        if (__get_cpuid_max(0, nullptr) < 7) {
+            return false;
+        }
+        unsigned int eax = 0;
+        unsigned int ebx = 0;
+        unsigned int ecx = 0;
+        unsigned int edx = 0;
+        __cpuid_count(7, 0, eax, ebx, ecx, edx);
+        return (ebx & bit_RDSEED);
+#else
+        return false;
+#endif
+    }
+
+    // 一回実行する。乱数が用意できていない(CF=0)ならfalseを返す。
+    bool StepRdrand(uint32_t& number) {
+#if defined(CPPFRIENDS_X86_RAND)
+        unsigned char ok = 0;
+        asm volatile (
+            "rdrand %0 \n\t"
+            "setc %1 \n\t"
+            :"=r"(number), "=qm"(ok)::"cc");
+        return ok;
+#else
+        return false;
+#endif
+    }
+
+    bool StepRdseed(uint32_t& number) {
+#if defined(CPPFRIENDS_X86_RAND)
+        unsigned char ok = 0;
+        asm volatile (
+            "rdseed %0 \n\t"
+            "setc %1 \n\t"
+            :"=r"(number), "=qm"(ok)::"cc");
+        return ok;
+#else
+        return false;
+#endif
+    }
+}
+
+// 乱数を生成する命令でまとめて作り置き、複数のスレッドに配る
+// 命令がなかったり、再試行しても失敗したりしたら、ソフトウェアで作る
+class EntropyPool {
+public:
+    // 乱数を一つ作る。失敗したらfalseを返す。
+    using Step = std::function<bool(uint32_t&)>;
+    static constexpr size_t PoolSize = 64;
+    static constexpr int MaxRetryCount = 10;          // Intelの推奨する再試行回数
+    static constexpr size_t ReseedInterval = 65536;   // ソフトウェアの乱数の種を替える間隔
+
+    EntropyPool(void) : EntropyPool(HasRdrand() ? Step(StepRdrand) : Step()) {}
+
+    // stepが空ならソフトウェアだけで作る。テストでは失敗するstepを渡す。
+    explicit EntropyPool(const Step& step) : step_(step) {
+        reseed();
+    }
+
+    virtual ~EntropyPool(void) = default;
+    EntropyPool(const EntropyPool&) = delete;
+    EntropyPool& operator =(const EntropyPool&) = delete;
+
+    uint32_t Get(void) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (index_ >= PoolSize) {
+            refill();
+        }
+        return buffer_[index_++];
+    }
+
+    // ロックを一回だけ取る
+    template<typename T>
+    void Fill(T* buffer, size_t size) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        size_t i = 0;
+        while(i < size) {
+            if (index_ >= PoolSize) {
+                refill();
+            }
+            const auto count = std::min(size - i, PoolSize - index_);
+            std::copy(buffer_ + index_, buffer_ + index_ + count, buffer + i);
+            index_ += count;
+            i += count;
+        }
+    }
+
+    bool IsHardware(void) const {
+        return static_cast<bool>(step_);
+    }
+
+    // ソフトウェアで作った数
+    size_t GetFallbackCount(void) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return fallbackCount_;
+    }
+
+private:
+    void refill(void) {
+        for(auto& number : buffer_) {
+            if (!tryStep(number)) {
+                number = generate();
+                ++fallbackCount_;
+            }
+        }
+        index_ = 0;
+        return;
+    }
+
+    bool tryStep(uint32_t& number) {
+        if (step_) {
+            for(int i = 0; i < MaxRetryCount; ++i) {
+                if (step_(number)) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    uint32_t generate(void) {
+        if (++generatedCount_ >= ReseedInterval) {
+            reseed();
+        }
+        return static_cast<uint32_t>(gen_());
+    }
+
+    void reseed(void) {
+        std::random_device rd;
+        gen_.seed(rd());
+        generatedCount_ = 0;
+        return;
+    }
+
+    mutable std::mutex mutex_;
+    Step step_;
+    std::mt19937 gen_;
+    size_t generatedCount_ {0};
+    size_t fallbackCount_ {0};
+    size_t index_ {PoolSize};
+    // 配る乱数をキャッシュラインの先頭から置く
+    // C++14のnewは揃えないので、静的変数か自動変数として作る
+    alignas(64) uint32_t buffer_[PoolSize];
+};
+
+static_assert(alignof(EntropyPool) >= 64, "The buffer must be aligned to a cache line");
+
+class HardwareRand : public RandomNumber<HardwareRand> {
+public:
+    HardwareRand(void) {}
+private:
+    friend class RandomNumber<HardwareRand>;
+    std::result_of<decltype(
+        &RandomNumber<SoftwareRand>::Get)(RandomNumber<SoftwareRand>)>::type impl() {
+        return getPool().Get();
+    }
+
+    void fillImpl(uint_fast32_t* buffer, size_t size) {
+        getPool().Fill(buffer, size);
+    }
+
+    // すべてのHardwareRandとスレッドで共有する
+    static EntropyPool& getPool(void) {
+        static EntropyPool pool;
+        return pool;
+    }
+};
+
+// xoshiro128++をLanes個並べて、一度にLanes個の乱数を作る
+// 各状態変数をレーンの配列にしているので、レーンのループはSIMD命令にできる
+class XoshiroRand : public RandomNumber<XoshiroRand> {
+public:
+    static constexpr size_t Lanes = 8;
+
+    XoshiroRand(void) : XoshiroRand(std::random_device()()) {}
+
+    explicit XoshiroRand(uint64_t seed) {
+        // 各レーンの初期状態はsplitmix64で作る
+        for(size_t lane = 0; lane < Lanes; ++lane) {
+            for(auto& state : state_) {
+                seed += 0x9e3779b97f4a7c15ull;
+                uint64_t z = seed;
+                z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+                z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+                state[lane] = static_cast<uint32_t>((z ^ (z >> 31)) >> 32);
+            }
+            // 状態がすべて0だと0しか出さない
+            if (!(state_[0][lane] | state_[1][lane] | state_[2][lane] | state_[3][lane])) {
+                state_[0][lane] = 1;
+            }
+        }
+    }
+
+private:
+    friend class RandomNumber<XoshiroRand>;
+    using Result = std::result_of<decltype(
+        &RandomNumber<XoshiroRand>::Get)(RandomNumber<XoshiroRand>)>::type;
+
+    Result impl() {
+        if (cachedIndex_ >= Lanes) {
+            next(cached_);
+            cachedIndex_ = 0;
+        }
+        return cached_[cachedIndex_++];
+    }
+
+    void fillImpl(Result* buffer, size_t size) {
+        // Getで作り置いた分を先に使う
+        size_t i = 0;
+        for(; (i < size) && (cachedIndex_ < Lanes); ++i) {
+            buffer[i] = cached_[cachedIndex_++];
+        }
+
+        uint32_t numbers[Lanes];
+        for(; (i + Lanes) <= size; i += Lanes) {
+            next(numbers);
+            std::copy(numbers, numbers + Lanes, buffer + i);
+        }
+
+        for(; i < size; ++i) {
+            buffer[i] = impl();
+        }
+        return;
+    }
+
+    static uint32_t rotl(uint32_t x, int k) {
+        return (x << k) | (x >> (32 - k));
+    }
+
+    // 全レーンを一つ進める
+    void next(uint32_t* numbers) {
+        auto& s0 = state_[0];
+        auto& s1 = state_[1];
+        auto& s2 = state_[2];
+        auto& s3 = state_[3];
+        for(size_t lane = 0; lane < Lanes; ++lane) {
+            numbers[lane] = rotl(s0[lane] + s3[lane], 7) + s0[lane];
+            const uint32_t t = s1[lane] << 9;
+            s2[lane] ^= s0[lane];
+            s3[lane] ^= s1[lane];
+            s1[lane] ^= s2[lane];
+            s0[lane] ^= s3[lane];
+            s2[lane] ^= t;
+            s3[lane] = rotl(s3[lane], 11);
+        }
+    }
+
+    uint32_t state_[4][Lanes];
+    uint32_t cached_[Lanes];
+    size_t cachedIndex_ {Lanes};
+};
+
+namespace {
+    // size個を処理する速さを、unit/secの単位で表示する
+    class ThroughputPrinter {
+    public:
+        using Clock = std::chrono::steady_clock;
+
+        ThroughputPrinter(size_t size, const std::string& unit) : size_(size), unit_(unit) {}
+
+        // startから今までにかかった時間で求める。noteは後ろに添える。
+        void Print(const std::string& name, const Clock::time_point& start, const std::string& note = "") const {
+            const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start);
+            const auto elapsedUsec = std::max(static_cast<decltype(elapsed.count())>(1), elapsed.count());
+            std::cout << name << " : " << (static_cast<long long>(size_) * 1000000 / elapsedUsec)
+                      << " " << unit_ << "/sec" << note << "\n";
+        }
+
+        // funcを一回呼んで測る
+        template <typename Func>
+        void Measure(const std::string& name, Func func) const {
+            const auto start = Clock::now();
+            func();
+            Print(name, start);
+        }
+
+    private:
+        size_t size_;
+        std::string unit_;
+    };
+}
+
+class TestSerialization : public ::testing::Test {
+protected:
+    void checkIfStartWith(const std::string& actual, const std::string& keyword) {
+        EXPECT_EQ(0, actual.find(keyword));
+        return;
+    }
+
+    std::string getTemporaryFilename(void) {
+        const auto path = boost::filesystem::temp_directory_path() /
+            boost::filesystem::unique_path("cppFriendsTrain-%%%%-%%%%-%%%%-%%%%");
+        return path.string();
+    }
+};
+
+TEST_F(TestSerialization, Initialize) {
+    Train train;
+    EXPECT_TRUE(train.name_.empty());
+    EXPECT_EQ(Train::Type::Local, train.type_);
+
+    const std::string rapidName = "Acty";
+    constexpr Train::Type rapidType = Train::Type::Rapid;
+    Train rapid(rapidName, rapidType);
+    EXPECT_EQ(rapidName, rapid.name_);
+    EXPECT_EQ(rapidType, rapid.type_);
+
+    const std::string ltdExpressName = " フラノラベンダー\nエクスプレス ";
+    constexpr Train::Type ltdExpressType = Train::Type::Limited_Express;
+    Train ltdExpress(ltdExpressName, ltdExpressType);
+    EXPECT_EQ("フラノラベンダー エクスプレス", ltdExpress.name_);
+    EXPECT_EQ(ltdExpressType, ltdExpress.type_);
+}
+
+TEST_F(TestSerialization, Concatenate) {
+    constexpr Train::Type type = Train::Type::Limited_Express;
+    const std::string leftName =  "Sunrise Seto";
+    const std::string rightName = "Sunrise Izumo";
+    const Train left(leftName, type);
+    const Train right(rightName, type);
+
+    const Train ltdExpress = left + right;
+    EXPECT_EQ("Sunrise Seto-Sunrise Izumo", ltdExpress.name_);
+    EXPECT_EQ(type, ltdExpress.type_);
+
+    // 読んだ名前は正規化していないが、連結した名前は正規化する
+    std::istringstream is("a\r\n1");
+    Train crlf;
+    is >> crlf;
+    EXPECT_EQ("a\r", crlf.name_);
+    EXPECT_EQ(Train::Type::Rapid, crlf.type_);
+
+    // 左は全体を、右は足した部分を正規化する
+    Train padded;
+    padded.name_ = " b\n";
+    const std::string expected = "a- b";
+    EXPECT_EQ(expected, (crlf + padded).name_);
+    EXPECT_EQ(Train::Type::Rapid, (crlf + padded).type_);
+    EXPECT_EQ(expected, (Train(crlf) + padded).name_);
+    Train appended(crlf);
+    appended += padded;
+    EXPECT_EQ(expected, appended.name_);
+    EXPECT_EQ("b-a", (padded + crlf).name_);
+}
+
+// 連結済みの部分は走査し直さないので、連結を繰り返しても名前の長さに比例する手間で済む
+TEST_F(TestSerialization, ConcatenateLinear) {
+    constexpr size_t sizeOfTrains = 10000;
+    const Train car("Car\r\n", Train::Type::Local);
+    Train consist = car + car;
+
+    // 正規化済みの部分に改行を置いて、後の連結で書き換えられないことを確かめる
+    consist.name_[1] = '\n';
+    for(size_t i = 2; i < sizeOfTrains; ++i) {
+        consist += car;
+    }
+    ASSERT_EQ(sizeOfTrains * 4 - 1, consist.name_.size());
+    EXPECT_EQ("C\nr-Car-Car", consist.name_.substr(0, 11));
+    EXPECT_EQ("-Car", consist.name_.substr(consist.name_.size() - 4));
+
+    // 読んだ名前は、最初に連結するときに一回だけ正規化する
+    std::istringstream is("Car\r\n0");
+    Train read;
+    is >> read;
+    Train readConsist = read + car;
+    readConsist.name_[1] = '\n';
+    readConsist += car;
+    EXPECT_EQ("C\nr-Car-Car", readConsist.name_);
+}
+
+// 列車を何十両もつなぐ
+TEST_F(TestSerialization, ConcatenateChain) {
+    constexpr size_t sizeOfTrains = 50;
+    std::vector<Train> trains;
+    std::string expected;
+    for(size_t i = 0; i < sizeOfTrains; ++i) {
+        const auto name = "Car" + boost::lexical_cast<std::string>(i);
+        trains.emplace_back(name, Train::Type::Local);
+        expected += (i ? "-" : "") + name;
+    }
+
+    // 一時オブジェクトに足していくので、最初の一回しか列車を作らない
+    Train consist = trains.at(0) + trains.at(1) + trains.at(2);
+    for(size_t i = 3; i < sizeOfTrains; ++i) {
+        consist += trains.at(i);
+    }
+    EXPECT_EQ(expected, consist.name_);
+    EXPECT_EQ(Train::Type::Local, consist.type_);
+
+    constexpr size_t loopCount = 20000;
+    using Clock = std::chrono::steady_clock;
+    auto measure = [&](const std::string& name, auto func) {
+        const auto start = Clock::now();
+        size_t totalSize = 0;
+        for(size_t n = 0; n < loopCount; ++n) {
+            totalSize += func().name_.size();
+        }
+        const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start);
+        std::cout << name << " : " << (elapsed.count() / static_cast<decltype(elapsed.count())>(loopCount))
+                  << " ns/consist\n";
+        EXPECT_EQ(expected.size() * loopCount, totalSize);
+    };
+
+    // 以前の実装と同様に、連結するたびに名前を作り直して正規化する
+    measure("copy", [&](void) {
+            Train train(trains.at(0).name_, Train::Type::Local);
+            for(size_t i = 1; i < sizeOfTrains; ++i) {
+                train = Train(train.name_ + "-" + trains.at(i).name_, train.type_);
+            }
+            return train;
+        });
+
+    measure("operator +=", [&](void) {
+            Train train = trains.at(0) + trains.at(1);
+            for(size_t i = 2; i < sizeOfTrains; ++i) {
+                train += trains.at(i);
+            }
+            return train;
+        });
+}
+
+TEST_F(TestSerialization, ToString) {
+    const Train local("いさぶろう", Train::Type::Local);
+    const Train rapid("ラビット", Train::Type::Rapid);
+    const Train ltdExpress("サンダーバード", Train::Type::Limited_Express);
+
+    EXPECT_EQ("いさぶろうは普通で走る列車なんだね", local.ToString());
+    EXPECT_EQ("ラビットは快速で走る列車なんだね", rapid.ToString());
+    EXPECT_EQ("サンダーバードは特急で走る列車なんだね", ltdExpress.ToString());
+
+    Train outOfService("回送", Train::Type::Local);
+    outOfService.type_ = static_cast<Train::Type>(3);
+    EXPECT_EQ("回送は??で走る列車なんだね", outOfService.ToString());
+}
+
+TEST_F(TestSerialization, ToStringBuffer) {
+    const Train rapid("ラビット", Train::Type::Rapid);
+    const std::string expected = "ラビットは快速で走る列車なんだね";
+
+    // 書くべき文字数だけを求める
+    EXPECT_EQ(expected.size(), rapid.ToString(nullptr, 0));
+
+    char buffer[64];
+    EXPECT_EQ(expected.size(), rapid.ToString(buffer, sizeof(buffer)));
+    EXPECT_EQ(expected, buffer);
+
+    // 収まらなければ切り詰めて終端する
+    EXPECT_EQ(expected.size(), rapid.ToString(buffer, expected.size()));
+    EXPECT_EQ(expected.substr(0, expected.size() - 1), buffer);
+    EXPECT_EQ(expected.size(), rapid.ToString(buffer, 4));
+    EXPECT_EQ(expected.substr(0, 3), buffer);
+    EXPECT_EQ(expected.size(), rapid.ToString(buffer, 1));
+    EXPECT_EQ('\0', buffer[0]);
+
+    Train outOfService("回送", Train::Type::Local);
+    outOfService.type_ = static_cast<Train::Type>(-1);
+    EXPECT_EQ("回送は??で走る列車なんだね", outOfService.ToString());
+}
+
+namespace {
+    // CountingAllocatorで確保した回数と量
+    std::atomic<size_t> g_allocationCount {0};
+    std::atomic<size_t> g_allocationBytes {0};
+
+    // 確保した回数と量を数えるアロケータ
+    // コンテナごとに指定するので、他のコードやライブラリが確保したものは数えない
+    template <typename T>
+    class CountingAllocator {
+    public:
+        using value_type = T;
+
+        CountingAllocator(void) = default;
+        template <typename U>
+        CountingAllocator(const CountingAllocator<U>&) noexcept {}
+
+        T* allocate(size_t n) {
+            g_allocationCount.fetch_add(1, std::memory_order_relaxed);
+            g_allocationBytes.fetch_add(n * sizeof(T), std::memory_order_relaxed);
+            return std::allocator<T>().allocate(n);
+        }
+
+        void deallocate(T* p, size_t n) noexcept {
+            std::allocator<T>().deallocate(p, n);
+        }
+    };
+
+    template <typename T, typename U>
+    bool operator ==(const CountingAllocator<T>&, const CountingAllocator<U>&) {
+        return true;
+    }
+
+    template <typename T, typename U>
+    bool operator !=(const CountingAllocator<T>&, const CountingAllocator<U>&) {
+        return false;
+    }
+
+    using CountingString = std::basic_string<char, std::char_traits<char>, CountingAllocator<char>>;
+
+    // 以前のTrain::ToString(void)を、文字列の型だけ変えて写したもの
+    template <typename String>
+    class OldTrainDescription {
+    public:
+        OldTrainDescription(void) : descriptions_ {
+            {Train::Type::Local, "普通"},
+            {Train::Type::Rapid, "快速"},
+            {Train::Type::Limited_Express, "特急"}} {}
+
+        String ToString(const String& name, Train::Type type) const {
+            String str;
+            auto i = std::find_if(descriptions_.begin(), descriptions_.end(),
+                                  [=](auto& s) { return (s.first == type); });
+            String desc = (i != descriptions_.end()) ? i->second : "??";
+            str = name + "は" + desc + "で走る列車なんだね";
+            return str;
+        }
+
+    private:
+        const std::vector<std::pair<Train::Type, String>> descriptions_;
+    };
+}
+
+// 列車の説明を作る速さと、領域を確保する回数を比べる
+TEST_F(TestSerialization, ToStringThroughput) {
+    std::vector<Train> trains;
+    trains.emplace_back("いさぶろう", Train::Type::Local);
+    trains.emplace_back("ラビット", Train::Type::Rapid);
+    trains.emplace_back("サンダーバード", Train::Type::Limited_Express);
+    constexpr size_t loopCount = 1000000;
+
+    using Clock = std::chrono::steady_clock;
+    size_t totalSize = 0;
+    auto measure = [&](const std::string& name, auto func) {
+        totalSize = 0;
+        g_allocationCount = 0;
+        const auto start = Clock::now();
+        for(size_t i = 0; i < loopCount; ++i) {
+            totalSize += func(trains[i % trains.size()]);
+        }
+        const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start);
+        std::cout << name << " : " << (elapsed.count() / static_cast<decltype(elapsed.count())>(loopCount))
+                  << " ns/op, " << g_allocationCount.load() << " allocations\n";
+    };
+
+    // 以前の実装で、種別を探して文字列を連結する
+    // 名前と表は測る前に作っておき、連結する式で確保した回数だけを数える
+    std::vector<CountingString> names;
+    for(const auto& train : trains) {
+        names.emplace_back(train.name_.data(), train.name_.size());
+    }
+    const OldTrainDescription<CountingString> oldDescription;
+    measure("operator +", [&](const Train& train) {
+            const auto index = static_cast<size_t>(&train - trains.data());
+            return oldDescription.ToString(names[index], train.type_).size();
+        });
+    const auto expectedSize = totalSize;
+
+    measure("ToString()", [](const Train& train) { return train.toString<CountingString>().size(); });
+    EXPECT_EQ(expectedSize, totalSize);
+
+    char buffer[256];
+    measure("ToString(buffer)", [&buffer](const Train& train) { return train.ToString(buffer, sizeof(buffer)); });
+    EXPECT_EQ(expectedSize, totalSize);
+    EXPECT_EQ(0, g_allocationCount.load());
+}
+
+TEST_F(TestSerialization, Std) {
+    {
+        const std::string name = "Sunrise Seto";
+        const Train::Type type = Train::Type::Limited_Express;
+
+        const Train original(name, type);
+        std::stringstream ss;
+        ss << original;
+
+        Train restored;
+        ss >> restored;
+        EXPECT_EQ(name, restored.name_);
+        EXPECT_EQ(type, restored.type_);
+    }
+
+    {
+        const std::string name = " Tottori\nLiner ";
+        constexpr Train::Type type = Train::Type::Rapid;
+
+        const Train original(name, type);
+        std::stringstream ss;
+        ss << original;
+
+        Train restored;
+        ss >> restored;
+        EXPECT_EQ("Tottori Liner", restored.name_);
+        EXPECT_EQ(type, restored.type_);
+    }
+}
+
+TEST_F(TestSerialization, Boost) {
+    const std::string name = "Sunrise Izumo";
+    constexpr Train::Type type = Train::Type::Limited_Express;
+
+    const Train original(name, type);
+    std::stringstream ss;
+    boost::archive::text_oarchive oarch(ss);
+    oarch << original;
+
+    Train restored;
+    boost::archive::text_iarchive iarch(ss);
+    iarch >> restored;
+    EXPECT_EQ(name, restored.name_);
+    EXPECT_EQ(type, restored.type_);
+}
+
+TEST_F(TestSerialization, StdInvalid) {
+    const std::string name = "Unnamed";
+    {
+        const std::string arg = name + "\n3";
+        std::istringstream is(arg);
+        Train notRestored;
+        std::string actual;
+
+        try {
+            is >> notRestored;
+        } catch(Train::InvalidValue& e) {
+            // 入力を適切にenumへとキャストできなかった
+            actual = e.what();
+        }
+
+        // MinGWでは": iostream error"が後ろにつく
+        const std::string expected = "Invalid number 3";
+        checkIfStartWith(actual, expected);
+    }
+
+    {
+        std::istringstream is(name);
+        Train notRestored;
+        std::string actual;
+
+        try {
+            is >> notRestored;
+        } catch(std::exception& e) {
+            // 入力が短すぎて読めなかった
+            actual = e.what();
+        }
+
+        EXPECT_FALSE(actual.empty());
+    }
+}
+
+TEST_F(TestSerialization, BoostInvalidOut) {
+    const std::string name = "Unnamed";
+    const Train::Type type = static_cast<Train::Type>(3);
+    const Train original(name, type);
+    std::ostringstream os;
+    std::string actual;
+
+    try {
+        boost::archive::text_oarchive oarch(os);
+        oarch << original;
+    } catch(Train::InvalidValue& e) {
+        // 出力値が壊れている
+        actual = e.what();
+    }
+
+    const std::string expected = "Invalid number 3";
+    checkIfStartWith(actual, expected);
+}
+
+TEST_F(TestSerialization, BoostInvalidIn) {
+    const std::string name = "Unnamed";
+    const Train::Type type = Train::Type::Local;
+    const Train original(name, type);
+    std::ostringstream os;
+    boost::archive::text_oarchive oarch(os);
+    oarch << original;
+
+    auto baseText = os.str();
+    baseText.pop_back();
+
+    const std::vector<std::pair<std::string, std::string>> testCases {
+        {"3", "Invalid number 3"}, {"A", "input stream error"}};
 
     for(auto& test : testCases) {
         const std::string text = baseText + test.first;
@@ -400,40 +1696,676 @@ TEST_F(TestSerialization, BoostInvalidIn) {
 
         checkIfStartWith(actual, test.second);
     }
-}
+}
+
+TEST_F(TestSerialization, Binary) {
+    // Trainはコピーできないので、initializer_listでは作れない
+    std::vector<Train> trains;
+    trains.emplace_back("Sunrise Seto", Train::Type::Limited_Express);
+    trains.emplace_back("ラビット", Train::Type::Rapid);
+    trains.emplace_back("", Train::Type::Local);
+
+    // 前に何か書いてあっても、その後ろに足す
+    const std::string prefix = "prefix";
+    std::string buffer = prefix;
+    TrainBinaryWriter writer(buffer);
+    for(auto& train : trains) {
+        writer.Write(train);
+    }
+    EXPECT_EQ(3, writer.GetCount());
+    EXPECT_EQ(prefix.size() + TrainBinaryFormat::HeaderSize + (4 + 12 + 1) + (4 + 12 + 1) + (4 + 0 + 1),
+              buffer.size());
+
+    {
+        TrainBinaryReader reader(buffer.data() + prefix.size(), buffer.size() - prefix.size());
+        EXPECT_EQ(3, reader.GetCount());
+        TrainView view;
+        for(auto& train : trains) {
+            ASSERT_TRUE(reader.Next(view));
+            // bufferを指している
+            EXPECT_EQ(train.name_, view.name.to_string());
+            EXPECT_LE(buffer.data(), view.name.data());
+            EXPECT_GE(buffer.data() + buffer.size(), view.name.data() + view.name.size());
+            EXPECT_EQ(train.type_, view.type);
+        }
+        EXPECT_FALSE(reader.Next(view));
+    }
+
+    {
+        TrainBinaryReader reader(buffer.data() + prefix.size(), buffer.size() - prefix.size());
+        Train restored;
+        ASSERT_TRUE(reader.Read(restored));
+        EXPECT_EQ("Sunrise Seto", restored.name_);
+        EXPECT_EQ(Train::Type::Limited_Express, restored.type_);
+    }
+}
+
+TEST_F(TestSerialization, BinaryInvalid) {
+    const Train original("Unnamed", Train::Type::Local);
+
+    {
+        // 出力値が壊れていれば何も書かない
+        Train broken("Unnamed", Train::Type::Local);
+        broken.type_ = static_cast<Train::Type>(3);
+        std::string buffer;
+        TrainBinaryWriter writer(buffer);
+        const auto baseSize = buffer.size();
+        std::string actual;
+        try {
+            writer.Write(broken);
+        } catch(Train::InvalidValue& e) {
+            actual = e.what();
+        }
+        checkIfStartWith(actual, "Invalid number 3");
+        EXPECT_EQ(baseSize, buffer.size());
+        EXPECT_EQ(0, writer.GetCount());
+    }
+
+    std::string buffer;
+    TrainBinaryWriter writer(buffer);
+    writer.Write(original);
+
+    {
+        // 種別が壊れている
+        auto text = buffer;
+        text.back() = 3;
+        TrainBinaryReader reader(text.data(), text.size());
+        Train notRestored("Not restored", Train::Type::Rapid);
+        for(int i = 0; i < 2; ++i) {
+            // 読む位置が進まないので、何度読んでも同じ所で失敗する
+            std::string actual;
+            try {
+                reader.Read(notRestored);
+            } catch(Train::InvalidValue& e) {
+                actual = e.what();
+            }
+            checkIfStartWith(actual, "Invalid number 3");
+            EXPECT_EQ("Not restored", notRestored.name_);
+            EXPECT_EQ(Train::Type::Rapid, notRestored.type_);
+        }
+    }
+
+    const std::vector<std::pair<std::string, std::string>> testCases {
+        {buffer.substr(0, buffer.size() - 1), "Truncated data"},
+        {buffer.substr(0, TrainBinaryFormat::HeaderSize + 2), "Truncated data"},
+        {buffer.substr(0, TrainBinaryFormat::HeaderSize - 1), "Invalid header"},
+        {"TRNX" + buffer.substr(4), "Invalid header"},
+        {buffer.substr(0, 4) + '\x02' + buffer.substr(5), "Unsupported version 2"}};
+
+    for(auto& test : testCases) {
+        std::string actual;
+        try {
+            TrainBinaryReader reader(test.first.data(), test.first.size());
+            TrainView view;
+            reader.Next(view);
+        } catch(Train::InvalidValue& e) {
+            actual = e.what();
+        }
+        checkIfStartWith(actual, test.second);
+    }
+}
+
+// 大量の列車を書いて読む速さを比べる
+TEST_F(TestSerialization, BinaryThroughput) {
+    constexpr size_t sizeOfTrains = 100000;
+    std::vector<Train> trains;
+    trains.reserve(sizeOfTrains);
+    for(size_t i = 0; i < sizeOfTrains; ++i) {
+        trains.emplace_back("Train " + boost::lexical_cast<std::string>(i),
+                            static_cast<Train::Type>(i % 3));
+    }
+
+    using Clock = std::chrono::steady_clock;
+    const ThroughputPrinter throughput(sizeOfTrains, "trains");
+
+    {
+        auto start = Clock::now();
+        std::stringstream ss;
+        for(auto& train : trains) {
+            ss << train << "\n";
+        }
+        throughput.Print("std::ostream", start);
+
+        start = Clock::now();
+        Train restored;
+        for(size_t i = 0; i < sizeOfTrains; ++i) {
+            ss >> restored;
+            // 種別の後の改行を読み飛ばす
+            ss.ignore(1);
+        }
+        throughput.Print("std::istream", start);
+        EXPECT_EQ(trains.back().name_, restored.name_);
+    }
+
+    {
+        auto start = Clock::now();
+        std::stringstream ss;
+        {
+            boost::archive::text_oarchive oarch(ss);
+            for(auto& train : trains) {
+                oarch << train;
+            }
+        }
+        throughput.Print("text_oarchive", start);
+
+        start = Clock::now();
+        Train restored;
+        boost::archive::text_iarchive iarch(ss);
+        for(size_t i = 0; i < sizeOfTrains; ++i) {
+            iarch >> restored;
+        }
+        throughput.Print("text_iarchive", start);
+        EXPECT_EQ(trains.back().name_, restored.name_);
+    }
+
+    {
+        auto start = Clock::now();
+        std::string buffer;
+        TrainBinaryWriter writer(buffer);
+        for(auto& train : trains) {
+            writer.Write(train);
+        }
+        throughput.Print("TrainBinaryWriter", start);
+
+        start = Clock::now();
+        TrainBinaryReader reader(buffer.data(), buffer.size());
+        TrainView view;
+        size_t count = 0;
+        while(reader.Next(view)) {
+            ++count;
+        }
+        throughput.Print("TrainBinaryReader", start);
+        EXPECT_EQ(sizeOfTrains, count);
+        EXPECT_EQ(trains.back().name_, view.name.to_string());
+    }
+}
+
+TEST_F(TestSerialization, Store) {
+    constexpr size_t sizeOfTrains = 1000;
+    std::vector<Train> trains;
+    for(size_t i = 0; i < sizeOfTrains; ++i) {
+        // 空の名前も置ける
+        const std::string name = (i % 10) ? ("Train " + boost::lexical_cast<std::string>(i)) : "";
+        trains.emplace_back(name, static_cast<Train::Type>(i % 3));
+    }
+
+    const auto filename = getTemporaryFilename();
+    TrainStore::Write(filename, trains);
+    {
+        TrainStore store(filename);
+        ASSERT_EQ(sizeOfTrains, store.GetSize());
+
+        for(auto i : std::vector<size_t>{0, 1, 10, 500, sizeOfTrains - 1}) {
+            const auto view = store.Get(i);
+            EXPECT_EQ(trains.at(i).name_, view.name.to_string());
+            EXPECT_EQ(trains.at(i).type_, view.type);
+            EXPECT_EQ(trains.at(i).type_, store.GetType(i));
+        }
+        EXPECT_THROW(store.Get(sizeOfTrains), std::out_of_range);
+
+        const auto rapids = store.FindByType(Train::Type::Rapid);
+        ASSERT_EQ(sizeOfTrains / 3, rapids.size());
+        for(auto i : rapids) {
+            EXPECT_EQ(1, i % 3);
+        }
+    }
+
+    {
+        // 開いているファイルを書き換えても、開いている方は元の内容を読める
+        TrainStore oldStore(filename);
+        std::vector<Train> newTrains;
+        newTrains.emplace_back("Sunrise", Train::Type::Limited_Express);
+        TrainStore::Write(filename, newTrains);
+
+        ASSERT_EQ(sizeOfTrains, oldStore.GetSize());
+        EXPECT_EQ(trains.back().name_, oldStore.Get(sizeOfTrains - 1).name.to_string());
+        TrainStore newStore(filename);
+        ASSERT_EQ(1, newStore.GetSize());
+        EXPECT_EQ("Sunrise", newStore.Get(0).name.to_string());
+    }
+
+    {
+        // 空のファイルも作れる
+        TrainStore::Write(filename, std::vector<Train>{});
+        TrainStore store(filename);
+        EXPECT_EQ(0, store.GetSize());
+        EXPECT_TRUE(store.FindByType(Train::Type::Local).empty());
+    }
+
+    boost::filesystem::remove(filename);
+}
+
+TEST_F(TestSerialization, StoreWriteFailure) {
+    // 置き換えられない場所に書くと、元の内容と書きかけのファイルを残さずに例外を投げる
+    const boost::filesystem::path dirname(getTemporaryFilename());
+    const auto target = dirname / "store";
+    const auto child = target / "child";
+    boost::filesystem::create_directories(target);
+    {
+        std::ofstream os(child.string());
+        os << "child";
+    }
+
+    std::vector<Train> trains;
+    trains.emplace_back("Sunrise", Train::Type::Limited_Express);
+    EXPECT_ANY_THROW(TrainStore::Write(target.string(), trains));
+    EXPECT_TRUE(boost::filesystem::is_directory(target));
+    EXPECT_TRUE(boost::filesystem::exists(child));
+
+    size_t sizeOfEntries = 0;
+    for(boost::filesystem::directory_iterator i(dirname), end; i != end; ++i) {
+        ++sizeOfEntries;
+    }
+    EXPECT_EQ(1, sizeOfEntries);
+
+    // ディレクトリが無ければ何も作らない
+    const auto missing = dirname / "missing" / "store";
+    EXPECT_ANY_THROW(TrainStore::Write(missing.string(), trains));
+    EXPECT_FALSE(boost::filesystem::exists(missing.parent_path()));
+
+    boost::filesystem::remove_all(dirname);
+}
+
+TEST_F(TestSerialization, StoreInvalid) {
+    const auto filename = getTemporaryFilename();
+
+    {
+        // 書けない列車があれば、ファイルを作らない
+        std::vector<Train> trains;
+        trains.emplace_back("Unnamed", Train::Type::Local);
+        trains.emplace_back("Broken", Train::Type::Local);
+        trains.back().type_ = static_cast<Train::Type>(3);
+        std::string actual;
+        try {
+            TrainStore::Write(filename, trains);
+        } catch(Train::InvalidValue& e) {
+            actual = e.what();
+        }
+        checkIfStartWith(actual, "Invalid number 3");
+        EXPECT_FALSE(boost::filesystem::exists(filename));
+    }
+
+    std::vector<Train> trains;
+    trains.emplace_back("Unnamed", Train::Type::Local);
+    trains.emplace_back("Sunrise", Train::Type::Rapid);
+    TrainStore::Write(filename, trains);
+    std::string image;
+    {
+        std::ifstream is(filename, std::ios::binary);
+        image.assign(std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>());
+    }
+
+    // 名前の位置、種別の順に置く
+    const size_t typePos = TrainStoreFormat::HeaderSize + 3 * sizeof(TrainStoreFormat::NameOffset);
+    auto brokenType = image;
+    brokenType.at(typePos + 1) = 3;
+    auto brokenOffset = image;
+    brokenOffset.at(TrainStoreFormat::HeaderSize + sizeof(TrainStoreFormat::NameOffset)) = 100;
+
+    const std::vector<std::pair<std::string, std::string>> testCases {
+        {brokenType, "Invalid number 3"},
+        {brokenOffset, "Invalid name offset"},
+        {image.substr(0, image.size() - 1), "Invalid name offset"},
+        {image.substr(0, typePos), "Truncated data"},
+        {"", "Invalid header"},
+        {image.substr(0, 4) + '\x02' + image.substr(5), "Unsupported version 2"}};
+
+    for(auto& test : testCases) {
+        {
+            std::ofstream os(filename, std::ios::binary | std::ios::trunc);
+            os.write(test.first.data(), static_cast<std::streamsize>(test.first.size()));
+        }
+
+        std::string actual;
+        try {
+            TrainStore store(filename);
+        } catch(Train::InvalidValue& e) {
+            actual = e.what();
+        }
+        checkIfStartWith(actual, test.second);
+    }
+
+    boost::filesystem::remove(filename);
+    EXPECT_THROW(TrainStore store(filename), std::ios_base::failure);
+}
+
+TEST_F(TestSerialization, BatchParse) {
+    const std::string text = "Sunrise Seto\n2\n"
+        "ラビット\n1\n"
+        "\n0\n"
+        "回送\n3\n"
+        "Unnamed\nA\n"
+        "Unnamed\n-1\n"
+        "Unnamed\n99999999999\n"
+        "Tottori Liner\n1\n"
+        "Truncated\n";
+
+    std::vector<Train> trains;
+    std::vector<TrainParseError> errors;
+    EXPECT_EQ(4, TrainTextParser::Parse(text.data(), text.size(), trains, errors));
+
+    ASSERT_EQ(4, trains.size());
+    EXPECT_EQ("Sunrise Seto", trains.at(0).name_);
+    EXPECT_EQ(Train::Type::Limited_Express, trains.at(0).type_);
+    EXPECT_EQ("ラビット", trains.at(1).name_);
+    EXPECT_EQ(Train::Type::Rapid, trains.at(1).type_);
+    EXPECT_TRUE(trains.at(2).name_.empty());
+    EXPECT_EQ(Train::Type::Local, trains.at(2).type_);
+    EXPECT_EQ("Tottori Liner", trains.at(3).name_);
+
+    using Reason = TrainParseError::Reason;
+    const std::vector<std::pair<size_t, Reason>> expected {
+        {3, Reason::INVALID_TYPE}, {4, Reason::INVALID_NUMBER}, {5, Reason::INVALID_TYPE},
+        {6, Reason::INVALID_NUMBER}, {8, Reason::TRUNCATED}};
+    ASSERT_EQ(expected.size(), errors.size());
+    for(size_t i = 0; i < expected.size(); ++i) {
+        EXPECT_EQ(expected.at(i).first, errors.at(i).record);
+        EXPECT_EQ(expected.at(i).second, errors.at(i).reason);
+    }
+    EXPECT_EQ(text.find("回送"), errors.at(0).offset);
+
+    // operator <<で書いたものを読める。最後の改行はなくてもよい。
+    std::ostringstream os;
+    os << trains.at(0) << "\n" << trains.at(1);
+    const auto written = os.str();
+    std::vector<Train> restored;
+    errors.clear();
+    EXPECT_EQ(2, TrainTextParser::Parse(written.data(), written.size(), restored, errors));
+    EXPECT_TRUE(errors.empty());
+    ASSERT_EQ(2, restored.size());
+    EXPECT_EQ("ラビット", restored.at(1).name_);
+}
+
+// 大量の列車を読む速さを比べる
+TEST_F(TestSerialization, BatchParseThroughput) {
+    constexpr size_t sizeOfTrains = 100000;
+    std::ostringstream os;
+    for(size_t i = 0; i < sizeOfTrains; ++i) {
+        const Train train("Train " + boost::lexical_cast<std::string>(i), static_cast<Train::Type>(i % 3));
+        os << train << "\n";
+    }
+    const auto text = os.str();
+
+    using Clock = std::chrono::steady_clock;
+    const ThroughputPrinter throughput(sizeOfTrains, "trains");
+
+    {
+        const auto start = Clock::now();
+        std::istringstream is(text);
+        std::vector<Train> trains;
+        for(size_t i = 0; i < sizeOfTrains; ++i) {
+            trains.emplace_back();
+            is >> trains.back();
+            // 種別の後の改行を読み飛ばす
+            is.ignore(1);
+        }
+        throughput.Print("operator >>", start);
+        EXPECT_EQ("Train 99999", trains.back().name_);
+    }
+
+    {
+        const auto start = Clock::now();
+        std::vector<Train> trains;
+        std::vector<TrainParseError> errors;
+        TrainTextParser::Parse(text.data(), text.size(), trains, errors);
+        throughput.Print("TrainTextParser", start);
+        EXPECT_TRUE(errors.empty());
+        ASSERT_EQ(sizeOfTrains, trains.size());
+        EXPECT_EQ("Train 99999", trains.back().name_);
+        EXPECT_EQ(Train::Type::Rapid, trains.at(1).type_);
+    }
+}
+
+class TestTrimAndExpand : public ::testing::Test {};
+
+TEST_F(TestTrimAndExpand, All) {
+    // 以前の実装
+    auto expected = [](std::string str) {
+        boost::replace_all(str, "\r\n", " ");
+        boost::replace_all(str, "\r", " ");
+        boost::replace_all(str, "\n", " ");
+        boost::trim(str);
+        return str;
+    };
+
+    const std::vector<std::string> testCases {
+        "", " ", "\r\n", "a", " a ", "\ta\v\f", "a\r\nb", "a\rb", "a\nb", "a\n\rb", "a\r\n\r\nb",
+        "\r\na\r\n", "\r", "a\r", "\nフラノラベンダー\r\nエクスプレス \r",
+        "0123456789abcdef0123456789abcdef\r\n0123456789abcdef\r0123456789abcdef\n ",
+        " 0123456789abcdef0123456789abcdef0123456789abcdef "};
+
+    for(auto& test : testCases) {
+        std::string actual = test;
+        TrimAndExpand(actual);
+        EXPECT_EQ(expected(test), actual);
+    }
+}
+
+// SpeedParameterとExtSpeedParameterを、sizeメンバで区切って並べたバイト列を列ごとに分けて持つ
+// 速度計はレコードごとにsizeメンバを調べたりキャストしたりせずに、列をまとめて処理できる
+class SpeedParameterColumns {
+public:
+    // 読めたレコードを列の後ろに足し、読んだバイト数を返す
+    // sizeメンバより短いバイト列しか残っていないレコードは読まないので、続きと一緒に渡し直す
+    size_t Append(const void* data, size_t size) {
+        const uint8_t* p = static_cast<const uint8_t*>(data);
+        const uint8_t* pEnd = p + size;
+
+        // 一番短いレコードが並んでいるとして確保し、後で縮める
+        const size_t first = size_;
+        const size_t capacity = first + size / sizeof(SpeedParameter);
+        indexes_.resize(capacity);
+        maxSpeeds_.resize(capacity);
+        validBits_.resize((capacity + BitsPerWord - 1) / BitsPerWord, 0);
+        extendedBits_.resize(validBits_.size(), 0);
+
+        // 列に書くたびにvectorの先頭を読み直さないようにする
+        int32_t* pIndexes = indexes_.data();
+        SpeedKph* pMaxSpeeds = maxSpeeds_.data();
+        uint64_t* pValidBits = validBits_.data();
+        uint64_t* pExtendedBits = extendedBits_.data();
+
+        size_t i = first;
+        while(static_cast<size_t>(pEnd - p) >= sizeof(SpeedParameter)) {
+            // 境界に揃っているとは限らないので複写する
+            SpeedParameter param;
+            std::memcpy(&param, p, sizeof(param));
+
+            // sizeメンバが短すぎるレコードは、SpeedParameterの大きさとみなして読み飛ばす
+            // 新しい版の長いレコードは、知っている部分だけ読む
+            // 壊れていて長すぎるレコードも不正とし、SpeedParameterの大きさだけ進める
+            // そうしないと、いつまでも続きを待つことになる
+            const bool oversized = (param.size > MaxRecordSize);
+            const size_t recordSize = oversized ? sizeof(SpeedParameter) :
+                std::max(param.size, sizeof(SpeedParameter));
+            if (recordSize > static_cast<size_t>(pEnd - p)) {
+                break;
+            }
+
+            const bool valid = (param.size >= sizeof(SpeedParameter)) & !oversized &
+                (static_cast<size_t>(param.index) < SPEED_COUNT);
+            const bool extended = valid & (param.size >= sizeof(ExtSpeedParameter));
+            // 拡張されているかどうかで分岐しないように、読める限り読んでから選ぶ
+            SpeedKph maxSpeed = 0;
+            constexpr size_t maxSpeedEnd = offsetof(ExtSpeedParameter, maxSpeed) + sizeof(maxSpeed);
+            if (static_cast<size_t>(pEnd - p) >= maxSpeedEnd) {
+                std::memcpy(&maxSpeed, p + offsetof(ExtSpeedParameter, maxSpeed), sizeof(maxSpeed));
+            }
+            // 三項演算子だと分岐することがあるので、マスクで選ぶ
+            maxSpeed &= -static_cast<SpeedKph>(extended);
+
+            pIndexes[i] = static_cast<int32_t>(param.index);
+            pMaxSpeeds[i] = maxSpeed;
+            pValidBits[i / BitsPerWord] |= static_cast<uint64_t>(valid) << (i % BitsPerWord);
+            pExtendedBits[i / BitsPerWord] |= static_cast<uint64_t>(extended) << (i % BitsPerWord);
+            ++i;
+            p += recordSize;
+        }
+
+        size_ = i;
+        indexes_.resize(size_);
+        maxSpeeds_.resize(size_);
+        validBits_.resize((size_ + BitsPerWord - 1) / BitsPerWord);
+        extendedBits_.resize(validBits_.size());
+        return static_cast<size_t>(p - static_cast<const uint8_t*>(data));
+    }
+
+    void Clear(void) {
+        size_ = 0;
+        indexes_.clear();
+        maxSpeeds_.clear();
+        validBits_.clear();
+        extendedBits_.clear();
+    }
+
+    size_t GetSize(void) const {
+        return size_;
+    }
+
+    // SpeedIndexを整数にしたもの
+    const std::vector<int32_t>& GetIndexes(void) const {
+        return indexes_;
+    }
+
+    // 拡張されていないレコードは0
+    const std::vector<SpeedKph>& GetMaxSpeeds(void) const {
+        return maxSpeeds_;
+    }
+
+    // i番目のレコードは、ビット列のi/64番目の要素のi%64ビット目
+    const std::vector<uint64_t>& GetValidBits(void) const {
+        return validBits_;
+    }
+
+    const std::vector<uint64_t>& GetExtendedBits(void) const {
+        return extendedBits_;
+    }
+
+    // SpeedParameterとして読めて、速度の段階が範囲内か
+    bool IsValid(size_t i) const {
+        return getBit(validBits_, i);
+    }
+
+    // ExtSpeedParameterとしても読めるか
+    bool IsExtended(size_t i) const {
+        return getBit(extendedBits_, i);
+    }
+
+    static constexpr size_t BitsPerWord = 64;
+    // これより長いsizeメンバは、壊れているとみなす
+    static constexpr size_t MaxRecordSize = 4096;
+
+private:
+    static bool getBit(const std::vector<uint64_t>& bits, size_t i) {
+        return (bits.at(i / BitsPerWord) >> (i % BitsPerWord)) & 1;
+    }
+
+    size_t size_ {0};
+    std::vector<int32_t> indexes_;
+    std::vector<SpeedKph> maxSpeeds_;
+    std::vector<uint64_t> validBits_;
+    std::vector<uint64_t> extendedBits_;
+};
+
+constexpr size_t SpeedParameterColumns::BitsPerWord;
+constexpr size_t SpeedParameterColumns::MaxRecordSize;
+
+// 通常の速度計
+class SpeedController {
+public:
+    virtual ~SpeedController(void) = default;
+
+    SpeedKph GetSpeed(const SpeedParameter& param) const {
+        return speedTable_[getTableIndex(param)];
+    }
+
+    // まとめて求める。speedsにはsize個の要素が必要である。
+    void GetSpeeds(const SpeedParameter* params, SpeedKph* speeds, size_t size) const {
+        size_t i = 0;
+#if defined(__SSE2__)
+        for(; (i + 4) <= size; i += 4) {
+            const SpeedParameter* p = params + i;
+            const __m128i indexes = gather4(p, [](const SpeedParameter& param) {
+                    return static_cast<int>(param.index); });
+            const __m128i valid = gather4(p, [](const SpeedParameter& param) {
+                    return -static_cast<int>(param.size >= sizeof(SpeedParameter)); });
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(speeds + i),
+                             _mm_and_si128(lookupSpeeds(indexes), valid));
+        }
+#endif
+        for(; i < size; ++i) {
+            speeds[i] = GetSpeed(params[i]);
+        }
+    }
+
+    // 列ごとに分けたレコードから、まとめて求める
+    void GetSpeeds(const SpeedParameterColumns& columns, SpeedKph* speeds) const {
+        const size_t size = columns.GetSize();
+        const int32_t* indexes = columns.GetIndexes().data();
+        size_t i = 0;
+#if defined(__SSE2__)
+        const uint64_t* validBits = columns.GetValidBits().data();
+        for(; (i + 4) <= size; i += 4) {
+            const __m128i valid = expand4Bits(validBits, i);
+            const __m128i lane = _mm_loadu_si128(reinterpret_cast<const __m128i*>(indexes + i));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(speeds + i), _mm_and_si128(lookupSpeeds(lane), valid));
+        }
+#endif
+        for(; i < size; ++i) {
+            speeds[i] = speedTable_[columns.IsValid(i) ? static_cast<size_t>(indexes[i]) :
+                                    static_cast<size_t>(SPEED_COUNT)];
+        }
+    }
+
+private:
+    friend class HighSpeedController;
+
+    // 不正な指示は番兵の位置を返す
+    static size_t getTableIndex(const SpeedParameter& param) {
+        const auto index = static_cast<size_t>(param.index);
+        const bool valid = (param.size >= sizeof(param)) & (index < SPEED_COUNT);
+        return valid ? index : static_cast<size_t>(SPEED_COUNT);
+    }
 
-// 通常の速度計
-class SpeedController {
-public:
-    virtual ~SpeedController(void) = default;
+#if defined(__SSE2__)
+    // 四つの要素からfuncで値を取り出して並べる
+    template <typename T, typename Func>
+    static __m128i gather4(const T* p, Func func) {
+        return _mm_set_epi32(func(p[3]), func(p[2]), func(p[1]), func(p[0]));
+    }
 
-    SpeedKph GetSpeed(const SpeedParameter& param) const {
-        SpeedKph speed = 0;
+    // ビット列のi番目から四ビットを、各32ビットの全ビットに広げる。iは4の倍数とする。
+    static __m128i expand4Bits(const uint64_t* bits, size_t i) {
+        const int nibble = static_cast<int>(
+            (bits[i / SpeedParameterColumns::BitsPerWord] >> (i % SpeedParameterColumns::BitsPerWord)) & 0xf);
+        const __m128i lanes = _mm_set_epi32(8, 4, 2, 1);
+        return _mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(nibble), lanes), lanes);
+    }
 
-        if (param.size >= sizeof(param)) {
-            // 本来ならテーブルをあらかじめ作っておくが、本題ではないので簡単に済ませる
-            switch(param.index) {
-            case SPEED_STOP:
-                break;
-            case SPEED_LOW:
-                speed = 45;
-                break;
-            case SPEED_MIDDLE:
-                speed = 70;
-                break;
-            case SPEED_HIGH:
-                // もっと速く走れる場合は読み替える
-                speed = 130;
-                break;
-            default:
-                break;
-            }
+    // 四つの速度の段階を、分岐せずに表の速度に置き換える。不正な段階は0になる。
+    static __m128i lookupSpeeds(__m128i indexes) {
+        __m128i speeds = _mm_setzero_si128();
+        for(int i = 0; i < SPEED_COUNT; ++i) {
+            const __m128i matched = _mm_cmpeq_epi32(indexes, _mm_set1_epi32(i));
+            speeds = _mm_or_si128(speeds, _mm_and_si128(matched, _mm_set1_epi32(speedTable_[i])));
         }
-
-        return speed;
+        return speeds;
     }
+#endif
+
+    // SpeedIndexの順に並べ、末尾に不正な指示の速度を置く
+    static constexpr SpeedKph speedTable_[] {
+        0,     // SPEED_STOP
+        45,    // SPEED_LOW
+        70,    // SPEED_MIDDLE
+        130,   // SPEED_HIGH : もっと速く走れる場合は読み替える
+        0};    // 不正な指示
+    static_assert((sizeof(speedTable_) / sizeof(speedTable_[0])) == (SPEED_COUNT + 1),
+                  "Must have all indexes and a sentinel");
 };
 
+constexpr SpeedKph SpeedController::speedTable_[];
+
 // 高速走行に対応した速度計
 class HighSpeedController {
 public:
@@ -457,7 +2389,81 @@ public:
         return std::min(maxSpeed_, extParam.maxSpeed);
     }
 
+    // SpeedParameterの配列には拡張部分が無いので、通常の速度計と同じになる
+    void GetSpeeds(const SpeedParameter* params, SpeedKph* speeds, size_t size) const {
+        base_.GetSpeeds(params, speeds, size);
+    }
+
+    // ExtSpeedParameterの配列から、まとめて求める
+    // sizeメンバがExtSpeedParameterより小さい要素は、SpeedParameterとして扱う
+    void GetSpeeds(const ExtSpeedParameter* params, SpeedKph* speeds, size_t size) const {
+        size_t i = 0;
+#if defined(__SSE2__)
+        const __m128i maxSpeed = _mm_set1_epi32(maxSpeed_);
+        const __m128i highIndex = _mm_set1_epi32(SPEED_HIGH);
+        for(; (i + 4) <= size; i += 4) {
+            const ExtSpeedParameter* p = params + i;
+            const __m128i indexes = SpeedController::gather4(p, [](const ExtSpeedParameter& param) {
+                    return static_cast<int>(param.base.index); });
+            const __m128i baseValid = SpeedController::gather4(p, [](const ExtSpeedParameter& param) {
+                    return -static_cast<int>(param.base.size >= sizeof(SpeedParameter)); });
+            const __m128i extValid = _mm_and_si128(
+                _mm_cmpeq_epi32(indexes, highIndex),
+                SpeedController::gather4(p, [](const ExtSpeedParameter& param) {
+                        return -static_cast<int>(param.base.size >= sizeof(ExtSpeedParameter)); }));
+            const __m128i requested = SpeedController::gather4(p, [](const ExtSpeedParameter& param) {
+                    return param.maxSpeed; });
+
+            // SSE2には32ビット整数のminが無いので、比較して選ぶ
+            const __m128i over = _mm_cmpgt_epi32(requested, maxSpeed);
+            const __m128i limited = select(over, maxSpeed, requested);
+            const __m128i base = _mm_and_si128(SpeedController::lookupSpeeds(indexes), baseValid);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(speeds + i), select(extValid, limited, base));
+        }
+#endif
+        for(; i < size; ++i) {
+            speeds[i] = GetSpeed(params[i].base);
+        }
+    }
+
+    // 列ごとに分けたレコードから、まとめて求める
+    void GetSpeeds(const SpeedParameterColumns& columns, SpeedKph* speeds) const {
+        const size_t size = columns.GetSize();
+        const int32_t* indexes = columns.GetIndexes().data();
+        const SpeedKph* maxSpeeds = columns.GetMaxSpeeds().data();
+        size_t i = 0;
+#if defined(__SSE2__)
+        const uint64_t* validBits = columns.GetValidBits().data();
+        const uint64_t* extendedBits = columns.GetExtendedBits().data();
+        const __m128i maxSpeed = _mm_set1_epi32(maxSpeed_);
+        const __m128i highIndex = _mm_set1_epi32(SPEED_HIGH);
+        for(; (i + 4) <= size; i += 4) {
+            const __m128i lane = _mm_loadu_si128(reinterpret_cast<const __m128i*>(indexes + i));
+            const __m128i requested = _mm_loadu_si128(reinterpret_cast<const __m128i*>(maxSpeeds + i));
+            const __m128i extValid = _mm_and_si128(SpeedController::expand4Bits(extendedBits, i),
+                                                   _mm_cmpeq_epi32(lane, highIndex));
+            const __m128i limited = select(_mm_cmpgt_epi32(requested, maxSpeed), maxSpeed, requested);
+            const __m128i base = _mm_and_si128(SpeedController::lookupSpeeds(lane),
+                                               SpeedController::expand4Bits(validBits, i));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(speeds + i), select(extValid, limited, base));
+        }
+#endif
+        for(; i < size; ++i) {
+            const size_t index = columns.IsValid(i) ? static_cast<size_t>(indexes[i]) :
+                static_cast<size_t>(SPEED_COUNT);
+            speeds[i] = (columns.IsExtended(i) && (index == SPEED_HIGH)) ?
+                std::min(maxSpeed_, maxSpeeds[i]) : SpeedController::speedTable_[index];
+        }
+    }
+
 private:
+#if defined(__SSE2__)
+    // maskのビットが立っていればa、そうでなければbを選ぶ
+    static __m128i select(__m128i mask, __m128i a, __m128i b) {
+        return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+    }
+#endif
+
     SpeedController base_;
     SpeedKph maxSpeed_ {0};
 };
@@ -522,6 +2528,379 @@ TEST_F(TestVersioning, Valid) {
     EXPECT_EQ(150, highCtrl.GetSpeed(paramOver.base));
 }
 
+TEST_F(TestVersioning, Batch) {
+    // 不正な指示も混ぜる
+    std::vector<ExtSpeedParameter> extParams;
+    for(size_t size : {sizeof(SpeedParameter) - 1, sizeof(SpeedParameter), sizeof(ExtSpeedParameter)}) {
+        for(int index = SPEED_STOP; index <= SPEED_COUNT; ++index) {
+            for(SpeedKph maxSpeed : {140, 160}) {
+                extParams.push_back({{size, static_cast<SpeedIndex>(index)}, maxSpeed});
+            }
+        }
+    }
+
+    std::vector<SpeedParameter> params;
+    for(const auto& param : extParams) {
+        params.push_back(param.base);
+    }
+
+    SpeedController ctrl;
+    HighSpeedController highCtrl(150);
+    std::vector<SpeedKph> speeds(extParams.size(), -1);
+
+    ctrl.GetSpeeds(params.data(), speeds.data(), params.size());
+    for(size_t i = 0; i < params.size(); ++i) {
+        EXPECT_EQ(ctrl.GetSpeed(params.at(i)), speeds.at(i));
+    }
+
+    highCtrl.GetSpeeds(params.data(), speeds.data(), params.size());
+    for(size_t i = 0; i < params.size(); ++i) {
+        EXPECT_EQ(ctrl.GetSpeed(params.at(i)), speeds.at(i));
+    }
+
+    highCtrl.GetSpeeds(extParams.data(), speeds.data(), extParams.size());
+    for(size_t i = 0; i < extParams.size(); ++i) {
+        EXPECT_EQ(highCtrl.GetSpeed(extParams.at(i).base), speeds.at(i));
+    }
+}
+
+namespace {
+    template <typename T>
+    void AppendRecord(std::vector<uint8_t>& stream, const T& record) {
+        const auto* p = reinterpret_cast<const uint8_t*>(&record);
+        stream.insert(stream.end(), p, p + sizeof(record));
+    }
+}
+
+TEST_F(TestVersioning, Columns) {
+    // 新しい版の、知らないメンバが後ろにあるレコード
+    struct FutureSpeedParameter {
+        ExtSpeedParameter base;
+        int64_t unknown;
+    };
+
+    std::vector<ExtSpeedParameter> expectedParams;
+    std::vector<uint8_t> stream;
+    for(int index = SPEED_STOP; index <= SPEED_COUNT; ++index) {
+        const auto speedIndex = static_cast<SpeedIndex>(index);
+        for(SpeedKph maxSpeed : {140, 160}) {
+            const SpeedParameter param {sizeof(SpeedParameter), speedIndex};
+            AppendRecord(stream, param);
+            expectedParams.push_back({param, 0});
+
+            const ExtSpeedParameter extParam {{sizeof(ExtSpeedParameter), speedIndex}, maxSpeed};
+            AppendRecord(stream, extParam);
+            expectedParams.push_back(extParam);
+
+            const FutureSpeedParameter futureParam {{{sizeof(FutureSpeedParameter), speedIndex}, maxSpeed}, -1};
+            AppendRecord(stream, futureParam);
+            expectedParams.push_back(futureParam.base);
+            expectedParams.back().base.size = sizeof(ExtSpeedParameter);
+
+            // 短すぎるsizeメンバは、SpeedParameterの大きさとみなす
+            const SpeedParameter shortParam {sizeof(SpeedParameter) - 1, speedIndex};
+            AppendRecord(stream, shortParam);
+            expectedParams.push_back({shortParam, 0});
+        }
+    }
+
+    // 途中で切れたレコードは読まない
+    const size_t wholeSize = stream.size();
+    const ExtSpeedParameter lastParam {{sizeof(ExtSpeedParameter), SPEED_HIGH}, 140};
+    AppendRecord(stream, lastParam);
+    stream.pop_back();
+
+    SpeedParameterColumns columns;
+    ASSERT_EQ(wholeSize, columns.Append(stream.data(), stream.size()));
+    ASSERT_EQ(expectedParams.size(), columns.GetSize());
+    for(size_t i = 0; i < columns.GetSize(); ++i) {
+        const auto& param = expectedParams.at(i);
+        const bool valid = (param.base.size >= sizeof(SpeedParameter)) && (param.base.index < SPEED_COUNT);
+        EXPECT_EQ(param.base.index, columns.GetIndexes().at(i));
+        EXPECT_EQ(valid, columns.IsValid(i));
+        EXPECT_EQ(valid && (param.base.size >= sizeof(ExtSpeedParameter)), columns.IsExtended(i));
+    }
+
+    SpeedController ctrl;
+    HighSpeedController highCtrl(150);
+    std::vector<SpeedKph> speeds(columns.GetSize(), -1);
+    ctrl.GetSpeeds(columns, speeds.data());
+    for(size_t i = 0; i < columns.GetSize(); ++i) {
+        EXPECT_EQ(ctrl.GetSpeed(expectedParams.at(i).base), speeds.at(i));
+    }
+    highCtrl.GetSpeeds(columns, speeds.data());
+    for(size_t i = 0; i < columns.GetSize(); ++i) {
+        EXPECT_EQ(highCtrl.GetSpeed(expectedParams.at(i).base), speeds.at(i));
+    }
+
+    // 残りを続きと一緒に渡すと読める
+    std::vector<uint8_t> rest(stream.begin() + static_cast<std::ptrdiff_t>(wholeSize), stream.end());
+    rest.push_back(reinterpret_cast<const uint8_t*>(&lastParam)[sizeof(lastParam) - 1]);
+    EXPECT_EQ(sizeof(lastParam), columns.Append(rest.data(), rest.size()));
+    ASSERT_EQ(expectedParams.size() + 1, columns.GetSize());
+    EXPECT_TRUE(columns.IsExtended(expectedParams.size()));
+    EXPECT_EQ(140, columns.GetMaxSpeeds().back());
+
+    columns.Clear();
+    EXPECT_EQ(0, columns.GetSize());
+    EXPECT_TRUE(columns.GetValidBits().empty());
+}
+
+TEST_F(TestVersioning, CorruptSize) {
+    // 壊れたsizeメンバの後ろに、正しいレコードが続く
+    std::vector<uint8_t> stream;
+    const SpeedParameter corruptParam {static_cast<size_t>(1) << 40, SPEED_HIGH};
+    AppendRecord(stream, corruptParam);
+    const SpeedParameter tooLongParam {SpeedParameterColumns::MaxRecordSize + 1, SPEED_HIGH};
+    AppendRecord(stream, tooLongParam);
+    const SpeedParameter param {sizeof(SpeedParameter), SPEED_MIDDLE};
+    AppendRecord(stream, param);
+    const ExtSpeedParameter extParam {{sizeof(ExtSpeedParameter), SPEED_HIGH}, 140};
+    AppendRecord(stream, extParam);
+
+    // 続きを待たずに読み進める
+    SpeedParameterColumns columns;
+    ASSERT_EQ(stream.size(), columns.Append(stream.data(), stream.size()));
+    ASSERT_EQ(4, columns.GetSize());
+    EXPECT_FALSE(columns.IsValid(0));
+    EXPECT_FALSE(columns.IsExtended(0));
+    EXPECT_FALSE(columns.IsValid(1));
+    EXPECT_TRUE(columns.IsValid(2));
+    EXPECT_TRUE(columns.IsExtended(3));
+    EXPECT_EQ(140, columns.GetMaxSpeeds().at(3));
+
+    SpeedController ctrl;
+    std::vector<SpeedKph> speeds(columns.GetSize(), -1);
+    ctrl.GetSpeeds(columns, speeds.data());
+    const std::vector<SpeedKph> expected {ctrl.GetSpeed(SpeedParameter{0, SPEED_STOP}),
+            ctrl.GetSpeed(SpeedParameter{0, SPEED_STOP}), ctrl.GetSpeed(param), ctrl.GetSpeed(extParam.base)};
+    EXPECT_EQ(expected, speeds);
+}
+
+TEST_F(TestVersioning, BatchThroughput) {
+    constexpr size_t sizeOfParams = 1000000;
+    std::vector<ExtSpeedParameter> params(sizeOfParams);
+    std::mt19937 gen;
+    std::uniform_int_distribution<int> indexDist(SPEED_STOP, SPEED_COUNT - 1);
+    std::uniform_int_distribution<SpeedKph> speedDist(100, 200);
+    for(auto& param : params) {
+        param.base.size = (gen() & 1) ? sizeof(ExtSpeedParameter) : sizeof(SpeedParameter);
+        param.base.index = static_cast<SpeedIndex>(indexDist(gen));
+        param.maxSpeed = speedDist(gen);
+    }
+
+    HighSpeedController highCtrl(150);
+    std::vector<SpeedKph> expected(sizeOfParams);
+    std::vector<SpeedKph> actual(sizeOfParams);
+
+    const ThroughputPrinter throughput(sizeOfParams, "records");
+
+    throughput.Measure("HighSpeedController::GetSpeed", [&](void) {
+            for(size_t i = 0; i < sizeOfParams; ++i) {
+                expected[i] = highCtrl.GetSpeed(params[i].base);
+            }
+        });
+    throughput.Measure("HighSpeedController::GetSpeeds", [&](void) {
+            highCtrl.GetSpeeds(params.data(), actual.data(), params.size());
+        });
+    EXPECT_EQ(expected, actual);
+
+    // 長さの異なるレコードを詰めて並べたバイト列から読む
+    std::vector<uint8_t> stream;
+    stream.reserve(sizeOfParams * sizeof(ExtSpeedParameter));
+    for(const auto& param : params) {
+        const auto* p = reinterpret_cast<const uint8_t*>(&param);
+        stream.insert(stream.end(), p, p + param.base.size);
+    }
+
+    std::vector<SpeedKph> fromStream(sizeOfParams);
+    throughput.Measure("Per-record size checks in a stream", [&](void) {
+            const uint8_t* p = stream.data();
+            for(size_t i = 0; i < sizeOfParams; ++i) {
+                ExtSpeedParameter param;
+                std::memcpy(&param.base, p, sizeof(param.base));
+                if (param.base.size >= sizeof(ExtSpeedParameter)) {
+                    std::memcpy(&param.maxSpeed, p + offsetof(ExtSpeedParameter, maxSpeed),
+                                sizeof(param.maxSpeed));
+                }
+                fromStream[i] = highCtrl.GetSpeed(param.base);
+                p += param.base.size;
+            }
+        });
+    EXPECT_EQ(expected, fromStream);
+
+    // 確保した領域を使い回す
+    SpeedParameterColumns columns;
+    columns.Append(stream.data(), stream.size());
+    columns.Clear();
+    throughput.Measure("SpeedParameterColumns::Append", [&](void) { columns.Append(stream.data(), stream.size()); });
+    throughput.Measure("HighSpeedController::GetSpeeds(columns)", [&](void) { highCtrl.GetSpeeds(columns, actual.data()); });
+    EXPECT_EQ(expected, actual);
+}
+
+// 整数だけを入れるハッシュ集合
+// 要素ごとにノードを確保せず、一つの配列に置いて線形に探す(open addressing)
+// 各要素に1バイトの制御情報(空、またはハッシュ値の下位7ビット)を置き、16個ずつまとめて比べる
+template<typename Key, typename Allocator = std::allocator<Key>>
+class FlatIntegerSet {
+    static_assert(std::is_integral<Key>::value, "Key must be an integer");
+    FRIEND_TEST(TestRandomNumber, FlatIntegerSetStrided);
+public:
+    explicit FlatIntegerSet(size_t expectedSize = 0) {
+        rehash(getCapacityFor(expectedSize));
+    }
+
+    virtual ~FlatIntegerSet(void) = default;
+
+    // 新たに加えたらtrueを返す
+    bool Insert(Key key) {
+        if ((size_ + 1) > getMaxSize(capacity_)) {
+            rehash(capacity_ * 2);
+        }
+
+        const auto hash = getHash(key);
+        size_t empty = 0;
+        if (find(key, hash, empty)) {
+            return false;
+        }
+
+        keys_[empty] = key;
+        controls_[empty] = static_cast<int8_t>(hash & 0x7f);
+        ++size_;
+        return true;
+    }
+
+    bool Contains(Key key) const {
+        size_t empty = 0;
+        return find(key, getHash(key), empty);
+    }
+
+    size_t GetSize(void) const {
+        return size_;
+    }
+
+    size_t GetCapacity(void) const {
+        return capacity_;
+    }
+
+    size_t GetMemoryUsage(void) const {
+        return capacity_ * (sizeof(Key) + sizeof(int8_t));
+    }
+
+private:
+    static constexpr size_t GroupSize = 16;
+    static constexpr int8_t Empty = -128;
+
+    // 7/8まで埋める
+    static size_t getMaxSize(size_t capacity) {
+        return capacity - capacity / 8;
+    }
+
+    static size_t getCapacityFor(size_t size) {
+        size_t capacity = GroupSize;
+        while(getMaxSize(capacity) < size) {
+            capacity *= 2;
+        }
+        return capacity;
+    }
+
+    // 制御情報とグループの位置はハッシュ値の下位ビットから取るので、鍵のすべてのビットを混ぜる
+    // 掛けるだけだと下位ビットは鍵の下位ビットだけで決まり、2のべき乗の倍数の鍵が一つのグループに集まる
+    // MurmurHash3のfmix64
+    static uint64_t getHash(Key key) {
+        auto hash = static_cast<uint64_t>(key);
+        hash ^= hash >> 33;
+        hash *= 0xff51afd7ed558ccdull;
+        hash ^= hash >> 33;
+        hash *= 0xc4ceb9fe1a85ec53ull;
+        hash ^= hash >> 33;
+        return hash;
+    }
+
+    // 16個の制御情報のうち、valueと等しいものをビットで返す
+    static unsigned int match(const int8_t* pGroup, int8_t value) {
+#if defined(__SSE2__)
+        const __m128i group = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pGroup));
+        return static_cast<unsigned int>(_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(value))));
+#else
+        unsigned int mask = 0;
+        for(size_t i = 0; i < GroupSize; ++i) {
+            mask |= (pGroup[i] == value) ? (1u << i) : 0;
+        }
+        return mask;
+#endif
+    }
+
+    // 見つからなければ、keyを置ける空きの位置をemptyに返す
+    bool find(Key key, uint64_t hash, size_t& empty) const {
+        const auto tag = static_cast<int8_t>(hash & 0x7f);
+        const size_t sizeOfGroups = capacity_ / GroupSize;
+        size_t group = static_cast<size_t>(hash >> 7) & (sizeOfGroups - 1);
+
+        for(;;) {
+            const size_t base = group * GroupSize;
+            const int8_t* pGroup = controls_.data() + base;
+            for(auto mask = match(pGroup, tag); mask; mask &= mask - 1) {
+                const size_t index = base + static_cast<size_t>(__builtin_ctz(mask));
+                if (keys_[index] == key) {
+                    return true;
+                }
+            }
+
+            // 消さないので、空きがあればその先にはない
+            const auto emptyMask = match(pGroup, Empty);
+            if (emptyMask) {
+                empty = base + static_cast<size_t>(__builtin_ctz(emptyMask));
+                return false;
+            }
+            group = (group + 1) & (sizeOfGroups - 1);
+        }
+    }
+
+    // 鍵を見つけるまでに調べるグループの数の最大値
+    size_t getMaxProbeLength(void) const {
+        const size_t sizeOfGroups = capacity_ / GroupSize;
+        size_t maxLength = 0;
+        for(size_t i = 0; i < capacity_; ++i) {
+            if (controls_[i] != Empty) {
+                const size_t home = static_cast<size_t>(getHash(keys_[i]) >> 7) & (sizeOfGroups - 1);
+                const size_t length = ((i / GroupSize - home) & (sizeOfGroups - 1)) + 1;
+                maxLength = std::max(maxLength, length);
+            }
+        }
+        return maxLength;
+    }
+
+    using KeyVector = std::vector<Key, Allocator>;
+    using ControlVector = std::vector<int8_t, typename std::allocator_traits<Allocator>::template rebind_alloc<int8_t>>;
+
+    void rehash(size_t capacity) {
+        KeyVector keys(capacity);
+        ControlVector controls(capacity, Empty);
+        keys.swap(keys_);
+        controls.swap(controls_);
+        capacity_ = capacity;
+        size_ = 0;
+
+        for(size_t i = 0; i < controls.size(); ++i) {
+            if (controls[i] != Empty) {
+                Insert(keys[i]);
+            }
+        }
+        return;
+    }
+
+    KeyVector keys_;
+    ControlVector controls_;
+    size_t capacity_ {0};
+    size_t size_ {0};
+};
+
+template<typename Key, typename Allocator>
+constexpr size_t FlatIntegerSet<Key, Allocator>::GroupSize;
+template<typename Key, typename Allocator>
+constexpr int8_t FlatIntegerSet<Key, Allocator>::Empty;
+
 class TestRandomNumber : public ::testing::Test{};
 
 namespace {
@@ -529,7 +2908,7 @@ namespace {
     template<typename T,
              typename R = typename std::result_of<decltype(&T::Get)(T)>::type>
     void CountRandomNumber(T& randomNumber, std::ostream& os) {
-        std::unordered_map<R, bool> board;
+        FlatIntegerSet<R> board(1000000);
         Count count=0;
         for(count=0; count<10; ++count) {
             os << randomNumber.Get() << ":";
@@ -537,11 +2916,12 @@ namespace {
         os << "\n";
 
         for(count=0; count<1000000; ++count) {
-            board[randomNumber.Get()] = true;
+            board.Insert(randomNumber.Get());
         }
 
-        std::cout << board.size() << "/" << count << " numbers are found \n";
-        EXPECT_LE((count / 100) * 99, count);
+        std::cout << board.GetSize() << "/" << count << " numbers are found \n";
+        // 32ビットの乱数を百万個作っても、ほとんど重ならない
+        EXPECT_LE((count / 100) * 99, board.GetSize());
         return;
     }
 }
@@ -549,8 +2929,534 @@ namespace {
 TEST_F(TestRandomNumber, List) {
     SoftwareRand sr;
     HardwareRand hr;
+    XoshiroRand xr;
     CountRandomNumber(sr, std::cout);
     CountRandomNumber(hr, std::cout);
+    CountRandomNumber(xr, std::cout);
+}
+
+TEST_F(TestRandomNumber, FlatIntegerSet) {
+    FlatIntegerSet<uint_fast32_t> board;
+    EXPECT_EQ(0, board.GetSize());
+    EXPECT_FALSE(board.Contains(0));
+
+    // 何度か拡げる
+    constexpr uint_fast32_t sizeOfKeys = 1000;
+    for(uint_fast32_t key = 0; key < sizeOfKeys; ++key) {
+        EXPECT_TRUE(board.Insert(key * 16));
+        EXPECT_FALSE(board.Insert(key * 16));
+    }
+    EXPECT_TRUE(board.Insert(std::numeric_limits<uint_fast32_t>::max()));
+
+    EXPECT_EQ(sizeOfKeys + 1, board.GetSize());
+    EXPECT_LE(board.GetSize(), board.GetCapacity());
+    for(uint_fast32_t key = 0; key < sizeOfKeys * 16; ++key) {
+        EXPECT_EQ(!(key % 16), board.Contains(key));
+    }
+    EXPECT_TRUE(board.Contains(std::numeric_limits<uint_fast32_t>::max()));
+}
+
+// 下位ビットが共通の鍵(揃えたポインタ、時刻、IDなど)を入れても、一つのグループに集まらない
+TEST_F(TestRandomNumber, FlatIntegerSetStrided) {
+    constexpr uint64_t sizeOfKeys = 100000;
+    // 散らばっていれば十数グループで見つかる。集まると表全体のグループを調べることになる。
+    constexpr size_t maxProbeLength = 32;
+    for(int shift : {0, 20, 32, 40}) {
+        FlatIntegerSet<uint64_t> board;
+        for(uint64_t i = 0; i < sizeOfKeys; ++i) {
+            EXPECT_TRUE(board.Insert(i << shift));
+        }
+
+        EXPECT_EQ(sizeOfKeys, board.GetSize());
+        for(uint64_t i = 0; i < sizeOfKeys; ++i) {
+            EXPECT_TRUE(board.Contains(i << shift));
+            EXPECT_FALSE(board.Contains((sizeOfKeys + i) << shift));
+        }
+
+        const auto probeLength = board.getMaxProbeLength();
+        std::cout << "i << " << shift << " : " << probeLength << " groups at most / "
+                  << (board.GetCapacity() / 16) << " groups\n";
+        EXPECT_GE(maxProbeLength, probeLength);
+    }
+}
+
+// 異なる乱数を数える速さと、使うメモリの量を比べる
+TEST_F(TestRandomNumber, DistinctCount) {
+    constexpr size_t sizeOfNumbers = 1000000;
+    std::vector<uint_fast32_t> numbers(sizeOfNumbers);
+    XoshiroRand xr;
+    xr.Fill(numbers);
+
+    const ThroughputPrinter throughput(sizeOfNumbers, "inserts");
+    size_t distinctCount = 0;
+    auto measure = [&](const std::string& name, auto func) {
+        g_allocationCount = 0;
+        g_allocationBytes = 0;
+        const auto start = ThroughputPrinter::Clock::now();
+        distinctCount = func();
+        throughput.Print(name, start, ", " + std::to_string(g_allocationCount.load()) + " allocations, "
+                         + std::to_string(g_allocationBytes.load() / 1024) + " KiB allocated");
+    };
+
+    measure("std::unordered_map", [&](void) {
+            std::unordered_map<uint_fast32_t, bool, std::hash<uint_fast32_t>, std::equal_to<uint_fast32_t>,
+                               CountingAllocator<std::pair<const uint_fast32_t, bool>>> board;
+            for(auto n : numbers) {
+                board[n] = true;
+            }
+            return board.size();
+        });
+    const auto expected = distinctCount;
+
+    measure("FlatIntegerSet", [&](void) {
+            FlatIntegerSet<uint_fast32_t, CountingAllocator<uint_fast32_t>> board;
+            for(auto n : numbers) {
+                board.Insert(n);
+            }
+            return board.GetSize();
+        });
+    EXPECT_EQ(expected, distinctCount);
+
+    measure("FlatIntegerSet (reserved)", [&](void) {
+            FlatIntegerSet<uint_fast32_t, CountingAllocator<uint_fast32_t>> board(sizeOfNumbers);
+            for(auto n : numbers) {
+                board.Insert(n);
+            }
+            return board.GetSize();
+        });
+    EXPECT_EQ(expected, distinctCount);
+}
+
+namespace {
+    // わざと偏らせた乱数。検定が偏りを見つけることを確かめる。
+    class CounterRand : public RandomNumber<CounterRand> {
+    public:
+        explicit CounterRand(uint32_t seed) : number_(seed) {}
+    private:
+        friend class RandomNumber<CounterRand>;
+        uint_fast32_t impl() {
+            return number_++;
+        }
+        uint32_t number_ {0};
+    };
+
+    // 正規分布の上側確率
+    double GetNormalUpperP(double z) {
+        return 0.5 * std::erfc(z / std::sqrt(2.0));
+    }
+
+    // 正規分布の両側確率
+    double GetNormalTwoSidedP(double z) {
+        return std::erfc(std::fabs(z) / std::sqrt(2.0));
+    }
+
+    // 乱数の統計的な検定
+    // 区間ごとに集計して合算できるので、スレッドごとに別の生成器で集計して後で合わせる
+    class RandomnessStats {
+    public:
+        static constexpr size_t SizeOfBuckets = 256;    // 上位8ビットで分ける
+        static constexpr size_t SizeOfBirthdays = 512;  // 誕生日の間隔検定で一度に使う数(Marsagliaと同じ)
+        static constexpr int DayBits = 24;              // 一年を2^24日とする
+
+        // numbersを一続きの列として集計する
+        void Add(const uint_fast32_t* numbers, size_t size) {
+            count_ += size;
+            addBuckets(numbers, size);
+            addSerial(numbers, size);
+            addRuns(numbers, size);
+            addBirthdays(numbers, size);
+        }
+
+        void Merge(const RandomnessStats& other) {
+            count_ += other.count_;
+            for(size_t i = 0; i < SizeOfBuckets; ++i) {
+                buckets_[i] += other.buckets_[i];
+            }
+            sumX_ += other.sumX_;
+            sumY_ += other.sumY_;
+            sumXX_ += other.sumXX_;
+            sumYY_ += other.sumYY_;
+            sumXY_ += other.sumXY_;
+            pairs_ += other.pairs_;
+            runs_ += other.runs_;
+            expectedRuns_ += other.expectedRuns_;
+            runsVariance_ += other.runsVariance_;
+            birthdaySamples_ += other.birthdaySamples_;
+            birthdayCollisions_ += other.birthdayCollisions_;
+        }
+
+        uint64_t GetCount(void) const {
+            return count_;
+        }
+
+        // 各バケツに均等に入るか(カイ二乗検定)
+        double GetChiSquareP(void) const {
+            const double expected = static_cast<double>(count_) / SizeOfBuckets;
+            double chiSquare = 0.0;
+            for(auto bucket : buckets_) {
+                const double diff = static_cast<double>(bucket) - expected;
+                chiSquare += diff * diff / expected;
+            }
+
+            // Wilson-Hilfertyの近似で正規分布にする
+            const double k = SizeOfBuckets - 1;
+            const double z = (std::cbrt(chiSquare / k) - (1.0 - 2.0 / (9.0 * k))) / std::sqrt(2.0 / (9.0 * k));
+            return GetNormalUpperP(z);
+        }
+
+        // 隣り合う数の相関係数が0か
+        double GetSerialCorrelationP(void) const {
+            const double n = static_cast<double>(pairs_);
+            const double covariance = n * sumXY_ - sumX_ * sumY_;
+            const double variance = std::sqrt((n * sumXX_ - sumX_ * sumX_) * (n * sumYY_ - sumY_ * sumY_));
+            const double r = covariance / variance;
+            return GetNormalTwoSidedP(r * std::sqrt(n));
+        }
+
+        // 最上位ビットの連の数が期待通りか(Wald-Wolfowitzの連検定)
+        double GetRunsP(void) const {
+            // 最上位ビットが変わらなければ、明らかに乱数ではない
+            if (!(runsVariance_ > 0.0)) {
+                return 0.0;
+            }
+            return GetNormalTwoSidedP((runs_ - expectedRuns_) / std::sqrt(runsVariance_));
+        }
+
+        // 誕生日の間隔が重なる数が、平均m^3/4nのポアソン分布に従うか
+        double GetBirthdaySpacingsP(void) const {
+            const double m = SizeOfBirthdays;
+            const double n = static_cast<double>(1u << DayBits);
+            const double lambda = m * m * m / (4.0 * n) * static_cast<double>(birthdaySamples_);
+            return GetNormalTwoSidedP((static_cast<double>(birthdayCollisions_) - lambda) / std::sqrt(lambda));
+        }
+
+    private:
+        void addBuckets(const uint_fast32_t* numbers, size_t size) {
+            for(size_t i = 0; i < size; ++i) {
+                ++buckets_[(numbers[i] >> 24) & 0xff];
+            }
+        }
+
+        void addSerial(const uint_fast32_t* numbers, size_t size) {
+            constexpr double scale = 1.0 / 4294967296.0;
+            for(size_t i = 1; i < size; ++i) {
+                const double x = static_cast<double>(numbers[i - 1] & 0xffffffffu) * scale;
+                const double y = static_cast<double>(numbers[i] & 0xffffffffu) * scale;
+                sumX_ += x;
+                sumY_ += y;
+                sumXX_ += x * x;
+                sumYY_ += y * y;
+                sumXY_ += x * y;
+            }
+            pairs_ += (size > 1) ? (size - 1) : 0;
+        }
+
+        void addRuns(const uint_fast32_t* numbers, size_t size) {
+            if (size < 2) {
+                return;
+            }
+
+            double ones = 0.0;
+            double runs = 1.0;
+            for(size_t i = 0; i < size; ++i) {
+                const auto bit = (numbers[i] >> 31) & 1;
+                ones += static_cast<double>(bit);
+                if (i && (bit != ((numbers[i - 1] >> 31) & 1))) {
+                    runs += 1.0;
+                }
+            }
+
+            const double n = static_cast<double>(size);
+            const double zeros = n - ones;
+            const double product = 2.0 * ones * zeros;
+            runs_ += runs;
+            expectedRuns_ += product / n + 1.0;
+            runsVariance_ += product * (product - n) / (n * n * (n - 1.0));
+        }
+
+        void addBirthdays(const uint_fast32_t* numbers, size_t size) {
+            std::array<uint32_t, SizeOfBirthdays> days;
+            std::array<uint32_t, SizeOfBirthdays> spacings;
+            for(size_t base = 0; (base + SizeOfBirthdays) <= size; base += SizeOfBirthdays) {
+                for(size_t i = 0; i < SizeOfBirthdays; ++i) {
+                    days[i] = static_cast<uint32_t>((numbers[base + i] & 0xffffffffu) >> (32 - DayBits));
+                }
+                std::sort(days.begin(), days.end());
+                spacings[0] = days[0];
+                for(size_t i = 1; i < SizeOfBirthdays; ++i) {
+                    spacings[i] = days[i] - days[i - 1];
+                }
+                std::sort(spacings.begin(), spacings.end());
+                for(size_t i = 1; i < SizeOfBirthdays; ++i) {
+                    birthdayCollisions_ += (spacings[i] == spacings[i - 1]) ? 1 : 0;
+                }
+                ++birthdaySamples_;
+            }
+        }
+
+        uint64_t count_ {0};
+        std::array<uint64_t, SizeOfBuckets> buckets_ {{0}};
+        double sumX_ {0.0};
+        double sumY_ {0.0};
+        double sumXX_ {0.0};
+        double sumYY_ {0.0};
+        double sumXY_ {0.0};
+        uint64_t pairs_ {0};
+        double runs_ {0.0};
+        double expectedRuns_ {0.0};
+        double runsVariance_ {0.0};
+        uint64_t birthdaySamples_ {0};
+        uint64_t birthdayCollisions_ {0};
+    };
+
+    struct BatteryResult {
+        RandomnessStats stats;
+        double generationSec {0.0};  // 各スレッドが乱数を作るのに掛かった時間の平均
+        double elapsedSec {0.0};     // 検定を含めた経過時間
+    };
+
+    // sizeOfThreads個のスレッドで、それぞれmakeGenerator(スレッド番号)で作った生成器の乱数を検定する
+    // 数十億個を試すときはsizeOfNumbersを増やす
+    template<typename Factory>
+    BatteryResult RunBattery(Factory makeGenerator, uint64_t sizeOfNumbers, size_t sizeOfThreads) {
+        constexpr size_t chunkSize = 65536;
+        const uint64_t sizeOfChunks = (sizeOfNumbers + chunkSize - 1) / chunkSize;
+        std::atomic<uint64_t> nextChunk {0};
+
+        using Clock = std::chrono::steady_clock;
+        std::vector<RandomnessStats> statsSet(sizeOfThreads);
+        std::vector<double> generationSecSet(sizeOfThreads, 0.0);
+        const auto start = Clock::now();
+        {
+            std::vector<std::thread> threads;
+            for(size_t i = 0; i < sizeOfThreads; ++i) {
+                threads.emplace_back([&, i](void) {
+                        auto pGenerator = makeGenerator(i);
+                        std::vector<uint_fast32_t> numbers(chunkSize);
+                        std::chrono::nanoseconds generation {0};
+                        // 区間を取り合うので、速いスレッドが多く処理する
+                        while(nextChunk.fetch_add(1, std::memory_order_relaxed) < sizeOfChunks) {
+                            const auto fillStart = Clock::now();
+                            pGenerator->Fill(numbers);
+                            generation += Clock::now() - fillStart;
+                            statsSet.at(i).Add(numbers.data(), numbers.size());
+                        }
+                        generationSecSet.at(i) = std::chrono::duration<double>(generation).count();
+                    });
+            }
+            for(auto& t : threads) {
+                t.join();
+            }
+        }
+
+        BatteryResult result;
+        result.elapsedSec = std::chrono::duration<double>(Clock::now() - start).count();
+        for(size_t i = 0; i < sizeOfThreads; ++i) {
+            result.stats.Merge(statsSet.at(i));
+            result.generationSec += generationSecSet.at(i) / static_cast<double>(sizeOfThreads);
+        }
+        return result;
+    }
+
+    void PrintBatteryResult(const std::string& name, const BatteryResult& result) {
+        const auto count = static_cast<double>(result.stats.GetCount());
+        std::cout << name << " : " << result.stats.GetCount() << " numbers, "
+                  << static_cast<long long>(count / std::max(result.generationSec, 1e-9)) << " numbers/sec generated, "
+                  << static_cast<long long>(count / std::max(result.elapsedSec, 1e-9)) << " numbers/sec tested\n"
+                  << "  p-values : chi-square " << result.stats.GetChiSquareP()
+                  << ", serial correlation " << result.stats.GetSerialCorrelationP()
+                  << ", runs " << result.stats.GetRunsP()
+                  << ", birthday spacings " << result.stats.GetBirthdaySpacingsP() << "\n";
+    }
+}
+
+// 各生成器を、スレッドごとに別の系列で検定する
+TEST_F(TestRandomNumber, Battery) {
+    const size_t sizeOfThreads = std::max(1u, std::thread::hardware_concurrency());
+    // 偶然に落ちることがないように、十分小さいp値だけを失敗とする
+    constexpr double minP = 1e-6;
+    auto check = [&](const std::string& name, const BatteryResult& result) {
+        PrintBatteryResult(name, result);
+        EXPECT_LT(minP, result.stats.GetChiSquareP());
+        EXPECT_LT(minP, result.stats.GetSerialCorrelationP());
+        EXPECT_LT(minP, result.stats.GetRunsP());
+        EXPECT_LT(minP, result.stats.GetBirthdaySpacingsP());
+    };
+
+    check("XoshiroRand", RunBattery([](size_t stream) { return std::make_unique<XoshiroRand>(stream); },
+                                    1ull << 24, sizeOfThreads));
+    check("SoftwareRand", RunBattery([](size_t) { return std::make_unique<SoftwareRand>(); },
+                                     1ull << 22, sizeOfThreads));
+    // すべてのスレッドが一つのプールを共有する
+    check("HardwareRand", RunBattery([](size_t) { return std::make_unique<HardwareRand>(); },
+                                     1ull << 22, sizeOfThreads));
+}
+
+TEST_F(TestRandomNumber, BatteryDetectsBias) {
+    const auto result = RunBattery(
+        [](size_t stream) { return std::make_unique<CounterRand>(static_cast<uint32_t>(stream << 28)); }, 1ull << 20, 2);
+    PrintBatteryResult("CounterRand", result);
+    EXPECT_GT(1e-6, result.stats.GetChiSquareP());
+    EXPECT_GT(1e-6, result.stats.GetSerialCorrelationP());
+    EXPECT_GT(1e-6, result.stats.GetRunsP());
+    EXPECT_GT(1e-6, result.stats.GetBirthdaySpacingsP());
+}
+
+TEST_F(TestRandomNumber, Fill) {
+    constexpr uint64_t seed = 12345;
+    XoshiroRand expected(seed);
+    XoshiroRand actual(seed);
+
+    // Getで途中まで読んだ後も、Fillは続きを返す
+    std::vector<uint_fast32_t> numbers(3 + XoshiroRand::Lanes * 4 + 5);
+    for(size_t i = 0; i < 3; ++i) {
+        numbers.at(i) = actual.Get();
+    }
+    actual.Fill(numbers.data() + 3, numbers.size() - 3);
+    for(auto n : numbers) {
+        EXPECT_EQ(expected.Get(), n);
+    }
+    EXPECT_EQ(expected.Get(), actual.Get());
+
+    // 既定の実装はGetを繰り返す
+    SoftwareRand sr;
+    sr.Fill(numbers);
+    EXPECT_NE(numbers.front(), numbers.back());
+}
+
+// 乱数を作る速さを比べる
+TEST_F(TestRandomNumber, FillThroughput) {
+    constexpr size_t sizeOfNumbers = 1000000;
+    std::vector<uint_fast32_t> numbers(sizeOfNumbers);
+
+    const ThroughputPrinter throughput(sizeOfNumbers, "numbers");
+
+    std::mt19937 mt;
+    throughput.Measure("std::mt19937", [&](void) {
+            for(auto& n : numbers) {
+                n = mt();
+            }
+        });
+
+    SoftwareRand sr;
+    throughput.Measure("SoftwareRand::Fill", [&](void) { sr.Fill(numbers); });
+    HardwareRand hr;
+    throughput.Measure("HardwareRand::Fill", [&](void) { hr.Fill(numbers); });
+
+    XoshiroRand xr;
+    throughput.Measure("XoshiroRand::Get", [&](void) {
+            for(auto& n : numbers) {
+                n = xr.Get();
+            }
+        });
+    throughput.Measure("XoshiroRand::Fill", [&](void) { xr.Fill(numbers); });
+}
+
+// 命令が失敗しても、再試行するかソフトウェアで作る
+TEST_F(TestRandomNumber, EntropyPoolFailure) {
+    const size_t poolSize = EntropyPool::PoolSize;
+    {
+        // 三回に二回失敗する
+        uint32_t count = 0;
+        uint32_t number = 0;
+        EntropyPool pool([&](uint32_t& n) {
+                ++count;
+                if (count % 3) {
+                    return false;
+                }
+                n = ++number;
+                return true;
+            });
+        EXPECT_TRUE(pool.IsHardware());
+        for(uint32_t i = 1; i <= poolSize * 2; ++i) {
+            ASSERT_EQ(i, pool.Get());
+        }
+        EXPECT_EQ(0, pool.GetFallbackCount());
+    }
+
+    {
+        // 常に失敗する
+        EntropyPool pool([](uint32_t& n) { return false; });
+        std::vector<uint32_t> numbers(poolSize);
+        pool.Fill(numbers.data(), numbers.size());
+        EXPECT_EQ(poolSize, pool.GetFallbackCount());
+        std::sort(numbers.begin(), numbers.end());
+        EXPECT_NE(numbers.front(), numbers.back());
+    }
+
+    {
+        // 命令がない
+        EntropyPool pool {EntropyPool::Step()};
+        EXPECT_FALSE(pool.IsHardware());
+        pool.Get();
+        EXPECT_EQ(poolSize, pool.GetFallbackCount());
+    }
+
+    std::cout << "RDRAND:" << HasRdrand() << ", RDSEED:" << HasRdseed() << "\n";
+    if (HasRdseed()) {
+        EntropyPool pool(StepRdseed);
+        pool.Get();
+        std::cout << pool.GetFallbackCount() << " numbers are made by software instead of RDSEED\n";
+    }
+}
+
+// 複数のスレッドが一つのプールから取っても、同じ数を二度配らない
+TEST_F(TestRandomNumber, EntropyPoolThreads) {
+    std::atomic<uint32_t> number {0};
+    EntropyPool pool([&](uint32_t& n) {
+            n = ++number;
+            return true;
+        });
+
+    constexpr size_t sizeOfThreads = 4;
+    constexpr size_t sizeOfNumbers = 10000;
+    std::vector<std::vector<uint32_t>> numberSet(sizeOfThreads);
+    std::vector<std::thread> threads;
+    for(size_t i = 0; i < sizeOfThreads; ++i) {
+        threads.emplace_back([&pool, &numbers=numberSet.at(i)](void) {
+                for(size_t n = 0; n < sizeOfNumbers; ++n) {
+                    numbers.push_back(pool.Get());
+                }
+            });
+    }
+    for(auto& t : threads) {
+        t.join();
+    }
+
+    std::vector<uint32_t> all;
+    for(auto& numbers : numberSet) {
+        all.insert(all.end(), numbers.begin(), numbers.end());
+    }
+    std::sort(all.begin(), all.end());
+    EXPECT_EQ(all.end(), std::adjacent_find(all.begin(), all.end()));
+    EXPECT_EQ(sizeOfThreads * sizeOfNumbers, all.size());
+}
+
+// 一つずつ命令を実行するのと、まとめて作り置くのとを比べる
+TEST_F(TestRandomNumber, EntropyPoolThroughput) {
+    constexpr size_t sizeOfNumbers = 1000000;
+    std::vector<uint32_t> numbers(sizeOfNumbers);
+
+    const ThroughputPrinter throughput(sizeOfNumbers, "numbers");
+
+    if (HasRdrand()) {
+        throughput.Measure("rdrand", [&](void) {
+                for(auto& n : numbers) {
+                    while(!StepRdrand(n)) {}
+                }
+            });
+    }
+
+    EntropyPool pool;
+    throughput.Measure("EntropyPool::Get", [&](void) {
+            for(auto& n : numbers) {
+                n = pool.Get();
+            }
+        });
+    throughput.Measure("EntropyPool::Fill", [&](void) { pool.Fill(numbers.data(), numbers.size()); });
+
+    EntropyPool softwarePool {EntropyPool::Step()};
+    throughput.Measure("EntropyPool::Fill (software)", [&](void) { softwarePool.Fill(numbers.data(), numbers.size()); });
 }
 
 /*
@@ -0,0 +1,579 @@
+// スレッドを置く論理CPUを決める
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <boost/filesystem.hpp>
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#elif defined(_WIN32) || defined(__CYGWIN__)
+#include <windows.h>
+#endif
+#include <gtest/gtest.h>
+#include "cppFriendsAffinity.hpp"
+
+namespace CpuAffinity {
+    namespace {
+        const std::string DefaultSysfsRoot = "/sys/devices/system";
+
+        // ファイルの先頭行を読む。読めなければfalseを返す。
+        bool readLine(const std::string& filename, std::string& line) {
+            std::ifstream is(filename);
+            return static_cast<bool>(std::getline(is, line));
+        }
+
+        bool readNumber(const std::string& filename, int& number) {
+            std::string line;
+            if (!readLine(filename, line)) {
+                return false;
+            }
+
+            std::istringstream is(line);
+            return static_cast<bool>(is >> number);
+        }
+
+        // 論理CPU番号の上限。LinuxのNR_CPUSの最大値に合わせる。
+        constexpr CpuId MaxSizeOfCpus = 8192;
+
+        // 十進数の論理CPU番号を読む。数字以外があるか、上限を超えたらfalseを返す。
+        bool parseCpuId(const std::string& str, CpuId& cpu) {
+            if (str.empty() || (str.size() > 5) ||
+                !std::all_of(str.begin(), str.end(),
+                             [](char c) { return std::isdigit(static_cast<unsigned char>(c)); })) {
+                return false;
+            }
+
+            cpu = std::stoi(str);
+            return cpu < MaxSizeOfCpus;
+        }
+
+        // 物理コアを区別する
+        using CoreKey = std::pair<int, int>;
+        CoreKey getCoreKey(const LogicalCpu& cpu) {
+            return CoreKey(cpu.packageId, cpu.coreId);
+        }
+    }
+
+    CpuSet ParseCpuList(const std::string& cpuList) {
+        std::set<CpuId> cpus;
+        std::istringstream is(cpuList);
+        std::string range;
+
+        while(std::getline(is, range, ',')) {
+            // 前後の改行や空白は無視する
+            const std::string spaces = " \t\n\v\f\r";
+            const auto firstPos = range.find_first_not_of(spaces);
+            if (firstPos == std::string::npos) {
+                continue;
+            }
+            range = range.substr(firstPos, range.find_last_not_of(spaces) + 1 - firstPos);
+
+            const auto separatorPos = range.find('-');
+            CpuId first = 0;
+            CpuId last = 0;
+            if (!parseCpuId(range.substr(0, separatorPos), first)) {
+                return CpuSet();
+            }
+            if (separatorPos == std::string::npos) {
+                last = first;
+            } else if (!parseCpuId(range.substr(separatorPos + 1), last) || (last < first)) {
+                return CpuSet();
+            }
+
+            for(CpuId cpu = first; cpu <= last; ++cpu) {
+                cpus.insert(cpu);
+            }
+        }
+
+        return CpuSet(cpus.begin(), cpus.end());
+    }
+
+    CpuTopology::CpuTopology(void) {
+        readSysfs(DefaultSysfsRoot);
+
+        // このプロセスが使えない論理CPUは除く
+        CpuSet allowed;
+        if (GetProcessAffinity(allowed) && !allowed.empty()) {
+            std::vector<LogicalCpu> cpus;
+            std::copy_if(cpus_.begin(), cpus_.end(), std::back_inserter(cpus), [&](const LogicalCpu& cpu) {
+                    return std::binary_search(allowed.begin(), allowed.end(), cpu.id); });
+            if (!cpus.empty()) {
+                cpus_.swap(cpus);
+            }
+        }
+    }
+
+    CpuTopology::CpuTopology(const std::string& sysfsRoot) {
+        readSysfs(sysfsRoot);
+    }
+
+    const std::vector<LogicalCpu>& CpuTopology::GetCpus(void) const {
+        return cpus_;
+    }
+
+    size_t CpuTopology::GetSizeOfCores(void) const {
+        std::set<CoreKey> cores;
+        for(auto& cpu : cpus_) {
+            cores.insert(getCoreKey(cpu));
+        }
+        return cores.size();
+    }
+
+    size_t CpuTopology::GetSizeOfPackages(void) const {
+        std::set<int> packages;
+        for(auto& cpu : cpus_) {
+            packages.insert(cpu.packageId);
+        }
+        return packages.size();
+    }
+
+    size_t CpuTopology::GetSizeOfNodes(void) const {
+        std::set<int> nodes;
+        for(auto& cpu : cpus_) {
+            nodes.insert(cpu.nodeId);
+        }
+        return nodes.size();
+    }
+
+    CpuSet CpuTopology::GetSmtSiblings(CpuId cpuId) const {
+        CpuSet siblings;
+        auto it = std::find_if(cpus_.begin(), cpus_.end(), [=](const LogicalCpu& cpu) { return cpu.id == cpuId; });
+        if (it == cpus_.end()) {
+            return siblings;
+        }
+
+        const auto key = getCoreKey(*it);
+        for(auto& cpu : cpus_) {
+            if (getCoreKey(cpu) == key) {
+                siblings.push_back(cpu.id);
+            }
+        }
+        return siblings;
+    }
+
+    CpuSet CpuTopology::FindPlacement(Placement placement, size_t sizeOfThreads) const {
+        CpuSet result;
+        if (!sizeOfThreads || cpus_.empty()) {
+            return result;
+        }
+
+        // 物理コアごと、ソケットごとに論理CPUをまとめる
+        std::map<CoreKey, CpuSet> cores;
+        std::map<int, CpuSet> packages;  // 物理コアごとに、最初の論理CPUだけを入れる
+        for(auto& cpu : cpus_) {
+            auto& siblings = cores[getCoreKey(cpu)];
+            if (siblings.empty()) {
+                packages[cpu.packageId].push_back(cpu.id);
+            }
+            siblings.push_back(cpu.id);
+        }
+
+        switch(placement) {
+        case Placement::SINGLE_CPU:
+            result.assign(sizeOfThreads, cpus_.front().id);
+            break;
+        case Placement::SAME_CORE_SMT:
+            // SMT siblingsがある物理コアを、順に埋める
+            for(auto& core : cores) {
+                if (core.second.size() >= 2) {
+                    result.insert(result.end(), core.second.begin(), core.second.end());
+                }
+            }
+            break;
+        case Placement::CROSS_CORE: {
+            // 物理コアが最も多いソケットで、物理コアごとに一つずつ使う
+            auto it = std::max_element(packages.begin(), packages.end(),
+                                       [](const std::pair<const int, CpuSet>& l, const std::pair<const int, CpuSet>& r) {
+                                           return l.second.size() < r.second.size(); });
+            if ((it->second.size() >= 2) || (sizeOfThreads == 1)) {
+                result = it->second;
+            }
+            break;
+        }
+        case Placement::CROSS_SOCKET:
+            // ソケットを順に巡り、物理コアを一つずつ使う
+            if (packages.size() >= 2) {
+                for(size_t index = 0; result.size() < cpus_.size(); ++index) {
+                    const auto previousSize = result.size();
+                    for(auto& package : packages) {
+                        if (index < package.second.size()) {
+                            result.push_back(package.second.at(index));
+                        }
+                    }
+                    if (previousSize == result.size()) {
+                        break;
+                    }
+                }
+            }
+            break;
+        default:
+            break;
+        }
+
+        if (result.size() < sizeOfThreads) {
+            return CpuSet();
+        }
+        result.resize(sizeOfThreads);
+        return result;
+    }
+
+    void CpuTopology::readSysfs(const std::string& sysfsRoot) {
+        cpus_.clear();
+        std::string line;
+        if (!readLine(sysfsRoot + "/cpu/online", line)) {
+            setFlat();
+            return;
+        }
+
+        for(auto id : ParseCpuList(line)) {
+            LogicalCpu cpu;
+            cpu.id = id;
+            const auto topologyDir = sysfsRoot + "/cpu/cpu" + std::to_string(id) + "/topology/";
+            // 読めなければ、論理CPUごとに別の物理コアとみなす
+            if (!readNumber(topologyDir + "core_id", cpu.coreId)) {
+                cpu.coreId = id;
+            }
+            if (!readNumber(topologyDir + "physical_package_id", cpu.packageId) || (cpu.packageId < 0)) {
+                cpu.packageId = 0;
+            }
+            cpus_.push_back(cpu);
+        }
+
+        if (cpus_.empty()) {
+            setFlat();
+            return;
+        }
+
+        // NUMAノードがなければ、すべてノード0にあるとみなす
+        const boost::filesystem::path nodeDir(sysfsRoot + "/node");
+        boost::system::error_code ec;
+        for(boost::filesystem::directory_iterator it(nodeDir, ec), end; !ec && (it != end); it.increment(ec)) {
+            const auto name = it->path().filename().string();
+            int nodeId = 0;
+            if ((name.compare(0, 4, "node") != 0) || !(std::istringstream(name.substr(4)) >> nodeId)) {
+                continue;
+            }
+
+            if (!readLine((it->path() / "cpulist").string(), line)) {
+                continue;
+            }
+
+            for(auto id : ParseCpuList(line)) {
+                for(auto& cpu : cpus_) {
+                    if (cpu.id == id) {
+                        cpu.nodeId = nodeId;
+                    }
+                }
+            }
+        }
+    }
+
+    void CpuTopology::setFlat(void) {
+        const auto size = std::max(std::thread::hardware_concurrency(), 1u);
+        cpus_.clear();
+        for(unsigned int i = 0; i < size; ++i) {
+            LogicalCpu cpu;
+            cpu.id = static_cast<CpuId>(i);
+            cpu.coreId = cpu.id;
+            cpus_.push_back(cpu);
+        }
+    }
+
+    const char* GetPlacementName(Placement placement) {
+        switch(placement) {
+        case Placement::SINGLE_CPU:
+            return "single-cpu";
+        case Placement::SAME_CORE_SMT:
+            return "same-core-smt";
+        case Placement::CROSS_CORE:
+            return "cross-core";
+        case Placement::CROSS_SOCKET:
+            return "cross-socket";
+        default:
+            break;
+        }
+        return "??";
+    }
+
+    size_t GetCacheLineSize(void) {
+        return GetCacheLineSize(DefaultSysfsRoot);
+    }
+
+    size_t GetCacheLineSize(const std::string& sysfsRoot) {
+        // indexNの順序は決まっていないので、レベル1のデータキャッシュを探す
+        const std::string cacheDir = sysfsRoot + "/cpu/cpu0/cache/index";
+        for(int index = 0; ; ++index) {
+            const auto dir = cacheDir + std::to_string(index);
+            int level = 0;
+            if (!readNumber(dir + "/level", level)) {
+                break;
+            }
+
+            std::string type;
+            int size = 0;
+            if ((level == 1) && readLine(dir + "/type", type) && (type == "Data") &&
+                readNumber(dir + "/coherency_line_size", size) && (size > 0)) {
+                return static_cast<size_t>(size);
+            }
+        }
+        return DestructiveInterferenceSize;
+    }
+
+#if defined(__linux__)
+    bool GetProcessAffinity(CpuSet& cpus) {
+        cpus.clear();
+        cpu_set_t cpuSet;
+        CPU_ZERO(&cpuSet);
+        if (::sched_getaffinity(0, sizeof(cpuSet), &cpuSet)) {
+            return false;
+        }
+
+        for(CpuId cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &cpuSet)) {
+                cpus.push_back(cpu);
+            }
+        }
+        return true;
+    }
+
+    bool SetProcessAffinity(const CpuSet& cpus) {
+        cpu_set_t cpuSet;
+        CPU_ZERO(&cpuSet);
+        for(auto cpu : cpus) {
+            if ((cpu < 0) || (cpu >= CPU_SETSIZE)) {
+                return false;
+            }
+            CPU_SET(cpu, &cpuSet);
+        }
+        // pid 0は呼び出したスレッドを指す。これから作るスレッドはこの設定を引き継ぐ。
+        return !::sched_setaffinity(0, sizeof(cpuSet), &cpuSet);
+    }
+
+    bool PinCurrentThread(CpuId cpu) {
+        if ((cpu < 0) || (cpu >= CPU_SETSIZE)) {
+            return false;
+        }
+
+        cpu_set_t cpuSet;
+        CPU_ZERO(&cpuSet);
+        CPU_SET(cpu, &cpuSet);
+        return !::pthread_setaffinity_np(::pthread_self(), sizeof(cpuSet), &cpuSet);
+    }
+#elif defined(_WIN32) || defined(__CYGWIN__)
+    bool GetProcessAffinity(CpuSet& cpus) {
+        cpus.clear();
+        // https://msdn.microsoft.com/ja-jp/library/windows/desktop/ms683213(v=vs.85).aspx
+        DWORD_PTR processAffinityMask = 0;
+        DWORD_PTR systemAffinityMask = 0;
+        if (!GetProcessAffinityMask(GetCurrentProcess(), &processAffinityMask, &systemAffinityMask)) {
+            return false;
+        }
+
+        for(CpuId cpu = 0; cpu < static_cast<CpuId>(sizeof(DWORD_PTR) * 8); ++cpu) {
+            if (processAffinityMask & (static_cast<DWORD_PTR>(1) << cpu)) {
+                cpus.push_back(cpu);
+            }
+        }
+        return true;
+    }
+
+    bool SetProcessAffinity(const CpuSet& cpus) {
+        DWORD_PTR mask = 0;
+        for(auto cpu : cpus) {
+            if ((cpu < 0) || (cpu >= static_cast<CpuId>(sizeof(DWORD_PTR) * 8))) {
+                return false;
+            }
+            mask |= static_cast<DWORD_PTR>(1) << cpu;
+        }
+        return SetProcessAffinityMask(GetCurrentProcess(), mask);
+    }
+
+    bool PinCurrentThread(CpuId cpu) {
+        if ((cpu < 0) || (cpu >= static_cast<CpuId>(sizeof(DWORD_PTR) * 8))) {
+            return false;
+        }
+        return SetThreadAffinityMask(GetCurrentThread(), static_cast<DWORD_PTR>(1) << cpu) != 0;
+    }
+#else
+    // 固定する方法がなければ何もしない
+    bool GetProcessAffinity(CpuSet& cpus) {
+        cpus.clear();
+        return false;
+    }
+
+    bool SetProcessAffinity(const CpuSet& cpus) {
+        return false;
+    }
+
+    bool PinCurrentThread(CpuId cpu) {
+        return false;
+    }
+#endif
+}
+
+class TestCpuAffinity : public ::testing::Test {
+protected:
+    using Path = boost::filesystem::path;
+
+    virtual void SetUp() override {
+        sysfsRoot_ = boost::filesystem::temp_directory_path() /
+            boost::filesystem::unique_path("cppFriendsAffinity-%%%%-%%%%-%%%%-%%%%");
+    }
+
+    virtual void TearDown() override {
+        boost::system::error_code ec;
+        boost::filesystem::remove_all(sysfsRoot_, ec);
+    }
+
+    void writeFile(const Path& path, const std::string& content) {
+        boost::filesystem::create_directories(path.parent_path());
+        std::ofstream os(path.string());
+        os << content << "\n";
+    }
+
+    // 2ソケット x 2物理コア x 2 SMT、ソケットごとにNUMAノードがある
+    // Linuxと同様に、論理CPU番号はSMT siblingsが離れるように振る
+    void createFakeSysfs(void) {
+        writeFile(sysfsRoot_ / "cpu" / "online", "0-7");
+        for(int cpu = 0; cpu < 8; ++cpu) {
+            const auto topologyDir = sysfsRoot_ / "cpu" / ("cpu" + std::to_string(cpu)) / "topology";
+            writeFile(topologyDir / "core_id", std::to_string(cpu % 2));
+            writeFile(topologyDir / "physical_package_id", std::to_string((cpu / 2) % 2));
+        }
+        writeFile(sysfsRoot_ / "node" / "node0" / "cpulist", "0-1,4-5");
+        writeFile(sysfsRoot_ / "node" / "node1" / "cpulist", "2-3,6-7");
+        writeFile(sysfsRoot_ / "node" / "possible", "0-1");
+    }
+
+    Path sysfsRoot_;
+};
+
+TEST_F(TestCpuAffinity, ParseCpuList) {
+    using namespace CpuAffinity;
+    EXPECT_TRUE(ParseCpuList("").empty());
+    EXPECT_EQ((CpuSet{0}), ParseCpuList("0\n"));
+    EXPECT_EQ((CpuSet{0, 1, 2, 3}), ParseCpuList("0-3"));
+    EXPECT_EQ((CpuSet{0, 2, 3, 8, 10, 11}), ParseCpuList("10-11,0,2-3,8"));
+    EXPECT_TRUE(ParseCpuList("3-1").empty());
+    EXPECT_TRUE(ParseCpuList("a").empty());
+    EXPECT_TRUE(ParseCpuList("1-").empty());
+
+    // 前後の空白だけを無視し、余分な文字や大きすぎる番号は受け付けない
+    EXPECT_EQ((CpuSet{1, 2}), ParseCpuList(" 1 , 2\n"));
+    EXPECT_TRUE(ParseCpuList("1 2").empty());
+    EXPECT_TRUE(ParseCpuList("3-5x").empty());
+    EXPECT_TRUE(ParseCpuList("1-2-3").empty());
+    EXPECT_TRUE(ParseCpuList("-1").empty());
+    EXPECT_TRUE(ParseCpuList("+1").empty());
+    EXPECT_EQ(8192, ParseCpuList("0-8191").size());
+    EXPECT_TRUE(ParseCpuList("0-8192").empty());
+    EXPECT_TRUE(ParseCpuList("0-2147483647").empty());
+    EXPECT_TRUE(ParseCpuList("99999999999999999999").empty());
+}
+
+TEST_F(TestCpuAffinity, FakeSysfs) {
+    using namespace CpuAffinity;
+    createFakeSysfs();
+    CpuTopology topology(sysfsRoot_.string());
+
+    ASSERT_EQ(8, topology.GetCpus().size());
+    EXPECT_EQ(4, topology.GetSizeOfCores());
+    EXPECT_EQ(2, topology.GetSizeOfPackages());
+    EXPECT_EQ(2, topology.GetSizeOfNodes());
+    EXPECT_EQ((CpuSet{0, 4}), topology.GetSmtSiblings(0));
+    EXPECT_EQ((CpuSet{3, 7}), topology.GetSmtSiblings(7));
+    EXPECT_TRUE(topology.GetSmtSiblings(8).empty());
+    EXPECT_EQ(1, topology.GetCpus().at(6).nodeId);
+
+    EXPECT_EQ((CpuSet{0, 0}), topology.FindPlacement(Placement::SINGLE_CPU, 2));
+    EXPECT_EQ((CpuSet{0, 4}), topology.FindPlacement(Placement::SAME_CORE_SMT, 2));
+    EXPECT_EQ((CpuSet{0, 1}), topology.FindPlacement(Placement::CROSS_CORE, 2));
+    EXPECT_EQ((CpuSet{0, 2}), topology.FindPlacement(Placement::CROSS_SOCKET, 2));
+    EXPECT_EQ((CpuSet{0, 2, 1, 3}), topology.FindPlacement(Placement::CROSS_SOCKET, 4));
+    // 物理コアより多くは置けない
+    EXPECT_TRUE(topology.FindPlacement(Placement::CROSS_CORE, 3).empty());
+    EXPECT_TRUE(topology.FindPlacement(Placement::CROSS_SOCKET, 5).empty());
+    EXPECT_TRUE(topology.FindPlacement(Placement::SINGLE_CPU, 0).empty());
+}
+
+TEST_F(TestCpuAffinity, NoSmt) {
+    using namespace CpuAffinity;
+    // topologyがなければ、論理CPUごとに別の物理コアとみなす
+    writeFile(sysfsRoot_ / "cpu" / "online", "0-1");
+    CpuTopology topology(sysfsRoot_.string());
+
+    EXPECT_EQ(2, topology.GetSizeOfCores());
+    EXPECT_EQ(1, topology.GetSizeOfPackages());
+    EXPECT_EQ(1, topology.GetSizeOfNodes());
+    EXPECT_TRUE(topology.FindPlacement(Placement::SAME_CORE_SMT, 2).empty());
+    EXPECT_EQ((CpuSet{0, 1}), topology.FindPlacement(Placement::CROSS_CORE, 2));
+    EXPECT_TRUE(topology.FindPlacement(Placement::CROSS_SOCKET, 2).empty());
+}
+
+TEST_F(TestCpuAffinity, CacheLineSize) {
+    using namespace CpuAffinity;
+    EXPECT_EQ(DestructiveInterferenceSize, GetCacheLineSize(sysfsRoot_.string()));
+
+    // 命令キャッシュと下位のキャッシュは読み飛ばす
+    const auto cacheDir = sysfsRoot_ / "cpu" / "cpu0" / "cache";
+    writeFile(cacheDir / "index0" / "level", "1");
+    writeFile(cacheDir / "index0" / "type", "Instruction");
+    writeFile(cacheDir / "index0" / "coherency_line_size", "32");
+    writeFile(cacheDir / "index1" / "level", "2");
+    writeFile(cacheDir / "index1" / "type", "Unified");
+    writeFile(cacheDir / "index1" / "coherency_line_size", "128");
+    EXPECT_EQ(DestructiveInterferenceSize, GetCacheLineSize(sysfsRoot_.string()));
+
+    writeFile(cacheDir / "index2" / "level", "1");
+    writeFile(cacheDir / "index2" / "type", "Data");
+    writeFile(cacheDir / "index2" / "coherency_line_size", "256");
+    EXPECT_EQ(256, GetCacheLineSize(sysfsRoot_.string()));
+}
+
+TEST_F(TestCpuAffinity, Host) {
+    using namespace CpuAffinity;
+    CpuTopology topology;
+    ASSERT_FALSE(topology.GetCpus().empty());
+    std::cout << topology.GetCpus().size() << " logical CPUs, " << topology.GetSizeOfCores() << " cores, "
+              << topology.GetSizeOfPackages() << " packages, " << topology.GetSizeOfNodes() << " nodes, "
+              << GetCacheLineSize() << " bytes per cache line\n";
+
+    // 2のべき乗である
+    const auto cacheLineSize = GetCacheLineSize();
+    EXPECT_FALSE(cacheLineSize & (cacheLineSize - 1));
+
+    CpuSet original;
+    if (!GetProcessAffinity(original)) {
+        std::cout << "GetProcessAffinity is not supported\n";
+        return;
+    }
+    ASSERT_FALSE(original.empty());
+
+    // 別のスレッドを固定しても、このスレッドには影響しない
+    const auto cpu = topology.GetCpus().front().id;
+    std::thread thr([=](void) { EXPECT_TRUE(PinCurrentThread(cpu)); });
+    thr.join();
+
+    CpuSet actual;
+    ASSERT_TRUE(GetProcessAffinity(actual));
+    EXPECT_EQ(original, actual);
+
+    EXPECT_TRUE(SetProcessAffinity(CpuSet{cpu}));
+    ASSERT_TRUE(GetProcessAffinity(actual));
+    EXPECT_EQ((CpuSet{cpu}), actual);
+    EXPECT_TRUE(SetProcessAffinity(original));
+}
+
+/*
+Local Variables:
+mode: c++
+coding: utf-8-dos
+tab-width: nil
+c-file-style: "stroustrup"
+End:
+*/
@@ -0,0 +1,93 @@
+// スレッドを置く論理CPUを決める
+#ifndef CPPFRIENDS_CPPFRIENDS_AFFINITY_HPP
+#define CPPFRIENDS_CPPFRIENDS_AFFINITY_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <string>
+#include <vector>
+
+namespace CpuAffinity {
+    using CpuId = int;
+    using CpuSet = std::vector<CpuId>;  // 昇順に並べる
+
+    // 別々のスレッドが書く変数を、これだけ離せば同じキャッシュラインに載らない
+    // C++17ならコンパイラが知っている値を使う
+#if defined(__cpp_lib_hardware_interference_size)
+    constexpr size_t DestructiveInterferenceSize = std::hardware_destructive_interference_size;
+#else
+    constexpr size_t DestructiveInterferenceSize = 64;
+#endif
+
+    // 論理CPUの位置
+    struct LogicalCpu {
+        CpuId id {0};
+        int   coreId {0};     // パッケージ内の物理コア番号
+        int   packageId {0};  // ソケット番号
+        int   nodeId {0};     // NUMAノード番号
+    };
+
+    // 二つ以上のスレッドを、どの論理CPUに置くか
+    enum class Placement {
+        SINGLE_CPU,     // すべて同じ論理CPUに置く
+        SAME_CORE_SMT,  // 同じ物理コアのSMT siblingsに置く
+        CROSS_CORE,     // 同じソケットの別の物理コアに置く
+        CROSS_SOCKET,   // 別のソケットに置く
+    };
+
+    // "0-3,8,10-11" という形式を展開する。解釈できなければ空を返す。
+    // 区切りの前後の空白は無視する。8192以上の番号は解釈できないとみなす。
+    CpuSet ParseCpuList(const std::string& cpuList);
+
+    // CPUの構成を/sys/devices/system以下から読む
+    // 読めなければ、hardware_concurrency個の論理CPUがそれぞれ別の物理コアにあるとみなす
+    class CpuTopology {
+    public:
+        CpuTopology(void);
+        // テスト用に、/sys/devices/systemの代わりの場所を指定する
+        explicit CpuTopology(const std::string& sysfsRoot);
+        virtual ~CpuTopology(void) = default;
+
+        const std::vector<LogicalCpu>& GetCpus(void) const;
+        size_t GetSizeOfCores(void) const;
+        size_t GetSizeOfPackages(void) const;
+        size_t GetSizeOfNodes(void) const;
+        // 同じ物理コアにある論理CPU(自分を含む)
+        CpuSet GetSmtSiblings(CpuId cpu) const;
+
+        // sizeOfThreads個のスレッドを置く論理CPUを、スレッドの順に返す
+        // このCPU構成では実現できない配置なら空を返す
+        CpuSet FindPlacement(Placement placement, size_t sizeOfThreads) const;
+
+    private:
+        void readSysfs(const std::string& sysfsRoot);
+        void setFlat(void);
+
+        std::vector<LogicalCpu> cpus_;
+    };
+
+    const char* GetPlacementName(Placement placement);
+
+    // 実行しているCPUのL1データキャッシュのラインサイズ。分からなければDestructiveInterferenceSizeを返す。
+    size_t GetCacheLineSize(void);
+    // テスト用に、/sys/devices/systemの代わりの場所を指定する
+    size_t GetCacheLineSize(const std::string& sysfsRoot);
+
+    // プロセス(Linuxでは呼び出したスレッドと、これから作るスレッド)を置ける論理CPU
+    bool GetProcessAffinity(CpuSet& cpus);
+    bool SetProcessAffinity(const CpuSet& cpus);
+    // 呼び出したスレッドを一つの論理CPUに固定する
+    bool PinCurrentThread(CpuId cpu);
+}
+
+#endif // CPPFRIENDS_CPPFRIENDS_AFFINITY_HPP
+
+/*
+Local Variables:
+mode: c++
+coding: utf-8-dos
+tab-width: nil
+c-file-style: "stroustrup"
+End:
+*/
@@ -3,15 +3,19 @@
 #include <cstdint>
 #include <algorithm>
 #include <atomic>
-#include <future>
+#include <chrono>
 #include <iostream>
 #include <string>
 #include <thread>
 #include <vector>
 #include <gtest/gtest.h>
+#if defined(_WIN32) || defined(__CYGWIN__)
 #include <windows.h>
+#endif
 #include "cFriendsCommon.h"
 #include "cppFriends.hpp"
+#include "cppFriendsAffinity.hpp"
+#include "cppFriendsThreadPool.hpp"
 
 class MyCounter {
 public:
@@ -61,58 +65,269 @@ MyCounter::Number MyCounter::nonVolatileCounter_ {0};
 volatile MyCounter::Number MyCounter::volatileCounter_ {0};
 std::atomic<MyCounter::Number> MyCounter::atomicCounter_ {0};
 
+// スレッドごとに別のキャッシュラインに数えて、読むときに合計する
+// 書くのは各スロットを持つスレッドだけなので、read-modify-writeは要らない
+class ShardedCounter {
+public:
+    using Number = MyCounter::Number;
+    using Index = size_t;
+
+    // flushIntervalが1なら、数えるたびにスロットを更新するので、合計は常に正確である
+    // 2以上なら手元でまとめてからスロットに書くので、合計はスレッド当たりflushInterval未満だけ遅れる
+    explicit ShardedCounter(Index sizeOfShards, Number flushInterval = 1) :
+        slots_(std::max(sizeOfShards, static_cast<Index>(1))),
+        flushInterval_(std::max(flushInterval, static_cast<Number>(1))) {}
+    virtual ~ShardedCounter(void) = default;
+    ShardedCounter(const ShardedCounter&) = delete;
+    ShardedCounter& operator =(const ShardedCounter&) = delete;
+
+    // shardIndexのスロットを持つスレッドだけが呼ぶ
+    void Increment(Index shardIndex) {
+        auto& slot = slots_[shardIndex];
+        if (++slot.pending >= flushInterval_) {
+            flush(slot);
+        }
+    }
+
+    // 手元に残っている分をスロットに書く
+    void Flush(Index shardIndex) {
+        flush(slots_.at(shardIndex));
+    }
+
+    // 読むときに合計する。Flushする前の値は含まない。
+    Number GetValue(void) const {
+        Number sum = 0;
+        for(auto& slot : slots_) {
+            sum += slot.value.load(std::memory_order_relaxed);
+        }
+        return sum;
+    }
+
+    Index GetSizeOfShards(void) const {
+        return slots_.size();
+    }
+
+private:
+    // C++14のnewはalignas(64)を保証しないので、キャッシュのラインサイズ分だけ他のスロットと離す
+    struct Slot {
+        std::atomic<Number> value {0};
+        Number pending {0};
+        uint8_t gap[64];
+    };
+
+    static void flush(Slot& slot) {
+        slot.value.store(slot.value.load(std::memory_order_relaxed) + slot.pending, std::memory_order_relaxed);
+        slot.pending = 0;
+    }
+
+    std::vector<Slot> slots_;
+    Number flushInterval_ {1};
+};
+
 class TestOptMyCounter : public ::testing::Test {
 protected:
     using SizeOfThreads = int;
+    using ThreadPool = WorkStealing::ThreadPool;
 
     virtual void SetUp() override {
         MyCounter::Reset();
         hardwareConcurrency_ = static_cast<decltype(hardwareConcurrency_)>(std::thread::hardware_concurrency());
-        processAffinityMask_ = 0;
-        systemAffinityMask_ = 0;
+        processAffinity_.clear();
 
+        // Windowsでは
         // https://msdn.microsoft.com/ja-jp/library/cc429135.aspx
         // https://msdn.microsoft.com/ja-jp/library/windows/desktop/ms683213(v=vs.85).aspx
         // で引数の型が異なる。下が正しい。
-        if (!GetProcessAffinityMask(GetCurrentProcess(), &processAffinityMask_, &systemAffinityMask_)) {
+        if (!CpuAffinity::GetProcessAffinity(processAffinity_) || processAffinity_.empty()) {
             // 取得に失敗したらシングルコアとみなす
-            std::cout << "GetProcessAffinityMask failed\n";
-            processAffinityMask_ = 1;
-            systemAffinityMask_ = 1;
+            std::cout << "GetProcessAffinity failed\n";
+            processAffinity_ = CpuAffinity::CpuSet{0};
         }
     }
 
     virtual void TearDown() override {
-        if (!SetProcessAffinityMask(GetCurrentProcess(), processAffinityMask_)) {
-            std::cout << "Restoring ProcessAffinityMask failed\n";
+        if (!CpuAffinity::SetProcessAffinity(processAffinity_)) {
+            std::cout << "Restoring ProcessAffinity failed\n";
         } else {
-            std::cout << "ProcessAffinityMask restored\n";
+            std::cout << "ProcessAffinity restored\n";
         }
     }
 
     void runCounters(SizeOfThreads sizeOfThreads, MyCounter::Number count) {
+        // Linuxではスレッドを起動したときのaffinityを引き継ぐので、affinityを設定してから起動する
+        ThreadPool pool(static_cast<ThreadPool::SizeOfThreads>(sizeOfThreads));
         std::vector<std::unique_ptr<MyCounter>> counterSet;
-        std::vector<std::future<void>> futureSet;
+        std::vector<WorkStealing::Future<void>> futureSet;
 
         // 並行処理を作って、後で実行できるようにする
         for(decltype(sizeOfThreads) index = 0; index < sizeOfThreads; ++index) {
             auto pCounter = std::make_unique<MyCounter>(count);
             MyCounter* pRawCounter = pCounter.get();
-            futureSet.push_back(std::async(std::launch::async, [=](void) -> void { pRawCounter->Run(); }));
+            futureSet.push_back(pool.Submit([=](void) -> void { pRawCounter->Run(); }));
             counterSet.push_back(std::move(pCounter));
         }
 
         // 並行して評価して、結果がそろうのを待つ
         for(auto& f : futureSet) {
-            f.get();
+            f.Get();
         }
 
         std::cout << "MyCounter::GetValue() = " << MyCounter::GetValue() << "\n";
         std::cout << "MyCounter::GetVolatileValue() = " << MyCounter::GetVolatileValue() << "\n";
         std::cout << "MyCounter::GetAtomicValue() = " << MyCounter::GetAtomicValue() << "\n";
+
+        // 同じ回数だけ、スレッドごとのスロットに数える
+        ShardedCounter shardedCounter(static_cast<ShardedCounter::Index>(sizeOfThreads));
+        measureCounter(pool, sizeOfThreads, [&](ShardedCounter::Index index) {
+                for(MyCounter::Number i = 0; i < count; ++i) {
+                    shardedCounter.Increment(index);
+                }
+            });
+        shardedValue_ = shardedCounter.GetValue();
+        std::cout << "ShardedCounter::GetValue() = " << shardedValue_ << "\n";
         return;
     }
 
+    // sizeOfThreads個のタスクで並行してfuncを呼び、終わるまでの時間[usec]を返す
+    // cpusを指定すれば、index番目のタスクを実行するスレッドをcpus[index]に固定する
+    // 固定したスレッドは固定したままなので、そのプールは他の用途に使わない
+    template <typename Func>
+    static long long measureCounter(ThreadPool& pool, SizeOfThreads sizeOfThreads, Func func,
+                                    const CpuAffinity::CpuSet& cpus = CpuAffinity::CpuSet()) {
+        // プールはタスクを別々のスレッドで実行するとは限らない。先に終わったスレッドが
+        // 次のタスクを取ると、一つのスレッドで順に実行した時間を測ってしまう。
+        // そこで全タスクが別々のスレッドで始まるまで待たせてから、一斉に始める。
+        const auto sizeOfWorkers = static_cast<SizeOfThreads>(pool.GetSizeOfThreads());
+        EXPECT_LE(sizeOfThreads, sizeOfWorkers);
+        if (sizeOfThreads > sizeOfWorkers) {
+            // 全タスクが始まることはないので、待つと終わらない
+            return 1;
+        }
+
+        using Clock = std::chrono::steady_clock;
+        std::atomic<SizeOfThreads> started {0};
+        std::atomic<bool> go {false};
+        std::vector<WorkStealing::Future<void>> futureSet;
+        for(decltype(sizeOfThreads) index = 0; index < sizeOfThreads; ++index) {
+            const auto shardIndex = static_cast<ShardedCounter::Index>(index);
+            const auto cpu = (shardIndex < cpus.size()) ? cpus.at(shardIndex) : -1;
+            futureSet.push_back(pool.Submit([=, &func, &started, &go](void) -> void {
+                        if (cpu >= 0) {
+                            CpuAffinity::PinCurrentThread(cpu);
+                        }
+                        started.fetch_add(1, std::memory_order_acq_rel);
+                        while(!go.load(std::memory_order_acquire)) {
+                            std::this_thread::yield();
+                        }
+                        func(shardIndex);
+                    }));
+        }
+
+        while(started.load(std::memory_order_acquire) < sizeOfThreads) {
+            std::this_thread::yield();
+        }
+        const auto start = Clock::now();
+        go.store(true, std::memory_order_release);
+
+        for(auto& f : futureSet) {
+            f.Get();
+        }
+
+        const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start);
+        return std::max(static_cast<long long>(1), static_cast<long long>(elapsed.count()));
+    }
+
+    // 1..hardware_concurrency個のスレッドで数えて、1秒当たりの回数を比べる
+    void benchmarkCounters(MyCounter::Number count) {
+        constexpr MyCounter::Number approximateInterval = 256;
+        ThreadPool pool(static_cast<ThreadPool::SizeOfThreads>(std::max(hardwareConcurrency_, 1)));
+
+        for(SizeOfThreads sizeOfThreads = 1; sizeOfThreads <= std::max(hardwareConcurrency_, 1); ++sizeOfThreads) {
+            const auto total = static_cast<long long>(sizeOfThreads) * count;
+            volatile MyCounter::Number volatileCounter = 0;
+            const auto volatileUsec = measureCounter(pool, sizeOfThreads, [&](ShardedCounter::Index) {
+                    for(MyCounter::Number i = 0; i < count; ++i) {
+                        ++volatileCounter;
+                    }
+                });
+
+            std::atomic<MyCounter::Number> atomicCounter {0};
+            const auto atomicUsec = measureCounter(pool, sizeOfThreads, [&](ShardedCounter::Index) {
+                    for(MyCounter::Number i = 0; i < count; ++i) {
+                        ++atomicCounter;
+                    }
+                });
+
+            const auto sizeOfShards = static_cast<ShardedCounter::Index>(sizeOfThreads);
+            ShardedCounter exactCounter(sizeOfShards);
+            const auto exactUsec = measureCounter(pool, sizeOfThreads, [&](ShardedCounter::Index index) {
+                    for(MyCounter::Number i = 0; i < count; ++i) {
+                        exactCounter.Increment(index);
+                    }
+                });
+
+            ShardedCounter approximateCounter(sizeOfShards, approximateInterval);
+            const auto approximateUsec = measureCounter(pool, sizeOfThreads, [&](ShardedCounter::Index index) {
+                    for(MyCounter::Number i = 0; i < count; ++i) {
+                        approximateCounter.Increment(index);
+                    }
+                    approximateCounter.Flush(index);
+                });
+
+            std::cout << sizeOfThreads << " threads [increments/usec] : volatile " << (total / volatileUsec)
+                      << ", atomic " << (total / atomicUsec) << ", sharded " << (total / exactUsec)
+                      << ", approximate " << (total / approximateUsec) << "\n";
+
+            EXPECT_EQ(total, atomicCounter.load());
+            EXPECT_EQ(total, exactCounter.GetValue());
+            EXPECT_EQ(total, approximateCounter.GetValue());
+        }
+    }
+
+    // 二つのスレッドを置く場所を変えて、共有するatomic変数と、スレッドごとのスロットに数える時間を比べる
+    void benchmarkPlacements(MyCounter::Number count) {
+        constexpr SizeOfThreads sizeOfThreads = 2;
+        const std::vector<CpuAffinity::Placement> placements {
+            CpuAffinity::Placement::SINGLE_CPU, CpuAffinity::Placement::SAME_CORE_SMT,
+            CpuAffinity::Placement::CROSS_CORE, CpuAffinity::Placement::CROSS_SOCKET};
+        CpuAffinity::CpuTopology topology;
+
+        for(auto placement : placements) {
+            const auto cpus = topology.FindPlacement(placement, sizeOfThreads);
+            std::cout << CpuAffinity::GetPlacementName(placement) << " : ";
+            if (cpus.empty()) {
+                std::cout << "n/a\n";
+                continue;
+            }
+
+            // スレッドを固定するので、配置ごとにプールを作る
+            ThreadPool pool(static_cast<ThreadPool::SizeOfThreads>(sizeOfThreads));
+            std::atomic<MyCounter::Number> atomicCounter {0};
+            const auto atomicUsec = measureCounter(pool, sizeOfThreads, [&](ShardedCounter::Index) {
+                    for(MyCounter::Number i = 0; i < count; ++i) {
+                        ++atomicCounter;
+                    }
+                }, cpus);
+
+            ShardedCounter shardedCounter(sizeOfThreads);
+            const auto shardedUsec = measureCounter(pool, sizeOfThreads, [&](ShardedCounter::Index index) {
+                    for(MyCounter::Number i = 0; i < count; ++i) {
+                        shardedCounter.Increment(index);
+                    }
+                }, cpus);
+
+            std::cout << "CPU";
+            for(auto cpu : cpus) {
+                std::cout << " " << cpu;
+            }
+            std::cout << ", atomic " << atomicUsec << " usec, sharded " << shardedUsec << " usec\n";
+
+            const auto expected = count * sizeOfThreads;
+            EXPECT_EQ(expected, atomicCounter.load());
+            EXPECT_EQ(expected, shardedCounter.GetValue());
+        }
+    }
+
     class IntBox {
     public:
         using Data = int;
@@ -143,10 +358,8 @@ protected:
     };
 
     SizeOfThreads hardwareConcurrency_ {0};
-
-private:
-    DWORD_PTR processAffinityMask_ {1};
-    DWORD_PTR systemAffinityMask_  {1};
+    MyCounter::Number shardedValue_ {0};
+    CpuAffinity::CpuSet processAffinity_;
 };
 
 TEST_F(TestOptMyCounter, MultiCore) {
@@ -178,13 +391,13 @@ TEST_F(TestOptMyCounter, MultiCore) {
     EXPECT_GT(expected, MyCounter::GetVolatileValue());
     // これは常に成り立つはず
     EXPECT_EQ(expected, MyCounter::GetAtomicValue());
+    EXPECT_EQ(expected, shardedValue_);
 }
 
 TEST_F(TestOptMyCounter, SingleCore) {
     /* 使うCPUを1個に固定する */
-    DWORD_PTR procMask = 1;
-    if (!SetProcessAffinityMask(GetCurrentProcess(), procMask)) {
-        std::cout << "SetProcessAffinityMask failed\n";
+    if (!CpuAffinity::SetProcessAffinity(CpuAffinity::CpuSet{processAffinity_.front()})) {
+        std::cout << "SetProcessAffinity failed\n";
     }
 
     SizeOfThreads sizeOfThreads = std::max(hardwareConcurrency_, 4);
@@ -198,6 +411,34 @@ TEST_F(TestOptMyCounter, SingleCore) {
     EXPECT_EQ(expected, MyCounter::GetVolatileValue());
     // これは常に成り立つはず
     EXPECT_EQ(expected, MyCounter::GetAtomicValue());
+    EXPECT_EQ(expected, shardedValue_);
+}
+
+TEST_F(TestOptMyCounter, Sharded) {
+    ShardedCounter exactCounter(2);
+    ShardedCounter approximateCounter(2, 4);
+    EXPECT_EQ(2, exactCounter.GetSizeOfShards());
+
+    for(int i = 0; i < 6; ++i) {
+        exactCounter.Increment(i & 1);
+        approximateCounter.Increment(i & 1);
+    }
+    EXPECT_EQ(6, exactCounter.GetValue());
+
+    // 手元にまとめている分は、Flushするまで見えない
+    EXPECT_EQ(0, approximateCounter.GetValue());
+    approximateCounter.Increment(0);
+    EXPECT_EQ(4, approximateCounter.GetValue());
+    approximateCounter.Flush(1);
+    EXPECT_EQ(7, approximateCounter.GetValue());
+}
+
+TEST_F(TestOptMyCounter, CounterScaling) {
+    benchmarkCounters(4000000);
+}
+
+TEST_F(TestOptMyCounter, Placement) {
+    benchmarkPlacements(4000000);
 }
 
 TEST_F(TestOptMyCounter, ConstMemberFunction) {
@@ -320,6 +561,8 @@ TEST_F(TestOptReleaseUniquePtr, Holder) {
     EXPECT_EQ(1, g_objDeleteCount);
 }
 
+// Vectored exception handlerはWindowsにしかない
+#if defined(_WIN32) || defined(__CYGWIN__)
 namespace {
     std::atomic<bool> g_breakPointHandled;
 
@@ -362,6 +605,7 @@ TEST_F(TestDebuggerDetecter, Trap) {
     // デバッガから起動したときには、ハンドラに制御が渡らないのでFALSEになる
     EXPECT_TRUE(g_breakPointHandled.load());
 }
+#endif
 
 class TestOverwriteVtable : public ::testing::Test {};
 
@@ -0,0 +1,307 @@
+// CPUのハードウェアカウンタで、処理の前後のイベント数を数える
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#include <gtest/gtest.h>
+#include "cppFriendsPerf.hpp"
+
+namespace PerfEvent {
+    namespace {
+        const std::vector<Event> DefaultEvents {
+            Event::CYCLES, Event::INSTRUCTIONS, Event::CACHE_MISSES, Event::L1D_READ_MISSES, Event::HITM};
+
+#if defined(__linux__)
+        struct CpuModel {
+            bool intel {false};
+            int family {-1};
+            int model {-1};
+        };
+
+        // 最初の論理CPUのベンダーと、familyとmodelを読む
+        CpuModel readCpuModel(void) {
+            CpuModel cpuModel;
+            std::ifstream is("/proc/cpuinfo");
+            std::string line;
+            auto getValue = [&line](void) -> int {
+                const auto pos = line.find(':');
+                return (pos == std::string::npos) ? -1 : std::atoi(line.c_str() + pos + 1);
+            };
+
+            while(std::getline(is, line)) {
+                if (line.empty()) {
+                    break;
+                }
+                if (line.compare(0, 9, "vendor_id") == 0) {
+                    cpuModel.intel = (line.find("GenuineIntel") != std::string::npos);
+                } else if (line.compare(0, 10, "cpu family") == 0) {
+                    cpuModel.family = getValue();
+                } else if ((line.compare(0, 5, "model") == 0) && (line.compare(0, 10, "model name") != 0)) {
+                    cpuModel.model = getValue();
+                }
+            }
+            return cpuModel;
+        }
+
+        // Hybrid CPUはコアの種類ごとにPMUが分かれていて、PERF_TYPE_RAWでは数えられない
+        bool isHybrid(void) {
+            std::ifstream is("/sys/bus/event_source/devices/cpu_core/type");
+            return static_cast<bool>(is);
+        }
+
+        // イベント0xd2, umask 0x04がXSNP_HITMを数えるCPUか
+        // Ice Lake以降は同じ番号で別のイベント(XSNP_FWDなど)を数えるので含めない
+        bool hasXsnpHitm(void) {
+            const auto cpuModel = readCpuModel();
+            if (!cpuModel.intel || (cpuModel.family != 6) || isHybrid()) {
+                return false;
+            }
+
+            switch(cpuModel.model) {
+            case 0x2a:  // Sandy Bridge
+            case 0x2d:  // Sandy Bridge-EP
+            case 0x3a:  // Ivy Bridge
+            case 0x3e:  // Ivy Bridge-EP
+            case 0x3c:  // Haswell
+            case 0x3f:  // Haswell-EP
+            case 0x45:  // Haswell-ULT
+            case 0x46:  // Haswell-GT3e
+            case 0x3d:  // Broadwell
+            case 0x47:  // Broadwell-GT3e
+            case 0x4f:  // Broadwell-EP
+            case 0x56:  // Broadwell-DE
+            case 0x4e:  // Skylake mobile
+            case 0x5e:  // Skylake desktop
+            case 0x55:  // Skylake-SP, Cascade Lake
+            case 0x8e:  // Kaby Lake, Coffee Lake mobile
+            case 0x9e:  // Kaby Lake, Coffee Lake desktop
+                return true;
+            default:
+                break;
+            }
+            return false;
+        }
+
+        // イベントの種類と設定値を求める。このCPUで数えられなければfalseを返す。
+        bool getEventConfig(Event event, uint32_t& type, uint64_t& config) {
+            type = PERF_TYPE_HARDWARE;
+            switch(event) {
+            case Event::CYCLES:
+                config = PERF_COUNT_HW_CPU_CYCLES;
+                return true;
+            case Event::INSTRUCTIONS:
+                config = PERF_COUNT_HW_INSTRUCTIONS;
+                return true;
+            case Event::CACHE_REFERENCES:
+                config = PERF_COUNT_HW_CACHE_REFERENCES;
+                return true;
+            case Event::CACHE_MISSES:
+                config = PERF_COUNT_HW_CACHE_MISSES;
+                return true;
+            case Event::L1D_READ_MISSES:
+                type = PERF_TYPE_HW_CACHE;
+                config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                    (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+                return true;
+            case Event::HITM:
+                // 汎用のイベントはないので、イベント番号が分かっているIntel CPUでだけ直接指定する
+                // MEM_LOAD_(UOPS_)L3_HIT_RETIRED.XSNP_HITM : event 0xd2, umask 0x04
+                // 他のCPUでは無関係なイベントを数えてしまうので、数えられないことにする
+                if (!hasXsnpHitm()) {
+                    return false;
+                }
+                type = PERF_TYPE_RAW;
+                config = 0x04d2;
+                return true;
+            default:
+                break;
+            }
+            return false;
+        }
+#endif
+    }
+
+    const char* GetEventName(Event event) {
+        switch(event) {
+        case Event::CYCLES:
+            return "cycles";
+        case Event::INSTRUCTIONS:
+            return "instructions";
+        case Event::CACHE_REFERENCES:
+            return "cache-references";
+        case Event::CACHE_MISSES:
+            return "cache-misses";
+        case Event::L1D_READ_MISSES:
+            return "L1-dcache-load-misses";
+        case Event::HITM:
+            return "hitm";
+        default:
+            break;
+        }
+        return "??";
+    }
+
+    CounterSet::CounterSet(void) : CounterSet(DefaultEvents) {}
+
+    CounterSet::CounterSet(const std::vector<Event>& events) {
+        for(auto event : events) {
+            open(event);
+        }
+    }
+
+    CounterSet::~CounterSet(void) {
+#if defined(__linux__)
+        for(auto& counter : counters_) {
+            if (counter.fd >= 0) {
+                ::close(counter.fd);
+            }
+        }
+#endif
+    }
+
+    bool CounterSet::IsAvailable(void) const {
+        for(auto& counter : counters_) {
+            if (counter.fd >= 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+#if defined(__linux__)
+    void CounterSet::open(Event event) {
+        Counter counter;
+        counter.event = event;
+
+        uint32_t type = 0;
+        uint64_t config = 0;
+        if (getEventConfig(event, type, config)) {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = type;
+            attr.config = config;
+            attr.disabled = 1;
+            attr.inherit = 1;  // 後から起動したスレッドも数える
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            // このスレッドを、どのCPUで実行しても数える
+            counter.fd = static_cast<int>(::syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+        }
+
+        counters_.push_back(counter);
+    }
+
+    void CounterSet::Start(void) {
+        for(auto& counter : counters_) {
+            if (counter.fd >= 0) {
+                ::ioctl(counter.fd, PERF_EVENT_IOC_RESET, 0);
+                ::ioctl(counter.fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+    }
+
+    void CounterSet::Stop(void) {
+        for(auto& counter : counters_) {
+            if (counter.fd >= 0) {
+                ::ioctl(counter.fd, PERF_EVENT_IOC_DISABLE, 0);
+            }
+        }
+    }
+
+    std::vector<Result> CounterSet::GetResults(void) const {
+        std::vector<Result> results;
+        for(auto& counter : counters_) {
+            Result result;
+            result.event = counter.event;
+
+            // value, time_enabled, time_running
+            uint64_t values[3] {0, 0, 0};
+            if ((counter.fd >= 0) && (::read(counter.fd, values, sizeof(values)) == sizeof(values)) && values[2]) {
+                result.available = true;
+                result.value = (values[2] < values[1]) ?
+                    static_cast<uint64_t>(static_cast<double>(values[0]) * static_cast<double>(values[1]) /
+                                          static_cast<double>(values[2])) : values[0];
+            }
+            results.push_back(result);
+        }
+        return results;
+    }
+#else
+    void CounterSet::open(Event event) {
+        Counter counter;
+        counter.event = event;
+        counters_.push_back(counter);
+    }
+
+    void CounterSet::Start(void) {}
+    void CounterSet::Stop(void) {}
+
+    std::vector<Result> CounterSet::GetResults(void) const {
+        std::vector<Result> results;
+        for(auto& counter : counters_) {
+            Result result;
+            result.event = counter.event;
+            results.push_back(result);
+        }
+        return results;
+    }
+#endif
+}
+
+class TestPerfEvent : public ::testing::Test {};
+
+TEST_F(TestPerfEvent, Measure) {
+    using namespace PerfEvent;
+    CounterSet counters({Event::CYCLES, Event::INSTRUCTIONS, Event::HITM});
+
+    volatile int sum = 0;
+    const auto results = counters.Measure([&](void) {
+            for(int i = 0; i < 1000000; ++i) {
+                sum = sum + i;
+            }
+        });
+
+    // 数えられなければ数えられないことが分かる
+    ASSERT_EQ(3, results.size());
+    EXPECT_EQ(Event::CYCLES, results.at(0).event);
+    EXPECT_EQ(Event::HITM, results.at(2).event);
+    if (!counters.IsAvailable()) {
+        std::cout << "perf_event_open is not available\n";
+        for(auto& result : results) {
+            EXPECT_FALSE(result.available);
+        }
+        return;
+    }
+
+    for(auto& result : results) {
+        std::cout << GetEventName(result.event) << " : ";
+        if (result.available) {
+            std::cout << result.value << "\n";
+        } else {
+            std::cout << "n/a\n";
+        }
+    }
+
+    // ループ一回に一命令以上掛かる
+    if (results.at(1).available) {
+        EXPECT_LT(1000000u, results.at(1).value);
+    }
+}
+
+/*
+Local Variables:
+mode: c++
+coding: utf-8-dos
+tab-width: nil
+c-file-style: "stroustrup"
+End:
+*/
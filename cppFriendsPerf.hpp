@@ -0,0 +1,74 @@
+// CPUのハードウェアカウンタで、処理の前後のイベント数を数える
+#ifndef CPPFRIENDS_CPPFRIENDS_PERF_HPP
+#define CPPFRIENDS_CPPFRIENDS_PERF_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace PerfEvent {
+    enum class Event {
+        CYCLES,
+        INSTRUCTIONS,
+        CACHE_REFERENCES,  // 最終レベルキャッシュへのアクセス
+        CACHE_MISSES,      // 最終レベルキャッシュのミス
+        L1D_READ_MISSES,
+        HITM,              // 他のコアが書き換えたキャッシュラインを読んだ(Sandy Bridge..Coffee LakeのIntel CPUのみ)
+    };
+
+    struct Result {
+        Event event {Event::CYCLES};
+        uint64_t value {0};
+        bool available {false};  // 数えられなければfalse
+    };
+
+    const char* GetEventName(Event event);
+
+    // Linuxではperf_event_openで数える。それ以外では何も数えない。
+    // 数えるのは、作ったスレッドと、作った後にそのスレッドが起動したスレッドである。
+    // perf_event_paranoidなどで許可されていなければ、そのイベントは数えない。
+    class CounterSet {
+    public:
+        CounterSet(void);
+        explicit CounterSet(const std::vector<Event>& events);
+        virtual ~CounterSet(void);
+        CounterSet(const CounterSet&) = delete;
+        CounterSet& operator =(const CounterSet&) = delete;
+
+        // 一つでも数えられるか
+        bool IsAvailable(void) const;
+        void Start(void);
+        void Stop(void);
+        // 他のイベントと交代で数えたときは、数えた時間の割合で補正する
+        std::vector<Result> GetResults(void) const;
+
+        template <typename Func>
+        std::vector<Result> Measure(Func func) {
+            Start();
+            func();
+            Stop();
+            return GetResults();
+        }
+
+    private:
+        struct Counter {
+            Event event {Event::CYCLES};
+            int fd {-1};
+        };
+
+        void open(Event event);
+
+        std::vector<Counter> counters_;
+    };
+}
+
+#endif // CPPFRIENDS_CPPFRIENDS_PERF_HPP
+
+/*
+Local Variables:
+mode: c++
+coding: utf-8-dos
+tab-width: nil
+c-file-style: "stroustrup"
+End:
+*/
@@ -2,15 +2,853 @@
 // ググって見つけたコードは、正しさと性能を確認してから使いましょう
 // 正しい実装は、教科書を読んで確認してください
 #include <cassert>
+#include <cstdint>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <mutex>
+#include <random>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <type_traits>
 #include <vector>
+#include <boost/filesystem.hpp>
 #include <gtest/gtest.h>
 #include "cFriendsCommon.h"
 #include "cppFriends.hpp"
+#include "cppFriendsThreadPool.hpp"
+
+namespace {
+    // 区間を分割する方法
+    enum class PartitionKernel {
+        HOARE,  // 左右から走査して交換する。比較結果で分岐する。
+        BLOCK,  // 比較結果をブロック単位で記録してからまとめて交換する(BlockQuicksort)。分岐予測に失敗しない。
+    };
+
+    // 下記のクイックソートを元にしたイントロソート
+    // - 再帰が2*log2(N)段より深くなったらヒープソートに切り替える
+    // - 小さい方の区間だけ再帰して、大きい方の区間はループで処理する
+    // - 要素数が少ない区間は挿入ソートで仕上げる
+    // 再帰深度(スタックの深さ)はlog2(N)+1段を超えない
+    template<typename RandomAccessIterator, typename Compare = std::less<>>
+    class IntroSort {
+    public:
+        using StackDepth = int;
+        using Size = typename std::iterator_traits<RandomAccessIterator>::difference_type;
+        static constexpr Size DefaultInsertionSortSize = 16;
+        static constexpr StackDepth DefaultDepthLimitScale = 2;
+
+        // テストでは挿入ソートやヒープソートへの切り替え条件を変えて、すべての経路を通す
+        explicit IntroSort(Size insertionSortSize = DefaultInsertionSortSize,
+                           StackDepth depthLimitScale = DefaultDepthLimitScale,
+                           PartitionKernel kernel = PartitionKernel::HOARE,
+                           Compare compare = Compare()) :
+            insertionSortSize_(std::max(insertionSortSize, static_cast<Size>(1))),
+            depthLimitScale_(depthLimitScale), kernel_(kernel), compare_(compare) {}
+        virtual ~IntroSort(void) = default;
+
+        // [first, last)をソートして、再帰の深さを返す
+        StackDepth Sort(RandomAccessIterator first, RandomAccessIterator last) {
+            heapSortCount_ = 0;
+            const auto size = last - first;
+            if (size < 2) {
+                return 0;
+            }
+
+            return sortRange(first, last, 1, getDepthLimit(size));
+        }
+
+        // ヒープソートに切り替えた区間の数
+        int GetHeapSortCount(void) const {
+            return heapSortCount_;
+        }
+
+        static StackDepth FloorLog2(Size size) {
+            StackDepth log2 = 0;
+            while(size > 1) {
+                size >>= 1;
+                ++log2;
+            }
+            return log2;
+        }
+
+    protected:
+        StackDepth getDepthLimit(Size size) const {
+            return depthLimitScale_ * FloorLog2(size);
+        }
+
+        // 分割を残りdepthLimit段まで続けて、[first, last)をソートする
+        void sortWithDepthLimit(RandomAccessIterator first, RandomAccessIterator last, StackDepth depthLimit) {
+            sortRange(first, last, 1, depthLimit);
+        }
+
+        // [first, leftLast)はpivot以下、[rightFirst, last)はpivot以上になる
+        // [leftLast, rightFirst)は整列済である
+        void partition(RandomAccessIterator first, RandomAccessIterator last,
+                       RandomAccessIterator& leftLast, RandomAccessIterator& rightFirst) {
+            // 3点の中央値を取るので、3要素以上必要
+            if ((kernel_ == PartitionKernel::BLOCK) && ((last - first) >= 3)) {
+                blockPartition(first, last, leftLast, rightFirst);
+            } else {
+                hoarePartition(first, last, leftLast, rightFirst);
+            }
+        }
+
+    private:
+        using Value = typename std::iterator_traits<RandomAccessIterator>::value_type;
+        using Offset = unsigned char;
+        static constexpr size_t BlockSize = 64;
+        static_assert(BlockSize <= std::numeric_limits<Offset>::max(), "Too large block");
+
+        void hoarePartition(RandomAccessIterator first, RandomAccessIterator last,
+                            RandomAccessIterator& leftLast, RandomAccessIterator& rightFirst) {
+            // pivotは区間内にあるので、最初の走査はpivotで必ず止まる
+            // 交換した後は、lの左にpivot以下、rの右にpivot以上の要素があって番兵になるので、
+            // 範囲チェックは要らない
+            const auto pivot = *(first + (last - first) / 2);
+            auto l = first;
+            auto r = last - 1;
+
+            for (;;) {
+                while(compare_(*l, pivot)) {
+                    ++l;
+                }
+
+                while(compare_(pivot, *r)) {
+                    --r;
+                }
+
+                if (l >= r) {
+                    break;
+                }
+
+                std::iter_swap(l, r);
+                ++l;
+                --r;
+            }
+
+            // l <= last - 1 かつ r >= firstなので、両区間とも元より必ず短い
+            leftLast = l;
+            rightFirst = r + 1;
+        }
+
+        void sort2(RandomAccessIterator a, RandomAccessIterator b) {
+            if (compare_(*b, *a)) {
+                std::iter_swap(a, b);
+            }
+        }
+
+        // *a <= *b <= *c にする
+        void sort3(RandomAccessIterator a, RandomAccessIterator b, RandomAccessIterator c) {
+            sort2(a, b);
+            sort2(b, c);
+            sort2(a, b);
+        }
+
+        // 比較結果を分岐せずにオフセットの配列に書き、左右で同数見つかったらまとめて交換する
+        // Edelkamp and Weiss, "BlockQuicksort: How Branch Mispredictions don't affect Quicksort"
+        // 実装はpdqsortのpartition_right_branchlessに倣う
+        void blockPartition(RandomAccessIterator first, RandomAccessIterator last,
+                            RandomAccessIterator& leftLast, RandomAccessIterator& rightFirst) {
+            // 3点の中央値を先頭に、それ以上の値を末尾に置く。末尾は左からの走査の番兵になる。
+            sort3(first + (last - first) / 2, first, last - 1);
+            Value pivot = std::move(*first);
+            auto l = first;
+            auto r = last;
+
+            while(compare_(*++l, pivot)) {}
+            // 先頭の次がpivot以上なら、右からの走査に番兵はない
+            if ((l - 1) == first) {
+                while((l < r) && !compare_(*--r, pivot)) {}
+            } else {
+                while(!compare_(*--r, pivot)) {}
+            }
+
+            if (l < r) {
+                std::iter_swap(l, r);
+                ++l;
+
+                Offset offsetsL[BlockSize];
+                Offset offsetsR[BlockSize];
+                auto baseL = l;
+                auto baseR = r;
+                size_t numL = 0;
+                size_t numR = 0;
+                size_t startL = 0;
+                size_t startR = 0;
+
+                while(l < r) {
+                    // 交換相手が残っていない側のブロックを埋める
+                    const auto unknown = static_cast<size_t>(r - l);
+                    const size_t splitL = (numL == 0) ? ((numR == 0) ? (unknown / 2) : unknown) : 0;
+                    const size_t splitR = (numR == 0) ? (unknown - splitL) : 0;
+
+                    // オフセットは必ず書き、右に送るべき要素のときだけ個数を進める
+                    const size_t sizeL = (splitL < BlockSize) ? splitL : BlockSize;
+                    for(size_t i = 0; i < sizeL; ++i) {
+                        offsetsL[numL] = static_cast<Offset>(i);
+                        numL += !compare_(*l, pivot);
+                        ++l;
+                    }
+
+                    const size_t sizeR = (splitR < BlockSize) ? splitR : BlockSize;
+                    for(size_t i = 0; i < sizeR;) {
+                        offsetsR[numR] = static_cast<Offset>(++i);
+                        numR += compare_(*--r, pivot);
+                    }
+
+                    const size_t num = std::min(numL, numR);
+                    swapOffsets(baseL, baseR, offsetsL + startL, offsetsR + startR, num, numL == numR);
+                    numL -= num;
+                    numR -= num;
+                    startL += num;
+                    startR += num;
+
+                    if (numL == 0) {
+                        startL = 0;
+                        baseL = l;
+                    }
+
+                    if (numR == 0) {
+                        startR = 0;
+                        baseR = r;
+                    }
+                }
+
+                // 交換相手のいない要素を境界に寄せる
+                if (numL) {
+                    while(numL--) {
+                        std::iter_swap(baseL + offsetsL[startL + numL], --r);
+                    }
+                    l = r;
+                }
+
+                if (numR) {
+                    while(numR--) {
+                        std::iter_swap(baseR - offsetsR[startR + numR], l);
+                        ++l;
+                    }
+                    r = l;
+                }
+            }
+
+            const auto pivotPos = l - 1;
+            *first = std::move(*pivotPos);
+            *pivotPos = std::move(pivot);
+
+            // pivotより小さい要素がなければ、pivotと等しい要素を前に集めて区間から外す
+            // こうしないと、すべての要素が同じときに区間が1要素ずつしか縮まない
+            if (pivotPos == first) {
+                const auto equalLast = std::partition(
+                    first + 1, last, [&](const Value& v) { return !compare_(*pivotPos, v); });
+                leftLast = first;
+                rightFirst = equalLast;
+                return;
+            }
+
+            leftLast = pivotPos;
+            rightFirst = pivotPos + 1;
+        }
+
+        // 交換相手がそろった要素を交換する
+        // 左右の数が違うときは、一時変数を一つ使って巡回置換する方が代入が少ない
+        void swapOffsets(RandomAccessIterator baseL, RandomAccessIterator baseR,
+                         const Offset* offsetsL, const Offset* offsetsR, size_t num, bool useSwaps) {
+            if (useSwaps) {
+                for(size_t i = 0; i < num; ++i) {
+                    std::iter_swap(baseL + offsetsL[i], baseR - offsetsR[i]);
+                }
+            } else if (num > 0) {
+                auto l = baseL + offsetsL[0];
+                auto r = baseR - offsetsR[0];
+                Value tmp(std::move(*l));
+                *l = std::move(*r);
+                for(size_t i = 1; i < num; ++i) {
+                    l = baseL + offsetsL[i];
+                    *r = std::move(*l);
+                    r = baseR - offsetsR[i];
+                    *l = std::move(*r);
+                }
+                *r = std::move(tmp);
+            }
+        }
+
+        StackDepth sortRange(RandomAccessIterator first, RandomAccessIterator last,
+                             StackDepth depth, StackDepth depthLimit) {
+            StackDepth maxDepth = depth;
+
+            while((last - first) > insertionSortSize_) {
+                // 分割がうまくいかない入力なので、O(N log N)が保証されている方法に切り替える
+                if (depthLimit <= 0) {
+                    std::make_heap(first, last, compare_);
+                    std::sort_heap(first, last, compare_);
+                    ++heapSortCount_;
+                    return maxDepth;
+                }
+                --depthLimit;
+
+                RandomAccessIterator leftLast;
+                RandomAccessIterator rightFirst;
+                partition(first, last, leftLast, rightFirst);
+
+                // 小さい方を再帰すれば、区間の長さは1段ごとに半分以下になる
+                if ((leftLast - first) < (last - rightFirst)) {
+                    maxDepth = std::max(maxDepth, sortRange(first, leftLast, depth + 1, depthLimit));
+                    first = rightFirst;
+                } else {
+                    maxDepth = std::max(maxDepth, sortRange(rightFirst, last, depth + 1, depthLimit));
+                    last = leftLast;
+                }
+            }
+
+            insertionSort(first, last);
+            return maxDepth;
+        }
+
+        void insertionSort(RandomAccessIterator first, RandomAccessIterator last) {
+            if (first == last) {
+                return;
+            }
+
+            for(auto i = first + 1; i != last; ++i) {
+                auto value = std::move(*i);
+                auto j = i;
+                for(; (j != first) && compare_(value, *(j - 1)); --j) {
+                    *j = std::move(*(j - 1));
+                }
+                *j = std::move(value);
+            }
+        }
+
+        Size insertionSortSize_ {DefaultInsertionSortSize};
+        StackDepth depthLimitScale_ {DefaultDepthLimitScale};
+        PartitionKernel kernel_ {PartitionKernel::HOARE};
+        Compare compare_;
+        int heapSortCount_ {0};
+    };
+
+    // ワークスティーリング方式のスレッドプール
+    // 各スレッドは自分のdequeの底から新しいタスクを取り出し、
+    // 自分のdequeが空なら他のスレッドのdequeの天井から古いタスクを盗む
+    using WorkStealingPool = WorkStealing::ThreadPool;
+
+    // 分割した区間をスレッドプールで並行してソートする
+    // 区間の長さがgrainSize以下になったら、そのスレッドでイントロソートする
+    template<typename RandomAccessIterator, typename Compare = std::less<>>
+    class ParallelIntroSort : public IntroSort<RandomAccessIterator, Compare> {
+    public:
+        using Base = IntroSort<RandomAccessIterator, Compare>;
+        using Size = typename Base::Size;
+        using StackDepth = typename Base::StackDepth;
+        static constexpr Size DefaultGrainSize = 4096;
+
+        ParallelIntroSort(WorkStealingPool& pool, Size grainSize = DefaultGrainSize, const Base& base = Base()) :
+            Base(base), pool_(pool), grainSize_(std::max(grainSize, static_cast<Size>(1))) {}
+        virtual ~ParallelIntroSort(void) = default;
+
+        void Sort(RandomAccessIterator first, RandomAccessIterator last) {
+            const auto size = last - first;
+            if (size < 2) {
+                return;
+            }
+
+            // キューにタスクがある間はこのスレッドも実行し、無くなったら全タスクが終わるまで眠る
+            Completion completion;
+            pool_.Push([=, &completion](void) { sortTask(first, last, this->getDepthLimit(size), completion); });
+            while(!completion.IsDone() && pool_.Help()) {}
+            completion.Wait();
+        }
+
+    private:
+        // 終わっていないタスクを数え、すべて終わったら待っているスレッドを起こす
+        class Completion {
+        public:
+            void Add(void) {
+                pending_.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            void Done(void) {
+                if (pending_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                    // 起こされたスレッドがこのオブジェクトを破棄するので、ロックしたまま起こす
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    done_ = true;
+                    cv_.notify_all();
+                }
+            }
+
+            bool IsDone(void) const {
+                return pending_.load(std::memory_order_acquire) == 0;
+            }
+
+            // Doneがmutex_を放すまで待つので、戻ったらこのオブジェクトを破棄してよい
+            void Wait(void) {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [this](void) -> bool { return done_; });
+            }
+
+        private:
+            std::atomic<size_t> pending_ {1};
+            std::mutex mutex_;
+            std::condition_variable cv_;
+            bool done_ {false};
+        };
+
+        void sortTask(RandomAccessIterator first, RandomAccessIterator last,
+                      StackDepth depthLimit, Completion& completion) {
+            while(((last - first) > grainSize_) && (depthLimit > 0)) {
+                --depthLimit;
+                RandomAccessIterator leftLast;
+                RandomAccessIterator rightFirst;
+                this->partition(first, last, leftLast, rightFirst);
+
+                completion.Add();
+                pool_.Push([=, &completion](void) { sortTask(first, leftLast, depthLimit, completion); });
+                first = rightFirst;
+            }
+
+            // 残りの段数を引き継ぐので、分割が偏り続けるなら後はヒープソートに任せる
+            // ソートするとメンバ変数を書き換えるので、スレッドごとに複製する
+            ParallelIntroSort sorter(*this);
+            sorter.sortWithDepthLimit(first, last, depthLimit);
+            completion.Done();
+        }
+
+        WorkStealingPool& pool_;
+        Size grainSize_ {DefaultGrainSize};
+    };
+
+    // 符号付き整数をLSD(下位桁から)基数ソートする
+    // 比較ソートではなく、桁ごとに数えて並べるのでO(N * 桁数)
+    template<typename Integer, unsigned int DigitBits = 8>
+    class RadixSort {
+    public:
+        static_assert(std::is_integral<Integer>::value && std::is_signed<Integer>::value, "Must be a signed integer");
+        static_assert((DigitBits > 0) && (DigitBits <= 16), "Too large digits");
+        using IntegerArray = std::vector<Integer>;
+        using Key = std::make_unsigned_t<Integer>;
+        using Count = size_t;
+        static constexpr unsigned int KeyBits = sizeof(Key) * 8;
+        static constexpr unsigned int SizeOfPasses = (KeyBits + DigitBits - 1) / DigitBits;
+        static constexpr size_t Radix = static_cast<size_t>(1) << DigitBits;
+        // 同じ桁が続くと同じカウンタを続けて更新するので、数える表を複数用意して依存関係を切る
+        static constexpr size_t SizeOfLanes = 4;
+
+        RadixSort(void) : histogram_(SizeOfPasses * SizeOfLanes * Radix, 0) {}
+        virtual ~RadixSort(void) = default;
+
+        // 作業領域を使いまわすので、一つのオブジェクトを複数のスレッドから同時に使わないこと
+        void Sort(IntegerArray& array) {
+            const auto size = array.size();
+            if (size < 2) {
+                return;
+            }
+
+            countDigits(array);
+            // 作業領域は確保したまま再利用する
+            buffer_.resize(size);
+
+            IntegerArray* pSrc = &array;
+            IntegerArray* pDst = &buffer_;
+            for(unsigned int pass = 0; pass < SizeOfPasses; ++pass) {
+                if (scatter(*pSrc, *pDst, pass)) {
+                    std::swap(pSrc, pDst);
+                }
+            }
+
+            // 結果が作業領域側にあれば、コピーせずに中身を入れ替える
+            if (pSrc != &array) {
+                array.swap(buffer_);
+            }
+        }
+
+        // 最後にソートしたときに、全要素が同じ桁だったので省略したパスの数
+        unsigned int GetSkippedPasses(void) const {
+            return skippedPasses_;
+        }
+
+    private:
+        // 符号ビットを反転すると、負の数が正の数より前に来る
+        static Key toKey(Integer n) {
+            constexpr Key signBit = static_cast<Key>(1) << (KeyBits - 1);
+            return static_cast<Key>(static_cast<Key>(n) ^ signBit);
+        }
+
+        static size_t getDigit(Key key, unsigned int pass) {
+            constexpr Key mask = static_cast<Key>(Radix - 1);
+            return static_cast<size_t>((key >> (pass * DigitBits)) & mask);
+        }
+
+        Count* getHistogram(unsigned int pass, size_t lane) {
+            return histogram_.data() + (pass * SizeOfLanes + lane) * Radix;
+        }
+
+        // 一回読むだけで、全パスの桁を数える
+        void countDigits(const IntegerArray& array) {
+            std::fill(histogram_.begin(), histogram_.end(), 0);
+            const auto size = array.size();
+            const Integer* pSrc = array.data();
+
+            size_t i = 0;
+            for(; (i + SizeOfLanes) <= size; i += SizeOfLanes) {
+                for(size_t lane = 0; lane < SizeOfLanes; ++lane) {
+                    const auto key = toKey(pSrc[i + lane]);
+                    for(unsigned int pass = 0; pass < SizeOfPasses; ++pass) {
+                        ++getHistogram(pass, lane)[getDigit(key, pass)];
+                    }
+                }
+            }
+
+            for(; i < size; ++i) {
+                const auto key = toKey(pSrc[i]);
+                for(unsigned int pass = 0; pass < SizeOfPasses; ++pass) {
+                    ++getHistogram(pass, 0)[getDigit(key, pass)];
+                }
+            }
+
+            // 各レーンの数を足し合わせる
+            for(unsigned int pass = 0; pass < SizeOfPasses; ++pass) {
+                Count* pTotal = getHistogram(pass, 0);
+                for(size_t lane = 1; lane < SizeOfLanes; ++lane) {
+                    const Count* pLane = getHistogram(pass, lane);
+                    for(size_t digit = 0; digit < Radix; ++digit) {
+                        pTotal[digit] += pLane[digit];
+                    }
+                }
+            }
+
+            skippedPasses_ = 0;
+        }
+
+        // 並べ替えたらtrue、並べ替える必要がなければfalseを返す
+        bool scatter(const IntegerArray& src, IntegerArray& dst, unsigned int pass) {
+            Count* pCount = getHistogram(pass, 0);
+            const auto size = src.size();
+
+            // 全要素がこの桁で同じなら、並べ替えなくても順序は変わらない
+            if (pCount[getDigit(toKey(src.front()), pass)] == size) {
+                ++skippedPasses_;
+                return false;
+            }
+
+            // 各桁の書き込み開始位置を求める
+            Count offset = 0;
+            for(size_t digit = 0; digit < Radix; ++digit) {
+                const auto count = pCount[digit];
+                pCount[digit] = offset;
+                offset += count;
+            }
+
+            // 同じ桁の要素は元の順序を保つ(安定ソート)
+            const Integer* pSrc = src.data();
+            Integer* pDst = dst.data();
+            for(size_t i = 0; i < size; ++i) {
+                const auto n = pSrc[i];
+                pDst[pCount[getDigit(toKey(n), pass)]++] = n;
+            }
+
+            return true;
+        }
+
+        IntegerArray buffer_;
+        std::vector<Count> histogram_;
+        unsigned int skippedPasses_ {0};
+    };
+
+    // メモリに載らない大きさのファイルを外部マージソートする
+    // ファイルは要素を並べたバイナリで、エンディアンは実行環境に従う
+    // - メモリに収まる長さずつ読んでイントロソートし、一時ファイル(ラン)に書き出す
+    // - ランをトーナメント木(敗者木)でk-wayマージする。一度にマージしきれなければ何段かに分ける
+    template<typename Element, typename Compare = std::less<>>
+    class ExternalSort {
+    public:
+        using Path = boost::filesystem::path;
+        using ElementArray = std::vector<Element>;
+        using Size = size_t;
+        // ファイルを読み書きする単位の下限。これより小さいとシークばかりになる。
+        static constexpr Size MinBufferBytes = 64 * 1024;
+
+        // memoryBudgetはソートとマージに使うバッファの合計byte数
+        explicit ExternalSort(Size memoryBudget, const Path& workDirectory = boost::filesystem::temp_directory_path(),
+                              Compare compare = Compare()) :
+            memoryBudget_(std::max(memoryBudget, MinBufferBytes * 3)),
+            workDirectory_(workDirectory), compare_(compare) {}
+        virtual ~ExternalSort(void) = default;
+
+        // 読み書きできない、ファイルの長さが要素の倍数でない、ときはstd::ios_base::failureを投げる
+        // 一時ファイルは例外を投げても消す
+        void Sort(const Path& inputPath, const Path& outputPath) {
+            TemporaryFiles runs;
+            createRuns(inputPath, runs);
+            sizeOfInitialRuns_ = runs.paths.size();
+            sizeOfMergePasses_ = 0;
+
+            const auto fanIn = getFanIn();
+            while(runs.paths.size() > fanIn) {
+                // 一度にマージしきれないので、fanIn個ずつマージして新しいランを作る
+                TemporaryFiles mergedRuns;
+                for(Size i = 0; i < runs.paths.size(); i += fanIn) {
+                    const auto last = std::min(i + fanIn, runs.paths.size());
+                    const std::vector<Path> group(runs.paths.begin() + static_cast<std::ptrdiff_t>(i),
+                                                  runs.paths.begin() + static_cast<std::ptrdiff_t>(last));
+                    mergedRuns.paths.push_back(createTemporaryPath());
+                    merge(group, mergedRuns.paths.back());
+                }
+                runs.Swap(mergedRuns);
+                ++sizeOfMergePasses_;
+            }
+
+            merge(runs.paths, outputPath);
+            ++sizeOfMergePasses_;
+        }
+
+        // 最初に作ったランの数
+        Size GetSizeOfInitialRuns(void) const {
+            return sizeOfInitialRuns_;
+        }
+
+        // マージした段数
+        Size GetSizeOfMergePasses(void) const {
+            return sizeOfMergePasses_;
+        }
+
+        // 一度にマージできるランの数
+        Size GetFanIn(void) const {
+            return getFanIn();
+        }
+
+    private:
+        // 一時ファイルを必ず消す
+        struct TemporaryFiles {
+            std::vector<Path> paths;
+            ~TemporaryFiles(void) {
+                for(const auto& path : paths) {
+                    boost::system::error_code ec;
+                    boost::filesystem::remove(path, ec);
+                }
+            }
+
+            void Swap(TemporaryFiles& other) {
+                paths.swap(other.paths);
+            }
+        };
+
+        // ランを先頭から順に、大きな単位で読む
+        class RunReader {
+        public:
+            RunReader(const Path& path, Size bufferSize) : is_(path.string(), std::ios::binary), buffer_(bufferSize) {
+                if (!is_) {
+                    throw std::ios_base::failure("Cannot open " + path.string());
+                }
+                fill();
+            }
+
+            bool IsEmpty(void) const {
+                return position_ >= size_;
+            }
+
+            const Element& Get(void) const {
+                return buffer_[position_];
+            }
+
+            void Next(void) {
+                ++position_;
+                if (position_ >= size_) {
+                    fill();
+                }
+            }
+
+        private:
+            void fill(void) {
+                position_ = 0;
+                size_ = read(is_, buffer_);
+            }
+
+            std::ifstream is_;
+            ElementArray buffer_;
+            Size position_ {0};
+            Size size_ {0};
+        };
+
+        // 敗者木。各節点は、そこで負けた(大きい方の)ランの番号を持つ。
+        // 勝者を取り出したら、そのランの葉から根まで再試合するだけで次の勝者が決まる。
+        // 比較回数はlog2(k)回で、二分ヒープのような左右の子の比較がない。
+        class LoserTree {
+        public:
+            LoserTree(std::vector<std::unique_ptr<RunReader>>& readers, Compare& compare) :
+                readers_(readers), compare_(compare), losers_(std::max(readers.size(), static_cast<Size>(1))) {
+                const auto k = readers_.size();
+                if (k <= 1) {
+                    losers_.at(0) = 0;
+                    return;
+                }
+
+                // 葉はk..2k-1番、内部節点は1..k-1番
+                std::vector<Size> winners(k * 2);
+                for(Size i = 0; i < k; ++i) {
+                    winners.at(k + i) = i;
+                }
+
+                for(Size node = k - 1; node >= 1; --node) {
+                    const auto left = winners.at(node * 2);
+                    const auto right = winners.at(node * 2 + 1);
+                    const bool leftWins = isLess(left, right);
+                    winners.at(node) = leftWins ? left : right;
+                    losers_.at(node) = leftWins ? right : left;
+                }
+
+                losers_.at(0) = winners.at(1);
+            }
+
+            // 空のランは必ず負けるので、勝者が空なら全ランが空である
+            bool IsEmpty(void) const {
+                return readers_.empty() || readers_.at(losers_.at(0))->IsEmpty();
+            }
+
+            const Element& Top(void) const {
+                return readers_.at(losers_.at(0))->Get();
+            }
+
+            void Pop(void) {
+                auto winner = losers_.at(0);
+                readers_.at(winner)->Next();
+
+                for(auto node = (winner + readers_.size()) / 2; node >= 1; node /= 2) {
+                    if (isLess(losers_.at(node), winner)) {
+                        std::swap(losers_.at(node), winner);
+                    }
+                }
+
+                losers_.at(0) = winner;
+            }
+
+        private:
+            // 同じ値なら番号の小さいランを先に出すので、安定である
+            bool isLess(Size left, Size right) const {
+                const auto& leftReader = *readers_.at(left);
+                const auto& rightReader = *readers_.at(right);
+                if (leftReader.IsEmpty() || rightReader.IsEmpty()) {
+                    return !leftReader.IsEmpty();
+                }
+
+                if (compare_(leftReader.Get(), rightReader.Get())) {
+                    return true;
+                }
+
+                return !compare_(rightReader.Get(), leftReader.Get()) && (left < right);
+            }
+
+            std::vector<std::unique_ptr<RunReader>>& readers_;
+            Compare& compare_;
+            std::vector<Size> losers_;
+        };
+
+        // 読めた要素数を返す
+        static Size read(std::ifstream& is, ElementArray& buffer) {
+            is.read(reinterpret_cast<char*>(buffer.data()),
+                    static_cast<std::streamsize>(buffer.size() * sizeof(Element)));
+            if (is.bad()) {
+                throw std::ios_base::failure("Read error");
+            }
+
+            const auto bytes = static_cast<Size>(is.gcount());
+            if (bytes % sizeof(Element)) {
+                throw std::ios_base::failure("File size is not a multiple of the element size");
+            }
+
+            return bytes / sizeof(Element);
+        }
+
+        static void write(std::ofstream& os, const ElementArray& buffer, Size size) {
+            os.write(reinterpret_cast<const char*>(buffer.data()),
+                     static_cast<std::streamsize>(size * sizeof(Element)));
+        }
+
+        static std::ofstream openOutput(const Path& path) {
+            std::ofstream os;
+            os.exceptions(std::ios::failbit | std::ios::badbit);
+            os.open(path.string(), std::ios::binary | std::ios::trunc);
+            return os;
+        }
+
+        Path createTemporaryPath(void) const {
+            return workDirectory_ / boost::filesystem::unique_path("cppFriendsSort-%%%%-%%%%-%%%%-%%%%.run");
+        }
+
+        Size getFanIn(void) const {
+            // 入力バッファk個と出力バッファ1個を用意する
+            return std::max(memoryBudget_ / MinBufferBytes, static_cast<Size>(3)) - 1;
+        }
+
+        // メモリ予算いっぱいずつ読んでソートし、ランを書き出す
+        void createRuns(const Path& inputPath, TemporaryFiles& runs) {
+            std::ifstream is(inputPath.string(), std::ios::binary);
+            if (!is) {
+                throw std::ios_base::failure("Cannot open " + inputPath.string());
+            }
+
+            ElementArray buffer(memoryBudget_ / sizeof(Element));
+            IntroSort<typename ElementArray::iterator, Compare> sorter(
+                IntroSort<typename ElementArray::iterator, Compare>::DefaultInsertionSortSize,
+                IntroSort<typename ElementArray::iterator, Compare>::DefaultDepthLimitScale,
+                PartitionKernel::BLOCK, compare_);
+
+            for(;;) {
+                const auto size = read(is, buffer);
+                if (!size) {
+                    break;
+                }
+
+                sorter.Sort(buffer.begin(), buffer.begin() + static_cast<std::ptrdiff_t>(size));
+                runs.paths.push_back(createTemporaryPath());
+                auto os = openOutput(runs.paths.back());
+                write(os, buffer, size);
+                os.close();
+            }
+        }
+
+        // ランをまとめて一つのファイルにする。ランがなければ空のファイルを作る。
+        void merge(const std::vector<Path>& runPaths, const Path& outputPath) {
+            const auto bufferBytes = memoryBudget_ / (runPaths.size() + 1);
+            const auto bufferSize = std::max(bufferBytes / sizeof(Element), static_cast<Size>(1));
+
+            std::vector<std::unique_ptr<RunReader>> readers;
+            for(const auto& path : runPaths) {
+                readers.push_back(std::make_unique<RunReader>(path, bufferSize));
+            }
+
+            auto os = openOutput(outputPath);
+            ElementArray outputBuffer(bufferSize);
+            Size outputSize = 0;
+
+            LoserTree tree(readers, compare_);
+            while(!tree.IsEmpty()) {
+                outputBuffer[outputSize] = tree.Top();
+                ++outputSize;
+                if (outputSize >= bufferSize) {
+                    write(os, outputBuffer, outputSize);
+                    outputSize = 0;
+                }
+                tree.Pop();
+            }
+
+            write(os, outputBuffer, outputSize);
+            os.close();
+        }
+
+        Size memoryBudget_ {0};
+        Path workDirectory_;
+        Compare compare_;
+        Size sizeOfInitialRuns_ {0};
+        Size sizeOfMergePasses_ {0};
+    };
+}
 
 // ググって見つけたクイックソートの解説を元に、私が再実装したもの
 class TestQuickSort : public ::testing::Test {
@@ -47,7 +885,14 @@ protected:
         return;
     }
 
+    // イントロソートでソートする
     StackDepth QuickSort(ElementArray& array) const {
+        IntroSort<ElementArray::iterator> sorter;
+        return sorter.Sort(array.begin(), array.end());
+    }
+
+    // 元の実装。入力次第で再帰深度がO(N)になる。
+    StackDepth NaiveQuickSort(ElementArray& array) const {
         auto arraySize = array.size();
         if (arraySize < 2) {
             return 0;
@@ -56,6 +901,105 @@ protected:
         return quickSort(array, 0, static_cast<Position>(arraySize) - 1, 1);
     }
 
+    // 再帰深度の上限
+    StackDepth MaxStackDepth(ElementArray::size_type size) const {
+        return IntroSort<ElementArray::iterator>::FloorLog2(static_cast<Position>(size)) + 1;
+    }
+
+    // 鋸歯状に並べる(1,3,5,...,6,4,2)。元の実装では再帰深度がO(N)になる。
+    ElementArray CreateSawtooth(int size) const {
+        const int arraySize = size * 2;
+        int n = 1;
+        int l = 0;
+        int r = arraySize - 1;
+        ElementArray array(arraySize, 0);
+
+        for(int i=0; i<size; ++i) {
+            array.at(l) = n;
+            ++n;
+            ++l;
+            array.at(r) = n;
+            ++n;
+            --r;
+        }
+
+        return array;
+    }
+
+    // 並べ替えた配列をすべてソートする
+    using SortFunction = std::function<void(ElementArray&)>;
+
+    // 要素に重複がない
+    void checkUnique(const SortFunction& sortFunc) const {
+        for(int size = 3; size <= 8; ++size) {
+            ElementArray expected;
+            for(int i = 1; i <= size; ++i) {
+                expected.push_back(i);
+            }
+
+            int count = 0;
+            ElementArray array = expected;
+            do {
+                ElementArray actual = array;
+                sortFunc(actual);
+                EXPECT_EQ(expected, actual);
+                ++count;
+            } while(std::next_permutation(array.begin(), array.end()));
+
+            EXPECT_LT(1, count);
+        }
+    }
+
+    // 要素に重複がある
+    void checkNotUnique(const SortFunction& sortFunc) const {
+        const int maskSet[] = {1,3,5};
+        for(auto mask : maskSet) {
+            int maskBits = ~mask;
+            for(int size = 3; size <= 8; ++size) {
+                // 0..を準備する
+                ElementArray array;
+                for(int i = 0; i < size; ++i) {
+                    array.push_back(i);
+                }
+
+                // マスクを掛けて重複を作る
+                ElementArray expected = array;
+                for(auto& v : expected) {
+                    v &= maskBits;
+                }
+                std::sort(expected.begin(), expected.end());
+
+                int count = 0;
+                do {
+                    ElementArray actual = array;
+                    // 重複を作る
+                    for(auto& v : actual) {
+                        v &= maskBits;
+                    }
+
+                    sortFunc(actual);
+                    EXPECT_EQ(expected, actual);
+                    ++count;
+                } while(std::next_permutation(array.begin(), array.end()));
+
+                EXPECT_LT(1, count);
+            }
+        }
+    }
+
+    // 基数ソートする
+    void RadixSort(ElementArray& array) const {
+        ::RadixSort<Element> sorter;
+        sorter.Sort(array);
+    }
+
+    // 並行してソートする
+    void ParallelQuickSort(ElementArray& array, WorkStealingPool& pool, ElementArray::difference_type grainSize) const {
+        using Sorter = ParallelIntroSort<ElementArray::iterator>;
+        Sorter sorter(pool, grainSize, Sorter::Base(1));
+        sorter.Sort(array.begin(), array.end());
+    }
+
 private:
     StackDepth quickSort(ElementArray& array, Position leftPos, Position rightPos, StackDepth depth) const {
         static_assert(std::is_signed<decltype(leftPos)>::value,  "Must be signed");
@@ -168,17 +1112,22 @@ TEST_F(TestQuickSort, SpecialCases) {
 TEST_F(TestQuickSort, Two) {
     const ElementArray expected {-1,1};
     ElementArray ascending  {-1,1};
-    EXPECT_EQ(2, QuickSort(ascending));
+    EXPECT_EQ(1, QuickSort(ascending));
     EXPECT_EQ(expected, ascending);
 
-    ElementArray descending {-1,1};
-    EXPECT_EQ(2, QuickSort(descending));
+    ElementArray descending {1,-1};
+    EXPECT_EQ(1, QuickSort(descending));
     EXPECT_EQ(expected, descending);
 
     const ElementArray expectedFlat {1,1};
     ElementArray flat {1,1};
-    EXPECT_EQ(2, QuickSort(flat));
+    EXPECT_EQ(1, QuickSort(flat));
     EXPECT_EQ(expectedFlat, flat);
+
+    // 元の実装は要素数1の区間まで再帰する
+    ElementArray naive {1,-1};
+    EXPECT_EQ(2, NaiveQuickSort(naive));
+    EXPECT_EQ(expected, naive);
 }
 
 // すべての要素が同じ
@@ -192,74 +1141,31 @@ TEST_F(TestQuickSort, Same) {
 
         // 全要素が同じだと、再帰深度がO(N)になってしまうのは避けたい
         StackDepth expectedDepth = depth + 1;
+        EXPECT_GE(MaxStackDepth(array.size()), QuickSort(array));
         EXPECT_EQ(expected, array);
-        EXPECT_EQ(expectedDepth, QuickSort(array));
+
+        ElementArray naive = expected;
+        EXPECT_EQ(expectedDepth, NaiveQuickSort(naive));
+        EXPECT_EQ(expected, naive);
     }
 
     // 要素数が2のn乗個以外でもソートできる
     for(int size = 3; size < 16; ++size) {
         ElementArray expected(size, 1);
         ElementArray array = expected;
+        QuickSort(array);
         EXPECT_EQ(expected, array);
     }
 }
 
 // 要素に重複がない
 TEST_F(TestQuickSort, Unique) {
-    for(int size = 3; size <= 8; ++size) {
-        ElementArray expected;
-        for(int i = 1; i <= size; ++i) {
-            expected.push_back(i);
-        }
-
-        int count = 0;
-        ElementArray array = expected;
-        do {
-            ElementArray actual = array;
-            QuickSort(actual);
-            EXPECT_EQ(expected, actual);
-            ++count;
-        } while(std::next_permutation(array.begin(), array.end()));
-
-        EXPECT_LT(1, count);
-    }
+    checkUnique([this](ElementArray& array) { QuickSort(array); });
 }
 
 // 要素に重複がある
 TEST_F(TestQuickSort, NotUnique) {
-    const int maskSet[] = {1,3,5};
-    for(auto mask : maskSet) {
-        int maskBits = ~mask;
-        for(int size = 3; size <= 8; ++size) {
-            // 0..を準備する
-            ElementArray array;
-            for(int i = 0; i < size; ++i) {
-                array.push_back(i);
-            }
-
-            // マスクを掛けて重複を作る
-            ElementArray expected = array;
-            for(auto& v : expected) {
-                v &= maskBits;
-            }
-            std::sort(expected.begin(), expected.end());
-
-            int count = 0;
-            do {
-                ElementArray actual = array;
-                // 重複を作る
-                for(auto& v : actual) {
-                    v &= maskBits;
-                }
-
-                QuickSort(actual);
-                EXPECT_EQ(expected, actual);
-                ++count;
-            } while(std::next_permutation(array.begin(), array.end()));
-
-            EXPECT_LT(1, count);
-        }
-    }
+    checkNotUnique([this](ElementArray& array) { QuickSort(array); });
 }
 
 // 既にソート済
@@ -276,8 +1182,17 @@ TEST_F(TestQuickSort, AlreadySorted) {
     EXPECT_TRUE(IsSorted(ascending));
     EXPECT_FALSE(IsSorted(descending));
 
-    EXPECT_EQ(6, QuickSort(ascending));
-    EXPECT_EQ(6, QuickSort(descending));
+    ElementArray naiveAscending = ascending;
+    ElementArray naiveDescending = descending;
+    EXPECT_GE(MaxStackDepth(size), QuickSort(ascending));
+    EXPECT_GE(MaxStackDepth(size), QuickSort(descending));
+    EXPECT_EQ(expected, ascending);
+    EXPECT_EQ(expected, descending);
+
+    EXPECT_EQ(6, NaiveQuickSort(naiveAscending));
+    EXPECT_EQ(6, NaiveQuickSort(naiveDescending));
+    EXPECT_EQ(expected, naiveAscending);
+    EXPECT_EQ(expected, naiveDescending);
 }
 
 // ある種の入力では再帰深度がO(N)になってしまう
@@ -285,26 +1200,452 @@ TEST_F(TestQuickSort, DeepStack) {
     for(int scale=2; scale<8; ++scale) {
         int size = 1;
         size <<= scale;
-        const int arraySize = size * 2;
-        int n = 1;
-        int l = 0;
-        int r = arraySize - 1;
-        ElementArray array(arraySize, 0);
-
-        for(int i=0; i<size; ++i) {
-            array.at(l) = n;
-            ++n;
-            ++l;
-            array.at(r) = n;
-            ++n;
-            --r;
-        }
+        ElementArray array = CreateSawtooth(size);
+        ElementArray naive = array;
 
         ElementArray expected = array;
         std::sort(expected.begin(), expected.end());
-        EXPECT_EQ(size + 1, QuickSort(array));
+        EXPECT_GE(MaxStackDepth(array.size()), QuickSort(array));
         EXPECT_EQ(expected, array);
+
+        EXPECT_EQ(size + 1, NaiveQuickSort(naive));
+        EXPECT_EQ(expected, naive);
+    }
+}
+
+// 分割が偏る入力はヒープソートに切り替わる
+TEST_F(TestQuickSort, HeapSortFallback) {
+    constexpr int size = 1024;
+    ElementArray array = CreateSawtooth(size);
+    ElementArray expected = array;
+    std::sort(expected.begin(), expected.end());
+
+    IntroSort<ElementArray::iterator> sorter;
+    EXPECT_GE(MaxStackDepth(array.size()), sorter.Sort(array.begin(), array.end()));
+    EXPECT_LT(0, sorter.GetHeapSortCount());
+    EXPECT_EQ(expected, array);
+
+    // 昇順に並んでいればきれいに分割できる
+    sorter.Sort(array.begin(), array.end());
+    EXPECT_EQ(0, sorter.GetHeapSortCount());
+    EXPECT_EQ(expected, array);
+}
+
+// 挿入ソート、クイックソート、ヒープソートのどれを使っても正しくソートできる
+TEST_F(TestQuickSort, IntroSortPaths) {
+    using Sorter = IntroSort<ElementArray::iterator>;
+    const std::vector<Sorter> sorterSet {
+        Sorter(1), Sorter(1, 0), Sorter(4, 1), Sorter(),
+        Sorter(1, 2, PartitionKernel::BLOCK), Sorter(4, 1, PartitionKernel::BLOCK)};
+
+    for(auto sorter : sorterSet) {
+        for(int size = 1; size <= 8; ++size) {
+            ElementArray expected;
+            for(int i = 1; i <= size; ++i) {
+                // 重複を作る
+                expected.push_back(i / 2);
+            }
+
+            ElementArray array = expected;
+            do {
+                ElementArray actual = array;
+                EXPECT_GE(MaxStackDepth(actual.size()), sorter.Sort(actual.begin(), actual.end()));
+                EXPECT_EQ(expected, actual);
+            } while(std::next_permutation(array.begin(), array.end()));
+        }
+    }
+
+    // 降順も比較関数で指定できる
+    ElementArray descending {3,1,4,1,5,9,2,6,5,3,5,8,9,7,9,3,2,3,8,4,6,2,6,4,3,3,8,3,2,7,9,5};
+    ElementArray expected = descending;
+    std::sort(expected.begin(), expected.end(), std::greater<Element>());
+    ElementArray descendingBlock = descending;
+    IntroSort<ElementArray::iterator, std::greater<Element>> descendingSorter(1);
+    descendingSorter.Sort(descending.begin(), descending.end());
+    EXPECT_EQ(expected, descending);
+
+    IntroSort<ElementArray::iterator, std::greater<Element>> descendingBlockSorter(1, 2, PartitionKernel::BLOCK);
+    descendingBlockSorter.Sort(descendingBlock.begin(), descendingBlock.end());
+    EXPECT_EQ(expected, descendingBlock);
+}
+
+// ブロック単位の分割は、ブロックより長い区間や重複の多い区間も正しく分割できる
+TEST_F(TestQuickSort, BlockPartition) {
+    using Sorter = IntroSort<ElementArray::iterator>;
+    std::mt19937 gen(1);
+
+    for(int size = 3; size < 1000; size += 7) {
+        for(Element mod : {2, 3, 1000000}) {
+            std::uniform_int_distribution<Element> dist(0, mod - 1);
+            ElementArray array(static_cast<ElementArray::size_type>(size));
+            for(auto& n : array) {
+                n = dist(gen);
+            }
+
+            ElementArray expected = array;
+            std::sort(expected.begin(), expected.end());
+            Sorter sorter(1, 2, PartitionKernel::BLOCK);
+            EXPECT_GE(MaxStackDepth(array.size()), sorter.Sort(array.begin(), array.end()));
+            EXPECT_EQ(expected, array);
+        }
+    }
+
+    // 全要素が同じでも、一度の分割で終わる(空の区間を一段再帰する)
+    ElementArray same(4096, 1);
+    Sorter sorter(1, 2, PartitionKernel::BLOCK);
+    EXPECT_EQ(2, sorter.Sort(same.begin(), same.end()));
+    EXPECT_EQ(0, sorter.GetHeapSortCount());
+    EXPECT_TRUE(IsSorted(same));
+
+    ElementArray sawtooth = CreateSawtooth(4096);
+    sorter.Sort(sawtooth.begin(), sawtooth.end());
+    EXPECT_TRUE(IsSorted(sawtooth));
+
+    // 並行ソートも同じ分割方法を使える
+    WorkStealingPool pool(2);
+    using ParallelSorter = ParallelIntroSort<ElementArray::iterator>;
+    ParallelSorter parallelSorter(pool, 1, ParallelSorter::Base(1, 2, PartitionKernel::BLOCK));
+    checkNotUnique([&](ElementArray& array) { parallelSorter.Sort(array.begin(), array.end()); });
+}
+
+// 分岐予測が外れやすいランダムな入力と、外れにくい整列済の入力で、分割方法ごとに時間を測る
+TEST_F(TestQuickSort, PartitionBenchmark) {
+    constexpr ElementArray::size_type size = 1 << 22;
+    ElementArray random(size);
+    std::mt19937 gen(1);
+    std::uniform_int_distribution<Element> dist;
+    for(auto& n : random) {
+        n = dist(gen);
+    }
+
+    ElementArray sorted = random;
+    std::sort(sorted.begin(), sorted.end());
+
+    using Sorter = IntroSort<ElementArray::iterator>;
+    const std::vector<std::pair<std::string, ElementArray>> inputSet {{"random", random}, {"sorted", sorted}};
+    const std::vector<std::pair<std::string, PartitionKernel>> kernelSet {
+        {"Hoare", PartitionKernel::HOARE}, {"Block", PartitionKernel::BLOCK}};
+
+    using Clock = std::chrono::steady_clock;
+    for(const auto& input : inputSet) {
+        for(const auto& kernel : kernelSet) {
+            ElementArray array = input.second;
+            Sorter sorter(Sorter::DefaultInsertionSortSize, Sorter::DefaultDepthLimitScale, kernel.second);
+            const auto start = Clock::now();
+            sorter.Sort(array.begin(), array.end());
+            const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start);
+            EXPECT_TRUE(IsSorted(array));
+            std::cout << input.first << " : " << kernel.first << " : " << elapsed.count() << "msec\n";
+        }
+    }
+}
+
+// 並行してソートしても結果は同じ
+TEST_F(TestQuickSort, ParallelUnique) {
+    WorkStealingPool pool(std::max(std::thread::hardware_concurrency(), 2u));
+    checkUnique([&](ElementArray& array) { ParallelQuickSort(array, pool, 1); });
+}
+
+TEST_F(TestQuickSort, ParallelNotUnique) {
+    WorkStealingPool pool(std::max(std::thread::hardware_concurrency(), 2u));
+    checkNotUnique([&](ElementArray& array) { ParallelQuickSort(array, pool, 1); });
+}
+
+TEST_F(TestQuickSort, ParallelSpecialCases) {
+    WorkStealingPool pool(2);
+    ElementArray emptyArray;
+    ParallelQuickSort(emptyArray, pool, 1);
+    EXPECT_TRUE(emptyArray.empty());
+
+    // ワーカスレッドがなくても、呼び出し元がすべて処理する
+    WorkStealingPool emptyPool(0);
+    ElementArray array = CreateSawtooth(256);
+    ParallelQuickSort(array, emptyPool, 4);
+    EXPECT_TRUE(IsSorted(array));
+
+    // 偏った分割が続いても終わる
+    array = CreateSawtooth(4096);
+    ParallelQuickSort(array, pool, 1);
+    EXPECT_TRUE(IsSorted(array));
+
+    ElementArray same(4096, 1);
+    ParallelQuickSort(same, pool, 1);
+    EXPECT_TRUE(IsSorted(same));
+
+    // 分割できる段数を使い切った区間は、ヒープソートする
+    using Sorter = ParallelIntroSort<ElementArray::iterator>;
+    Sorter heapSorter(pool, 1, Sorter::Base(1, 0));
+    array = CreateSawtooth(4096);
+    heapSorter.Sort(array.begin(), array.end());
+    EXPECT_TRUE(IsSorted(array));
+}
+
+// スレッド数を変えてソート時間を測る
+TEST_F(TestQuickSort, ParallelScaling) {
+    constexpr ElementArray::size_type size = 1 << 22;
+    ElementArray original(size);
+    std::mt19937 gen(1);
+    std::uniform_int_distribution<Element> dist;
+    for(auto& n : original) {
+        n = dist(gen);
+    }
+
+    using Clock = std::chrono::steady_clock;
+    const auto measure = [&](const SortFunction& sortFunc) -> auto {
+        ElementArray array = original;
+        const auto start = Clock::now();
+        sortFunc(array);
+        const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start);
+        EXPECT_TRUE(IsSorted(array));
+        return elapsed.count();
+    };
+
+    std::cout << "std::sort : " << measure([](ElementArray& array) { std::sort(array.begin(), array.end()); }) << "msec\n";
+    std::cout << "QuickSort : " << measure([this](ElementArray& array) { QuickSort(array); }) << "msec\n";
+
+    const auto maxThreads = std::max(std::thread::hardware_concurrency(), 1u);
+    for(auto sizeOfThreads = 1u; sizeOfThreads <= maxThreads; ++sizeOfThreads) {
+        // 呼び出し元のスレッドも働くので、プールのスレッドは一つ少なくする
+        WorkStealingPool pool(sizeOfThreads - 1);
+        const auto msec = measure([&](ElementArray& array) {
+                using Sorter = ParallelIntroSort<ElementArray::iterator>;
+                Sorter sorter(pool);
+                sorter.Sort(array.begin(), array.end());
+            });
+        std::cout << "ParallelQuickSort(" << sizeOfThreads << " threads) : " << msec << "msec\n";
+    }
+}
+
+// 基数ソートでも結果は同じ
+TEST_F(TestQuickSort, RadixUnique) {
+    checkUnique([this](ElementArray& array) { RadixSort(array); });
+}
+
+TEST_F(TestQuickSort, RadixNotUnique) {
+    checkNotUnique([this](ElementArray& array) { RadixSort(array); });
+}
+
+namespace {
+    template <typename Integer, unsigned int DigitBits>
+    void CheckRadixSort(void) {
+        using IntegerArray = std::vector<Integer>;
+        constexpr Integer minValue = std::numeric_limits<Integer>::min();
+        constexpr Integer maxValue = std::numeric_limits<Integer>::max();
+
+        // 符号ビットを反転し忘れると、負の数が後ろに来る
+        IntegerArray array {0, -1, 1, maxValue, minValue, -2, 2, maxValue - 1, minValue + 1, 0, -1};
+        std::mt19937_64 gen(1);
+        std::uniform_int_distribution<Integer> dist(minValue, maxValue);
+        for(int i = 0; i < 10000; ++i) {
+            array.push_back(dist(gen));
+        }
+
+        IntegerArray expected = array;
+        std::sort(expected.begin(), expected.end());
+
+        // 作業領域を使いまわしても正しくソートできる
+        RadixSort<Integer, DigitBits> sorter;
+        IntegerArray actual = array;
+        sorter.Sort(actual);
+        EXPECT_EQ(expected, actual);
+        EXPECT_EQ(0, sorter.GetSkippedPasses());
+
+        actual = array;
+        actual.resize(array.size() / 2 + 1);
+        IntegerArray expectedHalf = actual;
+        std::sort(expectedHalf.begin(), expectedHalf.end());
+        sorter.Sort(actual);
+        EXPECT_EQ(expectedHalf, actual);
+
+        // 全要素が同じなら並べ替えない
+        IntegerArray same(1000, minValue + 1);
+        IntegerArray expectedSame = same;
+        sorter.Sort(same);
+        EXPECT_EQ(expectedSame, same);
+        const unsigned int sizeOfPasses = sorter.SizeOfPasses;
+        EXPECT_EQ(sizeOfPasses, sorter.GetSkippedPasses());
+    }
+}
+
+TEST_F(TestQuickSort, RadixSigned) {
+    CheckRadixSort<int32_t, 8>();
+    CheckRadixSort<int32_t, 11>();
+    CheckRadixSort<int64_t, 8>();
+    CheckRadixSort<int64_t, 11>();
+}
+
+// 入力の種類ごとにソート時間を比べる
+TEST_F(TestQuickSort, RadixBenchmark) {
+    constexpr ElementArray::size_type size = 1 << 22;
+    ElementArray uniform(size);
+    std::mt19937 gen(1);
+    std::uniform_int_distribution<Element> dist;
+    for(auto& n : uniform) {
+        n = dist(gen);
+    }
+
+    ElementArray sorted = uniform;
+    std::sort(sorted.begin(), sorted.end());
+
+    const std::vector<std::pair<std::string, ElementArray>> inputSet {
+        {"uniform", uniform}, {"sorted", sorted},
+        {"same", ElementArray(size, 0)}, {"sawtooth", CreateSawtooth(static_cast<int>(size / 2))}};
+
+    ::RadixSort<Element, 8> radix8;
+    ::RadixSort<Element, 11> radix11;
+    const std::vector<std::pair<std::string, SortFunction>> sorterSet {
+        {"std::sort", [](ElementArray& array) { std::sort(array.begin(), array.end()); }},
+        {"QuickSort", [this](ElementArray& array) { QuickSort(array); }},
+        {"RadixSort(8bit)", [&](ElementArray& array) { radix8.Sort(array); }},
+        {"RadixSort(11bit)", [&](ElementArray& array) { radix11.Sort(array); }}};
+
+    using Clock = std::chrono::steady_clock;
+    for(const auto& input : inputSet) {
+        for(const auto& sorter : sorterSet) {
+            ElementArray array = input.second;
+            const auto start = Clock::now();
+            sorter.second(array);
+            const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start);
+            EXPECT_TRUE(IsSorted(array));
+            std::cout << input.first << " : " << sorter.first << " : " << elapsed.count() << "msec\n";
+        }
+    }
+}
+
+// メモリに載らないファイルをソートする
+class TestExternalSort : public TestQuickSort {
+protected:
+    using Path = boost::filesystem::path;
+    using Sorter = ExternalSort<Element>;
+
+    virtual void SetUp() override {
+        workDirectory_ = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("cppFriendsSort-%%%%-%%%%");
+        boost::filesystem::create_directories(workDirectory_);
+        inputPath_ = workDirectory_ / "input.bin";
+        outputPath_ = workDirectory_ / "output.bin";
+    }
+
+    virtual void TearDown() override {
+        boost::system::error_code ec;
+        boost::filesystem::remove_all(workDirectory_, ec);
+    }
+
+    void writeFile(const Path& path, const ElementArray& array) const {
+        std::ofstream os;
+        os.exceptions(std::ios::failbit | std::ios::badbit);
+        os.open(path.string(), std::ios::binary | std::ios::trunc);
+        os.write(reinterpret_cast<const char*>(array.data()),
+                 static_cast<std::streamsize>(array.size() * sizeof(Element)));
+    }
+
+    ElementArray readFile(const Path& path) const {
+        const auto bytes = boost::filesystem::file_size(path);
+        EXPECT_FALSE(bytes % sizeof(Element));
+        ElementArray array(static_cast<ElementArray::size_type>(bytes / sizeof(Element)));
+        std::ifstream is(path.string(), std::ios::binary);
+        is.read(reinterpret_cast<char*>(array.data()), static_cast<std::streamsize>(bytes));
+        return array;
+    }
+
+    ElementArray createRandomArray(ElementArray::size_type size, Element maxValue) const {
+        ElementArray array(size);
+        std::mt19937 gen(1);
+        std::uniform_int_distribution<Element> dist(-maxValue, maxValue);
+        for(auto& n : array) {
+            n = dist(gen);
+        }
+        return array;
+    }
+
+    // 入力と出力以外のファイルが残っていない
+    size_t countFiles(void) const {
+        return static_cast<size_t>(std::distance(boost::filesystem::directory_iterator(workDirectory_),
+                                                 boost::filesystem::directory_iterator()));
+    }
+
+    Path workDirectory_;
+    Path inputPath_;
+    Path outputPath_;
+};
+
+TEST_F(TestExternalSort, SinglePass) {
+    const auto array = createRandomArray(100000, 1000);
+    writeFile(inputPath_, array);
+
+    // 入力より大きなメモリがあれば、ランは一つ
+    Sorter sorter(array.size() * sizeof(Element) * 2, workDirectory_);
+    sorter.Sort(inputPath_, outputPath_);
+    EXPECT_EQ(1, sorter.GetSizeOfInitialRuns());
+    EXPECT_EQ(1, sorter.GetSizeOfMergePasses());
+
+    auto expected = array;
+    std::sort(expected.begin(), expected.end());
+    const auto actual = readFile(outputPath_);
+    EXPECT_TRUE(IsSorted(actual));
+    EXPECT_EQ(expected, actual);
+    EXPECT_EQ(2, countFiles());
+}
+
+TEST_F(TestExternalSort, MultiPass) {
+    // 最小のメモリ予算では、一度に2ランしかマージできない
+    const Sorter::Size memoryBudget = Sorter::MinBufferBytes * 3;
+    const auto runSize = memoryBudget / sizeof(Element);
+    for(auto size : {runSize - 1, runSize, runSize + 1, runSize * 5 + 7}) {
+        for(Element maxValue : {1, 1000000}) {
+            const auto array = createRandomArray(size, maxValue);
+            writeFile(inputPath_, array);
+
+            Sorter sorter(memoryBudget, workDirectory_);
+            EXPECT_EQ(2, sorter.GetFanIn());
+            sorter.Sort(inputPath_, outputPath_);
+            EXPECT_EQ((size + runSize - 1) / runSize, sorter.GetSizeOfInitialRuns());
+
+            auto expected = array;
+            std::sort(expected.begin(), expected.end());
+            const auto actual = readFile(outputPath_);
+            EXPECT_TRUE(IsSorted(actual));
+            EXPECT_EQ(expected, actual);
+            EXPECT_EQ(2, countFiles());
+        }
+    }
+}
+
+TEST_F(TestExternalSort, ManyRuns) {
+    const Sorter::Size memoryBudget = Sorter::MinBufferBytes * 8;
+    const auto array = createRandomArray(memoryBudget / sizeof(Element) * 20, 1000000);
+    writeFile(inputPath_, array);
+
+    Sorter sorter(memoryBudget, workDirectory_);
+    sorter.Sort(inputPath_, outputPath_);
+    EXPECT_EQ(20, sorter.GetSizeOfInitialRuns());
+    EXPECT_EQ(7, sorter.GetFanIn());
+    EXPECT_EQ(2, sorter.GetSizeOfMergePasses());
+
+    auto expected = array;
+    std::sort(expected.begin(), expected.end());
+    EXPECT_EQ(expected, readFile(outputPath_));
+    EXPECT_EQ(2, countFiles());
+}
+
+TEST_F(TestExternalSort, Empty) {
+    writeFile(inputPath_, ElementArray());
+    Sorter sorter(0, workDirectory_);
+    sorter.Sort(inputPath_, outputPath_);
+    EXPECT_EQ(0, sorter.GetSizeOfInitialRuns());
+    EXPECT_TRUE(readFile(outputPath_).empty());
+}
+
+TEST_F(TestExternalSort, Invalid) {
+    Sorter sorter(0, workDirectory_);
+    EXPECT_THROW(sorter.Sort(workDirectory_ / "notExist.bin", outputPath_), std::ios_base::failure);
+
+    // 要素の途中で終わっている
+    {
+        std::ofstream os(inputPath_.string(), std::ios::binary);
+        os << "abcdefg";
     }
+    EXPECT_THROW(sorter.Sort(inputPath_, outputPath_), std::ios_base::failure);
+    EXPECT_EQ(1, countFiles());
 }
 
 /*
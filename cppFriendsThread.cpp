@@ -1,14 +1,25 @@
 #include <algorithm>
+#include <array>
 #include <atomic>
 #include <chrono>
 #include <condition_variable>
+#include <deque>
 #include <future>
 #include <mutex>
+#include <shared_mutex>
 #include <thread>
 #include <tuple>
 #include <time.h>
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 #include <gtest/gtest.h>
 #include "cppFriends.hpp"
+#include "cppFriendsAffinity.hpp"
+#include "cppFriendsPerf.hpp"
+#include "cppFriendsThreadPool.hpp"
 
 // TLSを使わなくても、単にスレッド起動時の引数で渡せば済む
 class TestThreads : public ::testing::Test {};
@@ -30,42 +41,342 @@ TEST_F(TestThreads, All) {
     std::cout << "\n";
 }
 
+namespace {
+    // スピンロックの待ち合わせで、他の論理コアに実行資源とバスを譲る
+    void CpuRelax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+        asm volatile ("pause" ::: "memory");
+#else
+        std::this_thread::yield();
+#endif
+    }
+
+    // 待つたびにpauseの回数を倍にする(exponential backoff)
+    // 上限に達したら、論理コアより多くのスレッドが待っているかもしれないのでOSに譲る
+    class Backoff {
+    public:
+        void Pause(void) {
+            if (spinCount_ >= MaxSpinCount) {
+                std::this_thread::yield();
+                return;
+            }
+
+            for(unsigned int i = 0; i < spinCount_; ++i) {
+                CpuRelax();
+            }
+            spinCount_ *= 2;
+        }
+
+    private:
+        static constexpr unsigned int MaxSpinCount = 1024;
+        unsigned int spinCount_ {1};
+    };
+}
+
 // 排他制御が完全でないと何が起きるか確認する実験だが、
 // memory fenceがないと競合するケースが再現できていない
 
 class TestMemoryFence : public ::testing::Test {
 protected:
     using DataElement = int;
-    struct Data {
+    template <size_t Padding, bool HasGap = (Padding > 0)>
+    struct PaddedData {
         // std::atomicを使うときは明示的に初期化する。自動的に0になる訳ではない。
         std::atomic<DataElement> element {0};
-        // キャッシュのラインサイズ分だけ他のatomic変数と離す。
-        // C++17ではこのサイズ(64)を取得できる。
-        uint8_t gap[64];
+        // Paddingだけ他のatomic変数と離す
+        uint8_t gap[Padding];
+    };
+    // 長さ0の配列は作れないので、離さないときは特殊化する
+    template <size_t Padding>
+    struct PaddedData<Padding, false> {
+        std::atomic<DataElement> element {0};
     };
+    // キャッシュのラインサイズ分だけ他のatomic変数と離す。
+    // C++17ではこのサイズをstd::hardware_destructive_interference_sizeで取得できる。
+    using Data = PaddedData<CpuAffinity::DestructiveInterferenceSize>;
     using DataSet = std::vector<Data>;
     using Count = DataElement;
     static constexpr DataElement WriteLocked = 1;
     static constexpr Count TrialCountSpin = 2000000;
     static constexpr Count TrialCountMutex = 200000; // Mutexは時間が掛かり過ぎ
+    static constexpr Count TrialCountSeqlock = 2000000;
+    static constexpr Count TrialCountRwlock = 200000;  // Mutexと同程度に時間が掛かる
+    static constexpr Count TrialCountRcu = 200000;     // 更新のたびに複製を作るので時間が掛かる
+    static constexpr Count TrialCountTicket = 2000000;
+    static constexpr Count TrialCountMcs = 2000000;
+    static constexpr Count DefaultReaderSize = 3;      // writerと併せて論理コアくらい
 
     enum class MODE {
-        ASYNC,  // 同期処理を何もしないのでメチャクチャになる(というのを作りたい)
-        SPIN,   // Compare and Swapによるスピンロックで同期する
-        MUTEX,  // std::mutexで同期する
+        ASYNC,    // 同期処理を何もしないのでメチャクチャになる(というのを作りたい)
+        SPIN,     // Compare and Swapによるスピンロックで同期する
+        MUTEX,    // std::mutexで同期する
+        SEQLOCK,  // writerが更新の前後で通番を進め、readerは通番が変わっていたら読み直す
+        RWLOCK,   // std::shared_timed_mutexで、readers同士は同時に読み、writerは排他する
+        RCU,      // writerは複製を更新して差し替え、誰も読まなくなった古い版を解放する
+        TICKET,   // 整理券順に排他を確保するので、writerが飢餓状態にならない
+        MCS,      // 待ち行列に並び、各スレッドは自分のノードだけを見て待つ
+    };
+
+    // チケットロック : 整理券を取った順に排他を確保するので公平である
+    // 全スレッドが同じnowServing_を読むので、解放のたびにキャッシュラインが全スレッドに転送される
+    class TicketLock {
+    public:
+        void Lock(void) {
+            const auto ticket = nextTicket_.element.fetch_add(1, std::memory_order_relaxed);
+            Backoff backoff;
+            while(nowServing_.element.load(std::memory_order_acquire) != ticket) {
+                backoff.Pause();
+            }
+        }
+
+        void Unlock(void) {
+            // 排他を確保しているのは自分だけなので、read-modify-writeは要らない
+            const auto next = nowServing_.element.load(std::memory_order_relaxed) + 1;
+            nowServing_.element.store(next, std::memory_order_release);
+        }
+
+    private:
+        Data nextTicket_ {{0},{0}};
+        Data nowServing_ {{0},{0}};
+    };
+
+    // MCSロック : 待ち行列の末尾に自分のノードをつなぎ、前のスレッドから順番を渡してもらう
+    // 各スレッドは自分のノードだけを見て待つので、スレッドが増えてもキャッシュラインの取り合いにならない
+    class McsLock {
+    public:
+        struct Node {
+            std::atomic<Node*> next {nullptr};
+            std::atomic<bool> locked {false};
+            uint8_t gap[64];  // 他のスレッドのノードと同じキャッシュラインに置かない
+        };
+
+        void Lock(Node& node) {
+            node.next.store(nullptr, std::memory_order_relaxed);
+            auto pPrev = tail_.exchange(&node, std::memory_order_acq_rel);
+            if (!pPrev) {
+                // 誰も待っていない
+                return;
+            }
+
+            // 前のスレッドはnextをたどってからlockedを下ろすので、つなぐ前に立てておく
+            node.locked.store(true, std::memory_order_relaxed);
+            pPrev->next.store(&node, std::memory_order_release);
+            Backoff backoff;
+            while(node.locked.load(std::memory_order_acquire)) {
+                backoff.Pause();
+            }
+        }
+
+        void Unlock(Node& node) {
+            auto pNext = node.next.load(std::memory_order_acquire);
+            if (!pNext) {
+                // 後ろに誰もいなければ待ち行列を空にする
+                Node* pExpected = &node;
+                if (tail_.compare_exchange_strong(pExpected, nullptr, std::memory_order_release,
+                                                  std::memory_order_relaxed)) {
+                    return;
+                }
+
+                // 後ろのスレッドがtail_を書き換えてから、nextをつなぐまでの間である
+                while(!(pNext = node.next.load(std::memory_order_acquire))) {
+                    CpuRelax();
+                }
+            }
+
+            pNext->locked.store(false, std::memory_order_release);
+        }
+
+    private:
+        std::atomic<Node*> tail_ {nullptr};
+        uint8_t gap_[64];
+    };
+
+    // スレッドごとに、排他を確保した回数と、確保するまで待った時間の分布を数える
+    class LockStats {
+        FRIEND_TEST(TestMemoryFence, LockStats);
+    public:
+        using Nanoseconds = uint64_t;
+
+        // 排他を確保するまでの時間を計る
+        template <typename Locker>
+        void Acquire(Locker locker) {
+            using Clock = std::chrono::steady_clock;
+            const auto start = Clock::now();
+            locker();
+            const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start);
+            add(static_cast<Nanoseconds>(std::max(static_cast<decltype(elapsed.count())>(0), elapsed.count())));
+        }
+
+        uint64_t GetCount(void) const {
+            return count_;
+        }
+
+        Nanoseconds GetMax(void) const {
+            return max_;
+        }
+
+        // 待ち時間がこれ以下だった割合がratio以上になる値。2のべき乗単位で丸める。
+        Nanoseconds GetPercentile(double ratio) const {
+            const auto threshold = static_cast<uint64_t>(static_cast<double>(count_) * ratio);
+            uint64_t total = 0;
+            for(size_t i = 0; i < SizeOfBuckets; ++i) {
+                total += buckets_[i];
+                if (buckets_[i] && (total >= threshold)) {
+                    // バケットiは[2^(i-1), 2^i)を数えている
+                    const Nanoseconds upper = (i >= 64) ? max_ : ((static_cast<Nanoseconds>(1) << i) - 1);
+                    return std::min(upper, max_);
+                }
+            }
+            return max_;
+        }
+
+    private:
+        static constexpr size_t SizeOfBuckets = 65;
+
+        void add(Nanoseconds latency) {
+            size_t index = 0;
+            for(auto value = latency; value; value >>= 1) {
+                ++index;
+            }
+
+            ++buckets_[index];
+            ++count_;
+            max_ = std::max(max_, latency);
+        }
+
+        // バケットiは、待ち時間が[2^(i-1), 2^i)だった回数(バケット0は0nsの回数)
+        std::array<uint64_t, SizeOfBuckets> buckets_ {{0}};
+        uint64_t count_ {0};
+        Nanoseconds max_ {0};
+    };
+
+    // Read-Copy-Update
+    // readerはロックせずに最新版を読む。writerは最新版を複製して更新し、atomicなポインタで公開する。
+    // 古い版は、それを読んでいる可能性があるreaderがいなくなってから解放する(epoch based reclamation)。
+    class RcuDomain {
+    public:
+        using Epoch = uint64_t;
+        using Index = size_t;
+
+        RcuDomain(Index sizeOfReaders, DataSet::size_type sizeOfData) :
+            readerEpochs_(std::max(sizeOfReaders, static_cast<Index>(1))),
+            sizeOfData_(sizeOfData), published_(new DataSet(sizeOfData)) {
+            for(auto& readerEpoch : readerEpochs_) {
+                readerEpoch.epoch = Quiescent;
+            }
+        }
+
+        virtual ~RcuDomain(void) {
+            for(auto& retired : retiredSet_) {
+                delete retired.second;
+            }
+            delete published_.load();
+        }
+
+        RcuDomain(const RcuDomain&) = delete;
+        RcuDomain& operator =(const RcuDomain&) = delete;
+
+        // readerが読み始める。返した版は、ReadUnlockを呼ぶまで解放されない。
+        const DataSet& ReadLock(Index readerIndex) {
+            // 今のepochを宣言してから最新版を読む
+            // 宣言がwriterから見えなければ、writerが古い版を退避した後に読むので、新しい版が見える
+            readerEpochs_.at(readerIndex).epoch.store(globalEpoch_.load());
+            return *published_.load();
+        }
+
+        void ReadUnlock(Index readerIndex) {
+            readerEpochs_.at(readerIndex).epoch.store(Quiescent, std::memory_order_release);
+        }
+
+        // 最新版を複製して一つずつ増やし、公開する。writerは一つだけとする。
+        void Update(void) {
+            const DataSet* pCurrent = published_.load(std::memory_order_relaxed);
+            auto pNext = new DataSet(sizeOfData_);
+            for(DataSet::size_type i = 0; i < sizeOfData_; ++i) {
+                pNext->at(i).element.store(pCurrent->at(i).element.load(std::memory_order_relaxed) + 1,
+                                           std::memory_order_relaxed);
+            }
+
+            // 差し替えた版は、このepoch以前に読み始めたreaderが読んでいるかもしれない
+            auto pOld = published_.exchange(pNext);
+            retiredSet_.push_back(std::make_pair(globalEpoch_.fetch_add(1), pOld));
+            reclaim();
+        }
+
+        // 最新版の値を写す
+        void CopyTo(DataSet& dataSet) const {
+            const DataSet* pCurrent = published_.load();
+            for(DataSet::size_type i = 0; i < std::min(sizeOfData_, dataSet.size()); ++i) {
+                dataSet.at(i).element = pCurrent->at(i).element.load();
+            }
+        }
+
+        // 解放した版の数
+        size_t GetReclaimedCount(void) const {
+            return reclaimedCount_;
+        }
+
+    private:
+        static constexpr Epoch Quiescent = std::numeric_limits<Epoch>::max();
+
+        struct ReaderEpoch {
+            std::atomic<Epoch> epoch {0};
+            uint8_t gap[64];  // 他のreaderのepochと同じキャッシュラインに置かない
+        };
+
+        // 読んでいる最中のreaderの最も古いepochより前に退避した版は、もう誰も読んでいない
+        void reclaim(void) {
+            Epoch oldest = Quiescent;
+            for(auto& readerEpoch : readerEpochs_) {
+                oldest = std::min(oldest, readerEpoch.epoch.load());
+            }
+
+            while(!retiredSet_.empty() && (retiredSet_.front().first < oldest)) {
+                delete retiredSet_.front().second;
+                retiredSet_.pop_front();
+                ++reclaimedCount_;
+            }
+        }
+
+        std::vector<ReaderEpoch> readerEpochs_;
+        DataSet::size_type sizeOfData_ {0};
+        std::atomic<DataSet*> published_ {nullptr};
+        std::atomic<Epoch> globalEpoch_ {0};
+        std::deque<std::pair<Epoch, DataSet*>> retiredSet_;  // writerだけが触る
+        size_t reclaimedCount_ {0};
+    };
+
+    // producerとconsumersが共有する同期オブジェクト
+    struct SyncSet {
+        SyncSet(Count readerSize, DataSet::size_type sizeOfData) :
+            rcu(static_cast<RcuDomain::Index>(readerSize), sizeOfData) {}
+        std::mutex mutex;
+        std::shared_timed_mutex sharedMutex;
+        Data ready {{0},{0}};
+        Data reader {{0},{0}};
+        Data writer {{0},{0}};
+        Data sequence {{0},{0}};
+        RcuDomain rcu;
+        TicketLock ticketLock;
+        McsLock mcsLock;
     };
 
     // データを更新する
     class Producer {
     public:
-        Producer(MODE mode, Count loopCount, DataSet& dataSet,
-                 std::mutex& mx, Data& ready, Data& reader, Data& writer) :
+        Producer(MODE mode, Count loopCount, DataSet& dataSet, SyncSet& sync) :
             mode_(mode), loopCount_(loopCount), dataSet_(dataSet),
-            mutex_(mx), ready_(ready), reader_(reader), writer_(writer) {
+            mutex_(sync.mutex), sharedMutex_(sync.sharedMutex), ready_(sync.ready), reader_(sync.reader),
+            writer_(sync.writer), sequence_(sync.sequence), rcu_(sync.rcu),
+            ticketLock_(sync.ticketLock), mcsLock_(sync.mcsLock) {
         }
 
         virtual ~Producer(void) = default;
 
+        const LockStats& GetLockStats(void) const {
+            return lockStats_;
+        }
+
         void Run(void) {
             // データを消費するスレッドが起きるまで少し待つ
             timespec req {0, 10000000};
@@ -95,6 +406,21 @@ protected:
             case MODE::MUTEX:
                 runInMutex();
                 break;
+            case MODE::SEQLOCK:
+                runInSeqlock();
+                break;
+            case MODE::RWLOCK:
+                runInRwlock();
+                break;
+            case MODE::RCU:
+                runInRcu();
+                break;
+            case MODE::TICKET:
+                runInTicket();
+                break;
+            case MODE::MCS:
+                runInMcs();
+                break;
             default:
                 break;
             }
@@ -105,9 +431,16 @@ protected:
         Count loopCount_ {0};
         DataSet& dataSet_;
         std::mutex& mutex_;
+        std::shared_timed_mutex& sharedMutex_;
         Data& ready_;
         Data& reader_;
         Data& writer_;
+        Data& sequence_;
+        RcuDomain& rcu_;
+        TicketLock& ticketLock_;
+        McsLock& mcsLock_;
+        McsLock::Node mcsNode_;
+        LockStats lockStats_;
 
         void runIncorrectly(void) {
             // これを作る
@@ -116,7 +449,9 @@ protected:
         void runInSpinning(void) {
             for(Count i = 0; i<loopCount_; ++i) {
                 // Writeに対する排他を確保する
-                while(writer_.element.exchange(WriteLocked, std::memory_order_seq_cst) == WriteLocked) {}
+                lockStats_.Acquire([this](void) {
+                        while(writer_.element.exchange(WriteLocked, std::memory_order_seq_cst) == WriteLocked) {}
+                    });
 
                 // すべてのatomic要素を更新する
                 for(auto& d : dataSet_) {
@@ -141,21 +476,79 @@ protected:
         void runInMutex(void) {
             for(Count i = 0; i<loopCount_; ++i) {
                 // ブロックスコープ内を排他制御する。mfenceも行う。
-                std::lock_guard<std::mutex> lock{mutex_};
+                std::unique_lock<std::mutex> lock{mutex_, std::defer_lock};
+                lockStats_.Acquire([&lock](void) { lock.lock(); });
 
                 for(auto& d : dataSet_) {
                     ++d.element;
                 }
             }
         }
+
+        void runInSeqlock(void) {
+            // writerは一つなので、writer同士の排他は要らない
+            for(Count i = 0; i<loopCount_; ++i) {
+                // 奇数は更新中を示す
+                const auto sequence = sequence_.element.load(std::memory_order_relaxed);
+                sequence_.element.store(sequence + 1, std::memory_order_relaxed);
+                // 通番を奇数にしたことが、要素の更新より先に見えるようにする
+                std::atomic_thread_fence(std::memory_order_release);
+
+                for(auto& d : dataSet_) {
+                    d.element.store(d.element.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                }
+
+                // 要素の更新が、通番を偶数にしたことより先に見えるようにする
+                sequence_.element.store(sequence + 2, std::memory_order_release);
+            }
+        }
+
+        void runInRwlock(void) {
+            for(Count i = 0; i<loopCount_; ++i) {
+                // readersもwriterも締め出す
+                std::unique_lock<std::shared_timed_mutex> lock{sharedMutex_};
+
+                for(auto& d : dataSet_) {
+                    ++d.element;
+                }
+            }
+        }
+
+        void runInRcu(void) {
+            for(Count i = 0; i<loopCount_; ++i) {
+                // readersを待たない
+                rcu_.Update();
+            }
+        }
+
+        void runInTicket(void) {
+            for(Count i = 0; i<loopCount_; ++i) {
+                lockStats_.Acquire([this](void) { ticketLock_.Lock(); });
+                for(auto& d : dataSet_) {
+                    ++d.element;
+                }
+                ticketLock_.Unlock();
+            }
+        }
+
+        void runInMcs(void) {
+            for(Count i = 0; i<loopCount_; ++i) {
+                lockStats_.Acquire([this](void) { mcsLock_.Lock(mcsNode_); });
+                for(auto& d : dataSet_) {
+                    ++d.element;
+                }
+                mcsLock_.Unlock(mcsNode_);
+            }
+        }
     };
 
     class Consumer {
     public:
-        Consumer(MODE mode, Count loopCount, DataSet& dataSet,
-                 std::mutex& mx, Data& ready, Data& reader, Data& writer) :
+        Consumer(MODE mode, Count loopCount, DataSet& dataSet, SyncSet& sync, Count readerIndex) :
             mode_(mode), loopCount_(loopCount), dataSet_(dataSet),
-            mutex_(mx), ready_(ready), reader_(reader), writer_(writer) {
+            mutex_(sync.mutex), sharedMutex_(sync.sharedMutex), ready_(sync.ready), reader_(sync.reader),
+            writer_(sync.writer), sequence_(sync.sequence), rcu_(sync.rcu),
+            ticketLock_(sync.ticketLock), mcsLock_(sync.mcsLock), readerIndex_(readerIndex) {
         }
         virtual ~Consumer(void) = default;
 
@@ -172,6 +565,21 @@ protected:
             case MODE::MUTEX:
                 runInMutex();
                 break;
+            case MODE::SEQLOCK:
+                runInSeqlock();
+                break;
+            case MODE::RWLOCK:
+                runInRwlock();
+                break;
+            case MODE::RCU:
+                runInRcu();
+                break;
+            case MODE::TICKET:
+                runInTicket();
+                break;
+            case MODE::MCS:
+                runInMcs();
+                break;
             default:
                 break;
             }
@@ -181,6 +589,15 @@ protected:
             return count_;
         }
 
+        const LockStats& GetLockStats(void) const {
+            return lockStats_;
+        }
+
+        // 読み直した回数
+        Count GetRetryCount(void) const {
+            return retryCount_;
+        }
+
         void runIncorrectly(void) {
             // これを作る
         }
@@ -190,7 +607,9 @@ protected:
                 // Writeに対する排他を確保する
                 // 同時に複数のreadersからは読めない
                 // (工夫すればできそうだが、readerが多すぎるとライブロックしてwriterが更新できなくなる)
-                while(writer_.element.exchange(WriteLocked, std::memory_order_seq_cst) == WriteLocked) {}
+                lockStats_.Acquire([this](void) {
+                        while(writer_.element.exchange(WriteLocked, std::memory_order_seq_cst) == WriteLocked) {}
+                    });
 
                 // happens beforeは受け側でも指示する
                 std::atomic_thread_fence(std::memory_order_seq_cst);
@@ -204,23 +623,96 @@ protected:
         void runInMutex(void) {
             for(Count i = 0; i<loopCount_; ++i) {
                 // ブロックスコープ内を排他制御する
-                std::lock_guard<std::mutex> lock{mutex_};
+                std::unique_lock<std::mutex> lock{mutex_, std::defer_lock};
+                lockStats_.Acquire([&lock](void) { lock.lock(); });
+                checkConsistency();
+            }
+        }
+
+        void runInSeqlock(void) {
+            // readers同士は排他しないので、同時に読める
+            // writerを待たせることもない
+            for(Count i = 0; i<loopCount_; ++i) {
+                for(;;) {
+                    // writerが更新中(奇数)なら、終わるまで待つ
+                    const auto sequence = sequence_.element.load(std::memory_order_acquire);
+                    if (sequence & 1) {
+                        continue;
+                    }
+
+                    // 読んだ結果は、通番が変わっていなかったときだけ使う
+                    const bool consistent = isConsistent();
+                    std::atomic_thread_fence(std::memory_order_acquire);
+                    if (sequence_.element.load(std::memory_order_relaxed) == sequence) {
+                        if (!consistent) {
+                            ++count_;
+                        }
+                        break;
+                    }
+
+                    ++retryCount_;
+                }
+            }
+        }
+
+        void runInRwlock(void) {
+            for(Count i = 0; i<loopCount_; ++i) {
+                // readers同士は同時に入れる
+                std::shared_lock<std::shared_timed_mutex> lock{sharedMutex_};
                 checkConsistency();
             }
         }
 
+        void runInRcu(void) {
+            for(Count i = 0; i<loopCount_; ++i) {
+                // 読んでいる版はwriterが更新しないので、必ず一貫している
+                const auto& dataSet = rcu_.ReadLock(static_cast<RcuDomain::Index>(readerIndex_));
+                if (!isConsistent(dataSet)) {
+                    ++count_;
+                }
+                rcu_.ReadUnlock(static_cast<RcuDomain::Index>(readerIndex_));
+            }
+        }
+
+        void runInTicket(void) {
+            for(Count i = 0; i<loopCount_; ++i) {
+                // 整理券順なので、readersが続いてもwriterの順番が必ず来る
+                lockStats_.Acquire([this](void) { ticketLock_.Lock(); });
+                checkConsistency();
+                ticketLock_.Unlock();
+            }
+        }
+
+        void runInMcs(void) {
+            for(Count i = 0; i<loopCount_; ++i) {
+                lockStats_.Acquire([this](void) { mcsLock_.Lock(mcsNode_); });
+                checkConsistency();
+                mcsLock_.Unlock(mcsNode_);
+            }
+        }
+
         void checkConsistency(void) {
+            if (!isConsistent()) {
+                ++count_;
+            }
+        }
+
+        bool isConsistent(void) const {
+            return isConsistent(dataSet_);
+        }
+
+        static bool isConsistent(const DataSet& dataSet) {
             DataElement prev = std::numeric_limits<decltype(prev)>::max();
-            for(auto& d : dataSet_) {
+            for(auto& d : dataSet) {
                 DataElement e = d.element;
                 // 更新順序が逆転している
                 // 周回をまたぐことはないのでこれでよい
                 if (prev < e) {
-                    ++count_;
-                    break;
+                    return false;
                 }
                 prev = e;
             }
+            return true;
         }
 
     private:
@@ -228,46 +720,121 @@ protected:
         Count loopCount_ {0};
         DataSet& dataSet_;
         std::mutex& mutex_;
+        std::shared_timed_mutex& sharedMutex_;
         Data& ready_;
         Data& reader_;
         Data& writer_;
+        Data& sequence_;
+        RcuDomain& rcu_;
+        TicketLock& ticketLock_;
+        McsLock& mcsLock_;
+        McsLock::Node mcsNode_;
+        LockStats lockStats_;
+        Count readerIndex_ {0};
         Count count_ {0};
+        Count retryCount_ {0};
     };
 
-    void exec(MODE mode, Count loopCount, Count& minCount, Count& maxCount) {
+    static const char* getModeName(MODE mode) {
+        switch(mode) {
+        case MODE::ASYNC:
+            return "async";
+        case MODE::SPIN:
+            return "spin";
+        case MODE::MUTEX:
+            return "mutex";
+        case MODE::SEQLOCK:
+            return "seqlock";
+        case MODE::RWLOCK:
+            return "rwlock";
+        case MODE::RCU:
+            return "rcu";
+        case MODE::TICKET:
+            return "ticket";
+        case MODE::MCS:
+            return "mcs";
+        default:
+            break;
+        }
+        return "??";
+    }
+
+    // 排他を確保した回数と待ち時間を、スレッドごとに表示する
+    static void printLockStats(const char* name, const LockStats& stats) {
+        if (!stats.GetCount()) {
+            return;
+        }
+
+        std::cout << "  " << name << " : " << stats.GetCount() << " acquisitions, wait p50 "
+                  << stats.GetPercentile(0.5) << " nsec, p99 " << stats.GetPercentile(0.99)
+                  << " nsec, p99.9 " << stats.GetPercentile(0.999) << " nsec, max " << stats.GetMax() << " nsec\n";
+    }
+
+    // テストごとにスレッドを起動しない
+    static WorkStealing::ThreadPool& getThreadPool(void) {
+        const auto hardwareConcurrency = static_cast<Count>(std::thread::hardware_concurrency());
+        const auto readerSize = (hardwareConcurrency > DefaultReaderSize) ? hardwareConcurrency : DefaultReaderSize;
+        // writerの分を足す
+        static WorkStealing::ThreadPool pool(static_cast<WorkStealing::ThreadPool::SizeOfThreads>(readerSize) + 1);
+        return pool;
+    }
+
+    void exec(MODE mode, Count loopCount, Count& minCount, Count& maxCount, Count readerSize = DefaultReaderSize) {
         minCount = 0;
         maxCount = 0;
 
         DataSet  dataSet(16);  // キャッシュの連想度を超えるくらい
-        std::mutex mx;
-        Data ready  {{0},{0}};
-        Data reader {{0},{0}};
-        Data writer {{0},{0}};
-        constexpr Count readerSize = 3;  // writerと併せて論理コアくらい
+        SyncSet sync(readerSize, dataSet.size());
 
         // One-writer, multi-reader
-        Producer producer(mode, loopCount, dataSet, mx, ready, reader, writer);
+        Producer producer(mode, loopCount, dataSet, sync);
         std::vector<std::unique_ptr<Consumer>> consumers;
         for(Count i=0; i<readerSize; ++i) {
-            consumers.push_back(std::make_unique<Consumer>(mode, loopCount, dataSet, mx, ready, reader, writer));
+            consumers.push_back(std::make_unique<Consumer>(mode, loopCount, dataSet, sync, i));
         }
 
+        using Clock = std::chrono::steady_clock;
+        const auto start = Clock::now();
         {
+            // readersとwriterは互いを待つので、全員が同時に動けなければならない
+            auto& pool = getThreadPool();
+            ASSERT_LT(static_cast<size_t>(readerSize), pool.GetSizeOfThreads());
+
             // 並行処理を作って、後で実行できるようにする
-            std::vector<std::future<void>> futureSet;
+            std::vector<WorkStealing::Future<void>> futureSet;
             for(auto& p : consumers) {
                 // futureの方が寿命が短いのだから、shared_ptrにする必要はない
                 Consumer* pConsumer = p.get();
-                futureSet.push_back(std::async(std::launch::async, [=](void) -> void { pConsumer->Run(); }));
+                futureSet.push_back(pool.Submit([=](void) -> void { pConsumer->Run(); }));
             }
-            futureSet.push_back(std::async(std::launch::async, [&](void) -> void { producer.Run(); }));
+            futureSet.push_back(pool.Submit([&](void) -> void { producer.Run(); }));
 
             // 並行して評価して、結果がそろうのを待つ
             for(auto& f : futureSet) {
-                f.get();
+                f.Get();
             }
         }
 
+        // producerが起きるまでの待ち時間を含む
+        const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start);
+        const auto elapsedUsec = std::max(static_cast<decltype(elapsed.count())>(1), elapsed.count());
+        const auto totalReads = static_cast<long long>(loopCount) * readerSize;
+        Count retryCount = 0;
+        for(auto& p : consumers) {
+            retryCount += p->GetRetryCount();
+        }
+        std::cout << readerSize << " Readers(" << getModeName(mode) << ") : " << (totalReads * 1000000 / elapsedUsec)
+                  << " reads/sec, " << retryCount << " retries\n";
+        printLockStats("writer", producer.GetLockStats());
+        for(auto& p : consumers) {
+            printLockStats("reader", p->GetLockStats());
+        }
+
+        // RCUは最新版に書いている
+        if (mode == MODE::RCU) {
+            sync.rcu.CopyTo(dataSet);
+        }
+
         for(auto& d : dataSet) {
             EXPECT_EQ(loopCount, d.element);
         }
@@ -283,6 +850,48 @@ protected:
         maxCount = (*maxComsumer)->GetCount();
         return;
     }
+
+    // 各スレッドが自分の要素だけを書く。要素が同じキャッシュラインに載ると、書くたびにラインを奪い合う。
+    template <size_t Padding>
+    void measureFalseSharing(size_t sizeOfThreads, Count loopCount) {
+        std::vector<PaddedData<Padding>> dataSet(sizeOfThreads);
+
+        using Clock = std::chrono::steady_clock;
+        // カウンタを開いた後に起動したスレッドを数えるので、スレッドプールは使わない
+        PerfEvent::CounterSet counters;
+        const auto start = Clock::now();
+        const auto results = counters.Measure([&](void) {
+                std::vector<std::thread> threads;
+                for(size_t i = 0; i < sizeOfThreads; ++i) {
+                    threads.emplace_back([&dataSet, i, loopCount](void) {
+                            auto& element = dataSet.at(i).element;
+                            for(Count n = 0; n < loopCount; ++n) {
+                                element.fetch_add(1, std::memory_order_relaxed);
+                            }
+                        });
+                }
+                for(auto& t : threads) {
+                    t.join();
+                }
+            });
+        const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start);
+
+        std::cout << "Padding " << Padding << " (sizeof " << sizeof(PaddedData<Padding>) << ") : "
+                  << elapsed.count() << " usec";
+        for(auto& result : results) {
+            std::cout << ", " << PerfEvent::GetEventName(result.event) << " ";
+            if (result.available) {
+                std::cout << result.value;
+            } else {
+                std::cout << "n/a";
+            }
+        }
+        std::cout << "\n";
+
+        for(auto& d : dataSet) {
+            EXPECT_EQ(loopCount, d.element);
+        }
+    }
 };
 
 TEST_F(TestMemoryFence, Async) {
@@ -321,6 +930,207 @@ TEST_F(TestMemoryFence, Mutex) {
     return;
 }
 
+TEST_F(TestMemoryFence, Seqlock) {
+    if (std::thread::hardware_concurrency() <= 1) {
+        return;
+    }
+
+    Count minCount = 0;
+    Count maxCount = 0;
+    // readers同士もwriterもお互いを待たないので、spinと同じ回数で済む
+    exec(MODE::SEQLOCK, TrialCountSeqlock, minCount, maxCount);
+
+    std::cout << "consumer.GetCount(seqlock) = count " << minCount << "\n";
+    EXPECT_FALSE(minCount);
+    EXPECT_FALSE(maxCount);
+    return;
+}
+
+// readerの数を増やして、どれだけ読めるか比べる
+TEST_F(TestMemoryFence, ScaleReaders) {
+    if (std::thread::hardware_concurrency() <= 1) {
+        return;
+    }
+
+    // readersとwriterが論理CPUに収まる数までにする。
+    // 待っているスレッドがプリエンプトされると、FIFOで渡すロックはなかなか進まない。
+    const auto maxReaderSize = static_cast<Count>(std::thread::hardware_concurrency()) - 1;
+    // 何通りも試すので、どの方式もMutexと同じ回数にする
+    const std::vector<MODE> modes {
+        MODE::MUTEX, MODE::RWLOCK, MODE::SEQLOCK, MODE::RCU, MODE::SPIN, MODE::TICKET, MODE::MCS};
+
+    for(auto mode : modes) {
+        for(Count readerSize = 1; readerSize <= maxReaderSize; ++readerSize) {
+            Count minCount = 0;
+            Count maxCount = 0;
+            exec(mode, TrialCountMutex, minCount, maxCount, readerSize);
+            EXPECT_FALSE(minCount);
+            EXPECT_FALSE(maxCount);
+        }
+    }
+}
+
+TEST_F(TestMemoryFence, Rwlock) {
+    if (std::thread::hardware_concurrency() <= 1) {
+        return;
+    }
+
+    Count minCount = 0;
+    Count maxCount = 0;
+    exec(MODE::RWLOCK, TrialCountRwlock, minCount, maxCount);
+
+    std::cout << "consumer.GetCount(rwlock) = count " << minCount << "\n";
+    EXPECT_FALSE(minCount);
+    EXPECT_FALSE(maxCount);
+    return;
+}
+
+TEST_F(TestMemoryFence, Rcu) {
+    if (std::thread::hardware_concurrency() <= 1) {
+        return;
+    }
+
+    Count minCount = 0;
+    Count maxCount = 0;
+    exec(MODE::RCU, TrialCountRcu, minCount, maxCount);
+
+    std::cout << "consumer.GetCount(rcu) = count " << minCount << "\n";
+    EXPECT_FALSE(minCount);
+    EXPECT_FALSE(maxCount);
+    return;
+}
+
+TEST_F(TestMemoryFence, Ticket) {
+    if (std::thread::hardware_concurrency() <= 1) {
+        return;
+    }
+
+    Count minCount = 0;
+    Count maxCount = 0;
+    exec(MODE::TICKET, TrialCountTicket, minCount, maxCount);
+
+    std::cout << "consumer.GetCount(ticket) = count " << minCount << "\n";
+    EXPECT_FALSE(minCount);
+    EXPECT_FALSE(maxCount);
+    return;
+}
+
+TEST_F(TestMemoryFence, Mcs) {
+    if (std::thread::hardware_concurrency() <= 1) {
+        return;
+    }
+
+    Count minCount = 0;
+    Count maxCount = 0;
+    exec(MODE::MCS, TrialCountMcs, minCount, maxCount);
+
+    std::cout << "consumer.GetCount(mcs) = count " << minCount << "\n";
+    EXPECT_FALSE(minCount);
+    EXPECT_FALSE(maxCount);
+    return;
+}
+
+// 隣のスレッドの変数との距離を変えて、false sharingの影響を比べる
+TEST_F(TestMemoryFence, FalseSharing) {
+    const size_t sizeOfThreads = std::max(2u, std::thread::hardware_concurrency());
+    constexpr Count loopCount = 2000000;
+    // 論理コアが一つならキャッシュラインを奪い合わないので、差は出ない
+    measureFalseSharing<0>(sizeOfThreads, loopCount);
+    measureFalseSharing<64>(sizeOfThreads, loopCount);
+    // 隣接ラインをまとめて読むCPUでは、二ライン離すと差が出ることがある
+    measureFalseSharing<128>(sizeOfThreads, loopCount);
+    measureFalseSharing<CpuAffinity::DestructiveInterferenceSize>(sizeOfThreads, loopCount);
+}
+
+// 待ち時間の分布
+TEST_F(TestMemoryFence, LockStats) {
+    LockStats stats;
+    EXPECT_EQ(0, stats.GetCount());
+    EXPECT_EQ(0, stats.GetPercentile(0.99));
+
+    // 分かっている待ち時間を数える
+    for(int i = 0; i < 50; ++i) {
+        stats.add(0);
+    }
+    for(int i = 0; i < 40; ++i) {
+        stats.add(100);
+    }
+    for(int i = 0; i < 10; ++i) {
+        stats.add(5000);
+    }
+
+    EXPECT_EQ(100, stats.GetCount());
+    EXPECT_EQ(5000, stats.GetMax());
+    EXPECT_EQ(50, stats.buckets_.at(0));
+    EXPECT_EQ(40, stats.buckets_.at(7));   // [64, 128)
+    EXPECT_EQ(10, stats.buckets_.at(13));  // [4096, 8192)
+    uint64_t total = 0;
+    for(size_t i = 0; i < LockStats::SizeOfBuckets; ++i) {
+        total += stats.buckets_.at(i);
+    }
+    EXPECT_EQ(100, total);
+
+    EXPECT_EQ(0, stats.GetPercentile(0.5));
+    EXPECT_EQ(127, stats.GetPercentile(0.9));
+    // バケットの上限より最大値が小さければ、最大値を返す
+    EXPECT_EQ(5000, stats.GetPercentile(0.99));
+    EXPECT_EQ(5000, stats.GetPercentile(1.0));
+
+    // 少なくとも眠った時間だけ待つ
+    LockStats sleepStats;
+    constexpr LockStats::Nanoseconds sleepNsec = 2000000;
+    sleepStats.Acquire([](void) { std::this_thread::sleep_for(std::chrono::milliseconds(2)); });
+    EXPECT_EQ(1, sleepStats.GetCount());
+    EXPECT_LE(sleepNsec, sleepStats.GetMax());
+    EXPECT_EQ(sleepStats.GetMax(), sleepStats.GetPercentile(0.5));
+}
+
+// 一つのスレッドで、ロックの出入りを繰り返す
+TEST_F(TestMemoryFence, QueuedLocks) {
+    TicketLock ticketLock;
+    McsLock mcsLock;
+    McsLock::Node node;
+
+    for(int i = 0; i < 3; ++i) {
+        ticketLock.Lock();
+        ticketLock.Unlock();
+        mcsLock.Lock(node);
+        EXPECT_FALSE(node.locked.load());
+        mcsLock.Unlock(node);
+    }
+}
+
+// 読んでいる最中の版は解放されない
+TEST_F(TestMemoryFence, RcuReclaim) {
+    constexpr DataSet::size_type sizeOfData = 4;
+    RcuDomain rcu(2, sizeOfData);
+
+    const auto& oldVersion = rcu.ReadLock(0);
+    rcu.Update();
+    rcu.Update();
+    EXPECT_EQ(0, rcu.GetReclaimedCount());
+    EXPECT_EQ(0, oldVersion.at(0).element.load());
+
+    // 後から読み始めたreaderは新しい版を読む
+    const auto& newVersion = rcu.ReadLock(1);
+    EXPECT_EQ(2, newVersion.at(0).element.load());
+    rcu.ReadUnlock(0);
+
+    // reader 1が読み始める前に差し替えた版は解放できる
+    rcu.Update();
+    EXPECT_EQ(2, rcu.GetReclaimedCount());
+    rcu.ReadUnlock(1);
+
+    rcu.Update();
+    EXPECT_EQ(4, rcu.GetReclaimedCount());
+
+    DataSet dataSet(sizeOfData);
+    rcu.CopyTo(dataSet);
+    for(auto& d : dataSet) {
+        EXPECT_EQ(4, d.element.load());
+    }
+}
+
 namespace {
     // 他のスレッドが起きるまで少し待つ
     void Delay(bool valid) {
@@ -329,6 +1139,300 @@ namespace {
             std::this_thread::sleep_for(dur);
         }
     }
+
+    // 一つのスレッドが書き、一つのスレッドが読む、固定長のリングバッファ
+    // 書く側はtail_だけ、読む側はhead_だけを更新するので、ロックもread-modify-writeも要らない
+    template <typename T, size_t Capacity>
+    class SpscRing {
+        static_assert(Capacity && !(Capacity & (Capacity - 1)), "Capacity must be a power of 2");
+    public:
+        using Index = size_t;
+
+        SpscRing(void) = default;
+        virtual ~SpscRing(void) = default;
+        SpscRing(const SpscRing&) = delete;
+        SpscRing& operator =(const SpscRing&) = delete;
+
+        // 書く側のスレッドだけが呼ぶ
+        bool TryPush(const T& value) {
+            return PushBatch(&value, 1) == 1;
+        }
+
+        // 書ける分だけまとめて書き、一度だけ公開する。書いた数を返す。
+        size_t PushBatch(const T* pValues, size_t size) {
+            const auto tail = writer_.tail.load(std::memory_order_relaxed);
+            // 読む側の位置は、手元の写しで足りなければ読み直す
+            if ((tail - writer_.cachedHead + size) > Capacity) {
+                writer_.cachedHead = reader_.head.load(std::memory_order_acquire);
+            }
+
+            const auto available = Capacity - (tail - writer_.cachedHead);
+            const auto actual = std::min(size, available);
+            for(size_t i = 0; i < actual; ++i) {
+                buffer_[(tail + i) & Mask] = pValues[i];
+            }
+
+            if (actual) {
+                // 要素を書いたことが、tail_を進めたことより先に見えるようにする
+                writer_.tail.store(tail + actual, std::memory_order_release);
+            }
+            return actual;
+        }
+
+        // 読む側のスレッドだけが呼ぶ
+        bool TryPop(T& value) {
+            return PopBatch(&value, 1) == 1;
+        }
+
+        // 読める分だけまとめて読み、一度だけ空きを返す。読んだ数を返す。
+        size_t PopBatch(T* pValues, size_t size) {
+            const auto head = reader_.head.load(std::memory_order_relaxed);
+            if ((reader_.cachedTail - head) < size) {
+                reader_.cachedTail = writer_.tail.load(std::memory_order_acquire);
+            }
+
+            const auto actual = std::min(size, static_cast<size_t>(reader_.cachedTail - head));
+            for(size_t i = 0; i < actual; ++i) {
+                pValues[i] = buffer_[(head + i) & Mask];
+            }
+
+            if (actual) {
+                // 要素を読み終えてから、書く側に空きを返す
+                reader_.head.store(head + actual, std::memory_order_release);
+            }
+            return actual;
+        }
+
+        static constexpr size_t GetCapacity(void) {
+            return Capacity;
+        }
+
+    private:
+        static constexpr Index Mask = Capacity - 1;
+
+        // 書く側と読む側の変数を、別のキャッシュラインに置く
+        struct Writer {
+            std::atomic<Index> tail {0};
+            Index cachedHead {0};  // 読む側の位置の写し
+            uint8_t gap[64];
+        };
+
+        struct Reader {
+            std::atomic<Index> head {0};
+            Index cachedTail {0};  // 書く側の位置の写し
+            uint8_t gap[64];
+        };
+
+        uint8_t gap_[64];
+        Writer writer_;
+        Reader reader_;
+        std::array<T, Capacity> buffer_;
+    };
+
+    // 値が変わるまでスレッドを眠らせる
+    // Linuxではfutexを使い、カーネル内で待ち行列を管理する。それ以外ではmutexとcondition variableで代用する。
+    class Futex {
+    public:
+        using Word = int32_t;
+
+        Futex(void) = default;
+        virtual ~Futex(void) = default;
+        Futex(const Futex&) = delete;
+        Futex& operator =(const Futex&) = delete;
+
+        Word Load(void) const {
+            return word_.load(std::memory_order_acquire);
+        }
+
+        // 値がexpectedのままなら、Wakeされるまで眠る。spurious wakeupもある。
+        void Wait(Word expected) {
+#if defined(__linux__)
+            ::syscall(SYS_futex, reinterpret_cast<Word*>(&word_), FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+#else
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [&](void) -> bool { return word_.load() != expected; });
+#endif
+        }
+
+        // 値を変えてから、眠っているスレッドをsize個起こす
+        void Wake(int size) {
+#if defined(__linux__)
+            word_.fetch_add(1, std::memory_order_seq_cst);
+            ::syscall(SYS_futex, reinterpret_cast<Word*>(&word_), FUTEX_WAKE_PRIVATE, size, nullptr, nullptr, 0);
+#else
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                word_.fetch_add(1, std::memory_order_seq_cst);
+            }
+            if (size == 1) {
+                cv_.notify_one();
+            } else {
+                cv_.notify_all();
+            }
+#endif
+        }
+
+    private:
+        static_assert(sizeof(std::atomic<Word>) == sizeof(Word), "futex needs a plain 32-bit word");
+        std::atomic<Word> word_ {0};
+#if !defined(__linux__)
+        std::mutex mutex_;
+        std::condition_variable cv_;
+#endif
+    };
+
+    // 複数のスレッドが書き、複数のスレッドが読む、固定長のキュー(Dmitry Vyukov's bounded MPMC queue)
+    // 要素ごとの通番で、その要素が書けるのか読めるのかを判断するので、書く側と読む側が同じ変数を取り合わない
+    // 取れなければ少しスピンしてから、futexで眠る
+    template <typename T, size_t Capacity>
+    class MpmcQueue {
+        static_assert(Capacity && !(Capacity & (Capacity - 1)), "Capacity must be a power of 2");
+    public:
+        using Index = size_t;
+
+        MpmcQueue(void) {
+            for(Index i = 0; i < Capacity; ++i) {
+                cells_[i].sequence.store(i, std::memory_order_relaxed);
+            }
+        }
+
+        virtual ~MpmcQueue(void) = default;
+        MpmcQueue(const MpmcQueue&) = delete;
+        MpmcQueue& operator =(const MpmcQueue&) = delete;
+
+        bool TryPush(const T& value) {
+            auto pos = enqueuePos_.index.load(std::memory_order_relaxed);
+            for(;;) {
+                auto& cell = cells_[pos & Mask];
+                const auto sequence = cell.sequence.load(std::memory_order_acquire);
+                const auto diff = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(pos);
+                if (!diff) {
+                    // 空いているので、書く権利を取り合う
+                    if (enqueuePos_.index.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                        cell.value = value;
+                        // 読む側に、書き終えたことを知らせる
+                        cell.sequence.store(pos + 1, std::memory_order_release);
+                        wakeIfWaiting(notEmpty_);
+                        return true;
+                    }
+                } else if (diff < 0) {
+                    // 一周前の要素がまだ読まれていない
+                    return false;
+                } else {
+                    // 他のスレッドに先を越された
+                    pos = enqueuePos_.index.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        bool TryPop(T& value) {
+            auto pos = dequeuePos_.index.load(std::memory_order_relaxed);
+            for(;;) {
+                auto& cell = cells_[pos & Mask];
+                const auto sequence = cell.sequence.load(std::memory_order_acquire);
+                const auto diff = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(pos + 1);
+                if (!diff) {
+                    if (dequeuePos_.index.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                        value = cell.value;
+                        // 一周後に書く側が使えるようにする
+                        cell.sequence.store(pos + Capacity, std::memory_order_release);
+                        wakeIfWaiting(notFull_);
+                        return true;
+                    }
+                } else if (diff < 0) {
+                    // まだ書かれていない
+                    return false;
+                } else {
+                    pos = dequeuePos_.index.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        // 空きができるまで待って書く
+        void Push(const T& value) {
+            waitUntil(notFull_, [&](void) -> bool { return TryPush(value); });
+        }
+
+        // 要素が来るまで待って読む
+        void Pop(T& value) {
+            waitUntil(notEmpty_, [&](void) -> bool { return TryPop(value); });
+        }
+
+        // futexで眠った回数
+        uint64_t GetParkCount(void) const {
+            return parkCount_.load();
+        }
+
+        static constexpr size_t GetCapacity(void) {
+            return Capacity;
+        }
+
+    private:
+        static constexpr Index Mask = Capacity - 1;
+        static constexpr unsigned int SpinCount = 64;
+
+        struct Cell {
+            std::atomic<Index> sequence {0};
+            T value {};
+        };
+
+        struct Position {
+            std::atomic<Index> index {0};
+            uint8_t gap[64];
+        };
+
+        // 空くのを待つスレッドと、来るのを待つスレッドを別々に眠らせる
+        struct WaitSet {
+            Futex futex;
+            std::atomic<int> waiters {0};
+            uint8_t gap[64];
+        };
+
+        template <typename Func>
+        void waitUntil(WaitSet& waitSet, Func func) {
+            // 眠るより、少し待つ方が速いことが多い
+            for(unsigned int i = 0; i < SpinCount; ++i) {
+                if (func()) {
+                    return;
+                }
+                CpuRelax();
+            }
+
+            for(;;) {
+                // 状態を確認する前にfutexの値を読んでおけば、確認した後に起こされても眠らない
+                const auto word = waitSet.futex.Load();
+                waitSet.waiters.fetch_add(1, std::memory_order_seq_cst);
+                // funcはacquireで読むだけなので、fetch_addの後に読むとは限らない
+                // 起こす側のfenceと対にして、waitersを増やしてから要素を読むことを保証する
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (func()) {
+                    waitSet.waiters.fetch_sub(1, std::memory_order_relaxed);
+                    return;
+                }
+
+                ++parkCount_;
+                waitSet.futex.Wait(word);
+                waitSet.waiters.fetch_sub(1, std::memory_order_relaxed);
+            }
+        }
+
+        void wakeIfWaiting(WaitSet& waitSet) {
+            // 要素を更新したことと、waitersを読むことの順序を入れ替えない
+            // 待つ側はwaitersを増やしてから要素を読むので、どちらかが必ず相手に気付く
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (waitSet.waiters.load(std::memory_order_relaxed)) {
+                waitSet.futex.Wake(1);
+            }
+        }
+
+        uint8_t gap_[64];
+        Position enqueuePos_;
+        Position dequeuePos_;
+        WaitSet notFull_;
+        WaitSet notEmpty_;
+        std::atomic<uint64_t> parkCount_ {0};
+        std::array<Cell, Capacity> cells_;
+    };
 }
 
 // Condition variableを使って、スレッド間でハンドシェイクする
@@ -430,6 +1534,12 @@ protected:
         SharedValue previousValue_ {0};
     };
 
+    // SenderとReceiverは互いを待つので、同時に動けるだけのスレッドを用意する
+    static WorkStealing::ThreadPool& getThreadPool(void) {
+        static WorkStealing::ThreadPool pool(2);
+        return pool;
+    }
+
     // テストを実行する
     void exec(SharedValue count, bool senderDelayed, bool receiverDelayed) {
         SharedAtomic value {0};     // 初期値を明示的に与える必要がある
@@ -440,18 +1550,188 @@ protected:
         Sender sender(count, senderDelayed, value, received, mx, cvSent, cvReceived);
         Receiver receiver(count, receiverDelayed, value, received, mx, cvSent, cvReceived);
 
-        std::future<SharedValue> futureSender = std::async(std::launch::async, [&](void) -> auto { return sender.Exec(); });
-        std::future<SharedValue> futureReceiver = std::async(std::launch::async, [&](void) -> auto { return receiver.Exec(); });
+        // 起動済のスレッドで実行する
+        auto& pool = getThreadPool();
+        auto futureSender = pool.Submit([&](void) -> auto { return sender.Exec(); });
+        auto futureReceiver = pool.Submit([&](void) -> auto { return receiver.Exec(); });
+        auto actualSender = futureSender.Get();
+        auto actualReceiver = futureReceiver.Get();
+        EXPECT_EQ(count, value.load());
+        EXPECT_EQ(count, actualSender);
+        EXPECT_EQ(count, actualReceiver);
+    }
+
+    // ハンドシェイクの代わりにリングバッファで、1..countを順に送る
+    static constexpr size_t RingCapacity = 1024;
+    using Ring = SpscRing<SharedValue, RingCapacity>;
+    static constexpr size_t MaxBatchSize = 64;
+
+    // 送った数を返す
+    static SharedValue sendToRing(Ring& ring, SharedValue count, bool delayed, size_t batchSize) {
+        Delay(delayed);
+        std::array<SharedValue, MaxBatchSize> batch;
+        SharedValue sent = 0;
+
+        while(sent < count) {
+            const auto size = std::min(batchSize, static_cast<size_t>(count - sent));
+            for(size_t i = 0; i < size; ++i) {
+                batch[i] = sent + static_cast<SharedValue>(i) + 1;
+            }
+
+            // 空きがなければ、受け取られるまで待つ
+            size_t pushed = 0;
+            Backoff backoff;
+            while(pushed < size) {
+                const auto actual = ring.PushBatch(batch.data() + pushed, size - pushed);
+                if (!actual) {
+                    backoff.Pause();
+                }
+                pushed += actual;
+            }
+            sent += static_cast<SharedValue>(size);
+        }
+
+        return sent;
+    }
+
+    // 受け取った数を返す。最後に受け取った値をlastValueに、順序が狂った数をdisorderに返す。
+    static SharedValue receiveFromRing(Ring& ring, SharedValue count, bool delayed, size_t batchSize,
+                                       SharedValue& lastValue, SharedValue& disorder) {
+        Delay(delayed);
+        std::array<SharedValue, MaxBatchSize> batch;
+        SharedValue received = 0;
+        lastValue = 0;
+        disorder = 0;
+
+        Backoff backoff;
+        while(received < count) {
+            const auto size = std::min(batchSize, static_cast<size_t>(count - received));
+            const auto actual = ring.PopBatch(batch.data(), size);
+            if (!actual) {
+                backoff.Pause();
+                continue;
+            }
+
+            backoff = Backoff();
+            for(size_t i = 0; i < actual; ++i) {
+                // 送った順に一つずつ増えるはず
+                if (batch[i] != (lastValue + 1)) {
+                    ++disorder;
+                }
+                lastValue = batch[i];
+            }
+            received += static_cast<SharedValue>(actual);
+        }
+
+        return received;
+    }
+
+    // cpusを指定すれば、送信側をcpus[0]に、受信側をcpus[1]に固定する
+    void execRing(SharedValue count, bool senderDelayed, bool receiverDelayed, size_t batchSize,
+                  const CpuAffinity::CpuSet& cpus = CpuAffinity::CpuSet()) {
+        std::unique_ptr<Ring> pRing = std::make_unique<Ring>();
+        SharedValue lastValue = 0;
+        SharedValue disorder = 0;
+        const auto pinned = (cpus.size() >= 2);
+
+        std::future<SharedValue> futureSender = std::async(std::launch::async, [&](void) -> auto {
+                if (pinned) {
+                    CpuAffinity::PinCurrentThread(cpus.at(0));
+                }
+                return sendToRing(*pRing, count, senderDelayed, batchSize); });
+        std::future<SharedValue> futureReceiver = std::async(std::launch::async, [&](void) -> auto {
+                if (pinned) {
+                    CpuAffinity::PinCurrentThread(cpus.at(1));
+                }
+                return receiveFromRing(*pRing, count, receiverDelayed, batchSize, lastValue, disorder); });
         auto actualSender = futureSender.get();
         auto actualReceiver = futureReceiver.get();
-        EXPECT_EQ(count, value.load());
+        EXPECT_EQ(count, lastValue);
         EXPECT_EQ(count, actualSender);
         EXPECT_EQ(count, actualReceiver);
+        EXPECT_EQ(0, disorder);
+    }
+
+    // N個の送信側からそれぞれcount個ずつ、M個の受信側に送る。受信側にはStopを送って終わらせる。
+    static constexpr SharedValue Stop = 0;
+    static constexpr size_t MpmcCapacity = 16;  // 一杯になって待つことが多いように小さくする
+    using Queue = MpmcQueue<SharedValue, MpmcCapacity>;
+
+    void execMpmc(SharedValue count, size_t sizeOfSenders, size_t sizeOfReceivers) {
+        std::unique_ptr<Queue> pQueue = std::make_unique<Queue>();
+        std::vector<std::vector<SharedValue>> receivedSet(sizeOfReceivers);
+
+        std::vector<std::future<void>> receivers;
+        for(size_t i = 0; i < sizeOfReceivers; ++i) {
+            auto& received = receivedSet.at(i);
+            receivers.push_back(std::async(std::launch::async, [&](void) -> void {
+                        for(;;) {
+                            SharedValue value = Stop;
+                            pQueue->Pop(value);
+                            if (value == Stop) {
+                                break;
+                            }
+                            received.push_back(value);
+                        }
+                    }));
+        }
+
+        std::vector<std::future<void>> senders;
+        for(size_t i = 0; i < sizeOfSenders; ++i) {
+            // 送信側ごとに異なる値を送る
+            const auto base = static_cast<SharedValue>(i) * count;
+            senders.push_back(std::async(std::launch::async, [&pQueue, base, count](void) -> void {
+                        for(SharedValue value = 1; value <= count; ++value) {
+                            pQueue->Push(base + value);
+                        }
+                    }));
+        }
+
+        for(auto& f : senders) {
+            f.get();
+        }
+        const SharedValue stop = Stop;
+        for(size_t i = 0; i < sizeOfReceivers; ++i) {
+            pQueue->Push(stop);
+        }
+        for(auto& f : receivers) {
+            f.get();
+        }
+
+        // 失われたものも、重複したものもない
+        std::vector<SharedValue> allReceived;
+        for(auto& received : receivedSet) {
+            allReceived.insert(allReceived.end(), received.begin(), received.end());
+        }
+        std::sort(allReceived.begin(), allReceived.end());
+        const auto total = count * static_cast<SharedValue>(sizeOfSenders);
+        ASSERT_EQ(static_cast<size_t>(total), allReceived.size());
+        for(SharedValue i = 0; i < total; ++i) {
+            if (allReceived.at(static_cast<size_t>(i)) != (i + 1)) {
+                EXPECT_EQ(i + 1, allReceived.at(static_cast<size_t>(i)));
+                break;
+            }
+        }
+
+        std::cout << sizeOfSenders << " senders, " << sizeOfReceivers << " receivers : "
+                  << pQueue->GetParkCount() << " parks\n";
+    }
+
+    // 1秒当たりに送れたメッセージの数
+    template <typename Func>
+    static long long measureMessagesPerSec(SharedValue count, Func func) {
+        using Clock = std::chrono::steady_clock;
+        const auto start = Clock::now();
+        func();
+        const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start);
+        const auto elapsedUsec = std::max(static_cast<decltype(elapsed.count())>(1), elapsed.count());
+        return static_cast<long long>(count) * 1000000 / elapsedUsec;
     }
 };
 
 TEST_F(TestConditionVariable, Short) {
-    // スレッドを起動-終了して、Delayで待つので(これが長い)、Cygwinだとループ30回で1秒少々掛かる
+    // Delayで待つので(これが長い)、Cygwinだとループ30回で1秒少々掛かる
+    // スレッドはスレッドプールで使いまわすので、起動-終了は最初の一回だけである
     for(int i=0; i<30; ++i) {
         exec(10, true, false);
         exec(10, false, true);
@@ -467,6 +1747,310 @@ TEST_F(TestConditionVariable, Long) {
     }
 }
 
+TEST_F(TestConditionVariable, RingPushPop) {
+    SpscRing<SharedValue, 4> ring;
+    EXPECT_EQ(4, ring.GetCapacity());
+
+    SharedValue value = 0;
+    EXPECT_FALSE(ring.TryPop(value));
+    for(SharedValue i = 1; i <= 4; ++i) {
+        EXPECT_TRUE(ring.TryPush(i));
+    }
+    // 一杯
+    EXPECT_FALSE(ring.TryPush(5));
+
+    EXPECT_TRUE(ring.TryPop(value));
+    EXPECT_EQ(1, value);
+
+    // 空いた分だけ書ける
+    const SharedValue values[] {5, 6, 7};
+    EXPECT_EQ(1, ring.PushBatch(values, 3));
+
+    SharedValue actual[8] {0};
+    ASSERT_EQ(4, ring.PopBatch(actual, 8));
+    for(SharedValue i = 0; i < 4; ++i) {
+        EXPECT_EQ(i + 2, actual[i]);
+    }
+    EXPECT_FALSE(ring.PopBatch(actual, 8));
+}
+
+TEST_F(TestConditionVariable, Ring) {
+    for(int i=0; i<4; ++i) {
+        execRing(10000, false, false, 1);
+        execRing(10000, true, false, 1);
+        execRing(10000, false, true, 1);
+        execRing(10000, true, true, MaxBatchSize);
+    }
+}
+
+TEST_F(TestConditionVariable, RingBatch) {
+    for(size_t batchSize = 1; batchSize <= MaxBatchSize; batchSize *= 2) {
+        // リングバッファの容量で割り切れない数を送る
+        execRing(100003, false, false, batchSize);
+    }
+}
+
+TEST_F(TestConditionVariable, MpmcPushPop) {
+    MpmcQueue<SharedValue, 4> queue;
+    EXPECT_EQ(4, queue.GetCapacity());
+
+    SharedValue value = 0;
+    EXPECT_FALSE(queue.TryPop(value));
+    for(SharedValue i = 1; i <= 4; ++i) {
+        EXPECT_TRUE(queue.TryPush(i));
+    }
+    EXPECT_FALSE(queue.TryPush(5));
+
+    // 一周しても順序は変わらない
+    for(SharedValue i = 1; i <= 6; ++i) {
+        ASSERT_TRUE(queue.TryPop(value));
+        EXPECT_EQ(i, value);
+        queue.Push(i + 4);
+    }
+    EXPECT_EQ(0, queue.GetParkCount());
+}
+
+TEST_F(TestConditionVariable, Mpmc) {
+    const std::vector<std::pair<size_t, size_t>> testCases {{1, 1}, {2, 2}, {4, 2}, {2, 4}, {4, 4}};
+    for(int i=0; i<4; ++i) {
+        for(const auto& test : testCases) {
+            execMpmc(10000, test.first, test.second);
+        }
+    }
+}
+
+TEST_F(TestConditionVariable, RingBenchmark) {
+    constexpr SharedValue handshakeCount = 100000;
+    constexpr SharedValue ringCount = 10000000;
+
+    const auto handshake = measureMessagesPerSec(handshakeCount, [this](void) {
+            exec(handshakeCount, false, false); });
+    std::cout << "Handshake : " << handshake << " messages/sec\n";
+
+    for(size_t batchSize = 1; batchSize <= MaxBatchSize; batchSize *= 8) {
+        const auto ring = measureMessagesPerSec(ringCount, [=](void) {
+                execRing(ringCount, false, false, batchSize); });
+        std::cout << "Ring(batch " << batchSize << ") : " << ring << " messages/sec\n";
+    }
+}
+
+// 送信側と受信側を置く場所を変えて、リングバッファの転送速度を比べる
+TEST_F(TestConditionVariable, RingPlacement) {
+    constexpr SharedValue ringCount = 1000000;
+    const std::vector<CpuAffinity::Placement> placements {
+        CpuAffinity::Placement::SINGLE_CPU, CpuAffinity::Placement::SAME_CORE_SMT,
+        CpuAffinity::Placement::CROSS_CORE, CpuAffinity::Placement::CROSS_SOCKET};
+    CpuAffinity::CpuTopology topology;
+
+    for(auto placement : placements) {
+        const auto cpus = topology.FindPlacement(placement, 2);
+        std::cout << "Ring(" << CpuAffinity::GetPlacementName(placement) << ") : ";
+        if (cpus.empty()) {
+            std::cout << "n/a\n";
+            continue;
+        }
+
+        const auto ring = measureMessagesPerSec(ringCount, [=](void) {
+                execRing(ringCount, false, false, MaxBatchSize, cpus); });
+        std::cout << ring << " messages/sec\n";
+    }
+}
+
+class TestThreadPool : public ::testing::Test {
+protected:
+    using Deque = WorkStealing::ChaseLevDeque<int>;
+    using ThreadPool = WorkStealing::ThreadPool;
+};
+
+TEST_F(TestThreadPool, Deque) {
+    Deque deque(2);
+    EXPECT_EQ(2, deque.GetCapacity());
+    EXPECT_TRUE(deque.IsEmpty());
+
+    int value = 0;
+    EXPECT_FALSE(deque.Pop(value));
+    EXPECT_FALSE(deque.Steal(value));
+
+    // 容量を超えたら大きくする
+    for(int i = 1; i <= 5; ++i) {
+        deque.Push(i);
+    }
+    EXPECT_EQ(8, deque.GetCapacity());
+
+    // 持ち主は新しいものから、他のスレッドは古いものから取る
+    ASSERT_TRUE(deque.Pop(value));
+    EXPECT_EQ(5, value);
+    ASSERT_TRUE(deque.Steal(value));
+    EXPECT_EQ(1, value);
+    ASSERT_TRUE(deque.Pop(value));
+    EXPECT_EQ(4, value);
+    ASSERT_TRUE(deque.Steal(value));
+    EXPECT_EQ(2, value);
+    ASSERT_TRUE(deque.Pop(value));
+    EXPECT_EQ(3, value);
+    EXPECT_FALSE(deque.Pop(value));
+    EXPECT_TRUE(deque.IsEmpty());
+}
+
+// 持ち主が積んで取り出す間に、他のスレッドが盗んでも、どの要素もちょうど一回だけ取り出される
+TEST_F(TestThreadPool, DequeSteal) {
+    constexpr int count = 100000;
+    constexpr int sizeOfThieves = 3;
+    Deque deque;
+    std::atomic<bool> finished {false};
+    std::vector<std::vector<int>> stolenSet(sizeOfThieves);
+
+    std::vector<std::thread> thieves;
+    for(int i = 0; i < sizeOfThieves; ++i) {
+        auto& stolen = stolenSet.at(static_cast<size_t>(i));
+        thieves.emplace_back([&](void) {
+                int value = 0;
+                while(!finished.load() || !deque.IsEmpty()) {
+                    if (deque.Steal(value)) {
+                        stolen.push_back(value);
+                    } else {
+                        std::this_thread::yield();
+                    }
+                }
+            });
+    }
+
+    std::vector<int> popped;
+    int value = 0;
+    for(int i = 0; i < count; ++i) {
+        deque.Push(i);
+        // 時々取り出す
+        if ((i % 3) == 0 && deque.Pop(value)) {
+            popped.push_back(value);
+        }
+    }
+    while(deque.Pop(value)) {
+        popped.push_back(value);
+    }
+
+    finished.store(true);
+    for(auto& t : thieves) {
+        t.join();
+    }
+
+    for(auto& stolen : stolenSet) {
+        popped.insert(popped.end(), stolen.begin(), stolen.end());
+    }
+    std::sort(popped.begin(), popped.end());
+    ASSERT_EQ(static_cast<size_t>(count), popped.size());
+    for(int i = 0; i < count; ++i) {
+        if (popped.at(static_cast<size_t>(i)) != i) {
+            EXPECT_EQ(i, popped.at(static_cast<size_t>(i)));
+            break;
+        }
+    }
+}
+
+TEST_F(TestThreadPool, Submit) {
+    for(ThreadPool::SizeOfThreads sizeOfThreads = 0; sizeOfThreads <= 3; ++sizeOfThreads) {
+        ThreadPool pool(sizeOfThreads);
+        EXPECT_EQ(sizeOfThreads, pool.GetSizeOfThreads());
+
+        std::vector<WorkStealing::Future<int>> futureSet;
+        for(int i = 0; i < 100; ++i) {
+            futureSet.push_back(pool.Submit([=](void) -> int { return i * 2; }));
+        }
+
+        int i = 0;
+        for(auto& f : futureSet) {
+            EXPECT_EQ(i * 2, f.Get());
+            EXPECT_TRUE(f.IsReady());
+            ++i;
+        }
+
+        // タスクが投げた例外は、結果を受け取るときに投げ直す
+        auto future = pool.Submit([](void) -> void { throw std::runtime_error("task"); });
+        EXPECT_THROW(future.Get(), std::runtime_error);
+    }
+}
+
+// タスクの中からタスクを積んで待っても、待つ間に他のタスクを実行するのでデッドロックしない
+TEST_F(TestThreadPool, Nested) {
+    ThreadPool pool(1);
+    std::function<long long(int)> fibonacci = [&](int n) -> long long {
+        if (n < 2) {
+            return n;
+        }
+        auto future = pool.Submit([&, n](void) -> long long { return fibonacci(n - 1); });
+        const auto right = fibonacci(n - 2);
+        return future.Get() + right;
+    };
+
+    auto future = pool.Submit([&](void) -> long long { return fibonacci(20); });
+    EXPECT_EQ(6765, future.Get());
+}
+
+// ワーカスレッド以外から待つと、タスクを実行せずに眠る
+TEST_F(TestThreadPool, WaitFromOthers) {
+    ThreadPool pool(1);
+    EXPECT_FALSE(pool.IsWorker());
+    const auto mainId = std::this_thread::get_id();
+
+    // 待ち始めてから終わるタスクを混ぜる
+    std::vector<WorkStealing::Future<std::thread::id>> futureSet;
+    for(int i = 0; i < 100; ++i) {
+        futureSet.push_back(pool.Submit([&pool, i](void) -> std::thread::id {
+                    EXPECT_TRUE(pool.IsWorker());
+                    if ((i % 10) == 0) {
+                        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                    }
+                    return std::this_thread::get_id();
+                }));
+    }
+
+    for(auto& f : futureSet) {
+        EXPECT_NE(mainId, f.Get());
+    }
+
+    // ワーカスレッドが無ければ、待つスレッドが実行する
+    ThreadPool emptyPool(0);
+    EXPECT_EQ(mainId, emptyPool.Submit([](void) { return std::this_thread::get_id(); }).Get());
+}
+
+// タスクを起動して結果を受け取るまでの時間を、std::asyncと比べる
+TEST_F(TestThreadPool, SpawnLatency) {
+    constexpr int count = 10000;
+    using Clock = std::chrono::steady_clock;
+    auto toNsec = [](Clock::duration elapsed) -> long long {
+        return static_cast<long long>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()) / count;
+    };
+
+    int sum = 0;
+    auto start = Clock::now();
+    for(int i = 0; i < count; ++i) {
+        sum += std::async(std::launch::async, [=](void) -> int { return i; }).get();
+    }
+    const auto asyncNsec = toNsec(Clock::now() - start);
+
+    ThreadPool pool(std::max(std::thread::hardware_concurrency(), 1u));
+    start = Clock::now();
+    for(int i = 0; i < count; ++i) {
+        sum -= pool.Submit([=](void) -> int { return i; }).Get();
+    }
+    const auto poolNsec = toNsec(Clock::now() - start);
+
+    // 多数のタスクをまとめて積む
+    std::vector<WorkStealing::Future<int>> futureSet;
+    futureSet.reserve(count);
+    start = Clock::now();
+    for(int i = 0; i < count; ++i) {
+        futureSet.push_back(pool.Submit([=](void) -> int { return i; }));
+    }
+    for(auto& f : futureSet) {
+        sum -= f.Get();
+    }
+    const auto batchNsec = toNsec(Clock::now() - start);
+
+    std::cout << "Spawn latency : std::async " << asyncNsec << " nsec, pool " << poolNsec
+              << " nsec, pool(batch) " << batchNsec << " nsec per task\n";
+    EXPECT_EQ(-(count - 1) * count / 2, sum);
+}
+
 /*
 Local Variables:
 mode: c++
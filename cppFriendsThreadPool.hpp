@@ -0,0 +1,485 @@
+// ワーカスレッドごとにChase-Lev dequeを持つ、work-stealingスレッドプール
+#ifndef CPPFRIENDS_CPPFRIENDS_THREAD_POOL_HPP
+#define CPPFRIENDS_CPPFRIENDS_THREAD_POOL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <boost/optional.hpp>
+
+namespace WorkStealing {
+    // 持ち主のスレッドだけが底に積んで底から取り出し(LIFO)、他のスレッドは天井から盗む(FIFO)
+    // 持ち主と盗む側は、最後の一つを取り合うときだけCompare and Swapする
+    // D. Chase and Y. Lev, "Dynamic Circular Work-Stealing Deque", SPAA 2005
+    // N. M. Le et al., "Correct and Efficient Work-Stealing for Weak Memory Models", PPoPP 2013
+    template <typename T>
+    class ChaseLevDeque {
+        static_assert(std::is_trivially_copyable<T>::value, "T must be trivially copyable");
+    public:
+        using Index = int64_t;
+        static constexpr size_t DefaultCapacity = 64;
+
+        explicit ChaseLevDeque(size_t capacity = DefaultCapacity) {
+            // 容量は2のべき乗にする
+            size_t actual = 1;
+            while(actual < capacity) {
+                actual <<= 1;
+            }
+            arraySet_.push_back(std::make_unique<Array>(actual));
+            array_.store(arraySet_.back().get());
+        }
+
+        virtual ~ChaseLevDeque(void) = default;
+        ChaseLevDeque(const ChaseLevDeque&) = delete;
+        ChaseLevDeque& operator =(const ChaseLevDeque&) = delete;
+
+        // 持ち主だけが呼ぶ
+        void Push(T value) {
+            const auto bottom = bottom_.load(std::memory_order_relaxed);
+            const auto top = top_.load(std::memory_order_acquire);
+            auto pArray = array_.load(std::memory_order_relaxed);
+            if ((bottom - top) >= static_cast<Index>(pArray->capacity)) {
+                pArray = grow(pArray, top, bottom);
+            }
+
+            pArray->Put(bottom, value);
+            // 要素を書いたことが、底を進めたことより先に見えるようにする
+            bottom_.store(bottom + 1, std::memory_order_seq_cst);
+        }
+
+        // 持ち主だけが呼ぶ
+        bool Pop(T& value) {
+            const auto bottom = bottom_.load(std::memory_order_relaxed) - 1;
+            auto pArray = array_.load(std::memory_order_relaxed);
+            // 底を下げてから天井を読む。盗む側は天井を上げてから底を読む。
+            bottom_.store(bottom, std::memory_order_seq_cst);
+            auto top = top_.load(std::memory_order_seq_cst);
+
+            if (top > bottom) {
+                // 空だった
+                bottom_.store(bottom + 1, std::memory_order_relaxed);
+                return false;
+            }
+
+            value = pArray->Get(bottom);
+            if (top == bottom) {
+                // 最後の一つは盗む側と取り合う
+                const bool won = top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst,
+                                                              std::memory_order_relaxed);
+                bottom_.store(bottom + 1, std::memory_order_relaxed);
+                return won;
+            }
+
+            return true;
+        }
+
+        // どのスレッドからも呼べる。他のスレッドと取り合って負けたときもfalseを返す。
+        bool Steal(T& value) {
+            auto top = top_.load(std::memory_order_seq_cst);
+            const auto bottom = bottom_.load(std::memory_order_seq_cst);
+            if (top >= bottom) {
+                return false;
+            }
+
+            // 持ち主が配列を大きくしても、古い配列は残っているので読める
+            auto pArray = array_.load(std::memory_order_acquire);
+            value = pArray->Get(top);
+            return top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+        }
+
+        // 他のスレッドが読み書きしている最中は目安である
+        bool IsEmpty(void) const {
+            return bottom_.load(std::memory_order_relaxed) <= top_.load(std::memory_order_relaxed);
+        }
+
+        size_t GetCapacity(void) const {
+            return array_.load(std::memory_order_relaxed)->capacity;
+        }
+
+    private:
+        struct Array {
+            explicit Array(size_t size) : capacity(size), mask(size - 1), buffer(new std::atomic<T>[size]) {}
+            T Get(Index index) const {
+                return buffer[static_cast<size_t>(index) & mask].load(std::memory_order_relaxed);
+            }
+            void Put(Index index, T value) {
+                buffer[static_cast<size_t>(index) & mask].store(value, std::memory_order_relaxed);
+            }
+            size_t capacity {0};
+            size_t mask {0};
+            std::unique_ptr<std::atomic<T>[]> buffer;
+        };
+
+        // 持ち主だけが呼ぶ。盗む側が古い配列を読んでいるかもしれないので、古い配列はdequeと共に解放する。
+        Array* grow(Array* pArray, Index top, Index bottom) {
+            arraySet_.push_back(std::make_unique<Array>(pArray->capacity * 2));
+            auto pNewArray = arraySet_.back().get();
+            for(auto i = top; i < bottom; ++i) {
+                pNewArray->Put(i, pArray->Get(i));
+            }
+            array_.store(pNewArray, std::memory_order_release);
+            return pNewArray;
+        }
+
+        // 持ち主と盗む側が同じキャッシュラインを取り合わないように離す
+        std::atomic<Index> top_ {0};
+        uint8_t gap1_[64];
+        std::atomic<Index> bottom_ {0};
+        uint8_t gap2_[64];
+        std::atomic<Array*> array_ {nullptr};
+        std::vector<std::unique_ptr<Array>> arraySet_;
+    };
+
+    class ThreadPool;
+
+    // Submitの結果を受け取る
+    // 終わったかどうかはatomic変数で調べ、待っているスレッドがいるときだけcondition variableで起こす
+    class FutureStateBase {
+    public:
+        virtual ~FutureStateBase(void) = default;
+
+        bool IsReady(void) const {
+            return ready_.load(std::memory_order_acquire);
+        }
+
+        // 終わるまで眠る
+        void Wait(void) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            // 終わらせる側はready_を書いてからwaiting_を読むので、どちらかが必ず相手に気付く
+            waiting_.store(true, std::memory_order_seq_cst);
+            cv_.wait(lock, [this](void) -> bool { return ready_.load(std::memory_order_seq_cst); });
+        }
+
+    protected:
+        void setReady(void) {
+            ready_.store(true, std::memory_order_seq_cst);
+            if (waiting_.load(std::memory_order_seq_cst)) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                cv_.notify_all();
+            }
+        }
+
+        std::exception_ptr exception_;
+
+    private:
+        std::atomic<bool> ready_ {false};
+        std::atomic<bool> waiting_ {false};
+        std::mutex mutex_;
+        std::condition_variable cv_;
+    };
+
+    template <typename Result>
+    class FutureState : public FutureStateBase {
+    public:
+        template <typename Func>
+        void Run(Func& func) {
+            try {
+                value_ = func();
+            } catch(...) {
+                exception_ = std::current_exception();
+            }
+            setReady();
+        }
+
+        Result Get(void) {
+            if (exception_) {
+                std::rethrow_exception(exception_);
+            }
+            return std::move(*value_);
+        }
+
+    private:
+        boost::optional<Result> value_;
+    };
+
+    template <>
+    class FutureState<void> : public FutureStateBase {
+    public:
+        template <typename Func>
+        void Run(Func& func) {
+            try {
+                func();
+            } catch(...) {
+                exception_ = std::current_exception();
+            }
+            setReady();
+        }
+
+        void Get(void) {
+            if (exception_) {
+                std::rethrow_exception(exception_);
+            }
+        }
+    };
+
+    template <typename Result>
+    class Future {
+    public:
+        Future(ThreadPool& pool, std::shared_ptr<FutureState<Result>> pState) : pPool_(&pool), pState_(pState) {}
+        virtual ~Future(void) = default;
+        Future(Future&&) = default;
+        Future& operator =(Future&&) = default;
+
+        bool IsReady(void) const {
+            return pState_->IsReady();
+        }
+
+        // 終わるまで待つ
+        // ワーカスレッドは待つ代わりにプールのタスクを実行するので、ワーカスレッドから待ってもデッドロックしない
+        // 他のスレッドはタスクを実行せずに眠る。ただしワーカスレッドが無いプールでは、待つスレッドが実行する。
+        void Wait(void);
+
+        // タスクが投げた例外は、ここで投げ直す
+        Result Get(void) {
+            Wait();
+            return pState_->Get();
+        }
+
+    private:
+        ThreadPool* pPool_ {nullptr};
+        std::shared_ptr<FutureState<Result>> pState_;
+    };
+
+    class ThreadPool {
+    public:
+        using Task = std::function<void(void)>;
+        using SizeOfThreads = size_t;
+
+        // スレッド数が0なら、タスクはすべてHelpを呼んだスレッドが実行する
+        explicit ThreadPool(SizeOfThreads sizeOfThreads) {
+            for(SizeOfThreads index = 0; index < std::max(sizeOfThreads, static_cast<SizeOfThreads>(1)); ++index) {
+                dequeSet_.push_back(std::make_unique<TaskDeque>());
+            }
+            for(SizeOfThreads index = 0; index < sizeOfThreads; ++index) {
+                threadSet_.emplace_back([=](void) { run(index); });
+            }
+        }
+
+        virtual ~ThreadPool(void) {
+            {
+                std::lock_guard<std::mutex> lock(sleepMutex_);
+                stopped_ = true;
+            }
+            cvSleep_.notify_all();
+
+            for(auto& t : threadSet_) {
+                t.join();
+            }
+
+            // 実行されなかったタスクを捨てる
+            TaskBase* pTask = nullptr;
+            for(auto& pDeque : dequeSet_) {
+                while(pDeque->Pop(pTask)) {
+                    delete pTask;
+                }
+            }
+            for(auto p : injectedTasks_) {
+                delete p;
+            }
+        }
+
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator =(const ThreadPool&) = delete;
+
+        SizeOfThreads GetSizeOfThreads(void) const {
+            return threadSet_.size();
+        }
+
+        // 結果を受け取らないタスクを積む
+        void Push(Task task) {
+            push(new FunctionTask<Task>(std::move(task)));
+        }
+
+        // 結果を受け取るタスクを積む
+        template <typename Func>
+        auto Submit(Func func) -> Future<decltype(func())> {
+            using Result = decltype(func());
+            auto pState = std::make_shared<FutureState<Result>>();
+            auto body = [pState, func](void) mutable { pState->Run(func); };
+            push(new FunctionTask<decltype(body)>(std::move(body)));
+            return Future<Result>(*this, pState);
+        }
+
+        // 呼び出したスレッドが、このプールのワーカスレッドか
+        bool IsWorker(void) const {
+            return getContext().pPool == this;
+        }
+
+        // 待っているスレッドが、ただ待つ代わりにタスクを一つ実行する
+        bool Help(void) {
+            const auto& context = getContext();
+            TaskBase* pTask = nullptr;
+            const bool found = (context.pPool == this) ? popForWorker(context.index, pTask) : popForOthers(pTask);
+            if (!found) {
+                return false;
+            }
+
+            execute(pTask);
+            return true;
+        }
+
+    private:
+        class TaskBase {
+        public:
+            virtual ~TaskBase(void) = default;
+            virtual void Run(void) = 0;
+        };
+
+        template <typename Func>
+        class FunctionTask : public TaskBase {
+        public:
+            explicit FunctionTask(Func&& func) : func_(std::move(func)) {}
+            virtual ~FunctionTask(void) = default;
+            virtual void Run(void) override {
+                func_();
+            }
+        private:
+            Func func_;
+        };
+
+        using TaskDeque = ChaseLevDeque<TaskBase*>;
+
+        // ワーカスレッドなら、どのプールの何番目か
+        struct WorkerContext {
+            ThreadPool* pPool {nullptr};
+            SizeOfThreads index {0};
+        };
+
+        // C++14ではstaticメンバ変数をヘッダで定義できないので、関数内のstatic変数にする
+        static WorkerContext& getContext(void) {
+            static thread_local WorkerContext context;
+            return context;
+        }
+
+        void push(TaskBase* pTask) {
+            // 取り出す前に数を減らさないように、積む前に数える
+            queuedTasks_.fetch_add(1, std::memory_order_seq_cst);
+
+            const auto& context = getContext();
+            if (context.pPool == this) {
+                // ワーカスレッドは自分のdequeに積む
+                dequeSet_.at(context.index)->Push(pTask);
+            } else {
+                // dequeの持ち主以外は積めないので、共有のキューに入れる
+                std::lock_guard<std::mutex> lock(injectionMutex_);
+                injectedTasks_.push_back(pTask);
+            }
+
+            // 眠っているワーカスレッドがいるときだけ起こす
+            // 眠る側はsleepers_を増やしてからqueuedTasks_を読むので、どちらかが必ず相手に気付く
+            if (sleepers_.load(std::memory_order_seq_cst)) {
+                std::lock_guard<std::mutex> lock(sleepMutex_);
+                cvSleep_.notify_one();
+            }
+        }
+
+        void run(SizeOfThreads index) {
+            auto& context = getContext();
+            context.pPool = this;
+            context.index = index;
+
+            for(;;) {
+                TaskBase* pTask = nullptr;
+                if (popForWorker(index, pTask)) {
+                    execute(pTask);
+                    continue;
+                }
+
+                std::unique_lock<std::mutex> lock(sleepMutex_);
+                sleepers_.fetch_add(1, std::memory_order_seq_cst);
+                cvSleep_.wait(lock, [&](void) -> bool {
+                        return stopped_ || (queuedTasks_.load(std::memory_order_seq_cst) > 0); });
+                sleepers_.fetch_sub(1, std::memory_order_relaxed);
+                if (stopped_) {
+                    break;
+                }
+            }
+        }
+
+        // 自分のdeque(キャッシュに残っている)、共有のキュー、他人のdeque(大きな仕事が残っている)の順に探す
+        bool popForWorker(SizeOfThreads index, TaskBase*& pTask) {
+            if (dequeSet_.at(index)->Pop(pTask)) {
+                return true;
+            }
+            return popInjected(pTask) || steal(index + 1, pTask);
+        }
+
+        bool popForOthers(TaskBase*& pTask) {
+            return popInjected(pTask) || steal(nextVictim_++, pTask);
+        }
+
+        bool popInjected(TaskBase*& pTask) {
+            std::lock_guard<std::mutex> lock(injectionMutex_);
+            if (injectedTasks_.empty()) {
+                return false;
+            }
+
+            pTask = injectedTasks_.front();
+            injectedTasks_.pop_front();
+            return true;
+        }
+
+        bool steal(SizeOfThreads first, TaskBase*& pTask) {
+            const auto size = dequeSet_.size();
+            for(SizeOfThreads i = 0; i < size; ++i) {
+                if (dequeSet_.at((first + i) % size)->Steal(pTask)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void execute(TaskBase* pTask) {
+            queuedTasks_.fetch_sub(1, std::memory_order_relaxed);
+            std::unique_ptr<TaskBase> pOwned(pTask);
+            pOwned->Run();
+        }
+
+        std::vector<std::unique_ptr<TaskDeque>> dequeSet_;
+        std::vector<std::thread> threadSet_;
+        std::mutex injectionMutex_;
+        std::deque<TaskBase*> injectedTasks_;
+        std::mutex sleepMutex_;
+        std::condition_variable cvSleep_;
+        std::atomic<size_t> queuedTasks_ {0};
+        std::atomic<size_t> sleepers_ {0};
+        std::atomic<size_t> nextVictim_ {0};
+        bool stopped_ {false};
+    };
+
+    template <typename Result>
+    void Future<Result>::Wait(void) {
+        // ワーカスレッド以外がタスクを実行すると、計測中のスレッドが増えたり、
+        // タスクがそのスレッドのaffinityを変えたりする
+        const bool helping = pPool_->IsWorker() || !pPool_->GetSizeOfThreads();
+        while(!pState_->IsReady()) {
+            if (helping && pPool_->Help()) {
+                continue;
+            }
+
+            // 実行できるタスクが無ければ、このタスクは他のスレッドが実行中である
+            pState_->Wait();
+        }
+    }
+}
+
+#endif // CPPFRIENDS_CPPFRIENDS_THREAD_POOL_HPP
+
+/*
+Local Variables:
+mode: c++
+coding: utf-8-dos
+tab-width: nil
+c-file-style: "stroustrup"
+End:
+*/